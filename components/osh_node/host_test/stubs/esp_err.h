@@ -0,0 +1,26 @@
+/*
+ * @Author      : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @Date        : 2024-07-01 20:10:00
+ * @LastEditors : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @LastEditTime: 2024-07-01 20:10:00
+ * @FilePath    : /OpenSmartHome/components/osh_node/host_test/stubs/esp_err.h
+ * @Description : error codes of ESP-IDF used by osh_node
+ * Copyright (c) 2024 by Zheng, Yang, All Rights Reserved.
+ */
+#pragma once
+
+#include <stdint.h>
+
+typedef int esp_err_t;
+
+#define ESP_OK                  0
+#define ESP_FAIL                -1
+#define ESP_ERR_NO_MEM          0x101
+#define ESP_ERR_INVALID_ARG     0x102
+#define ESP_ERR_INVALID_STATE   0x103
+#define ESP_ERR_INVALID_SIZE    0x104
+#define ESP_ERR_NOT_FOUND       0x105
+#define ESP_ERR_NOT_SUPPORTED   0x106
+#define ESP_ERR_TIMEOUT         0x107
+
+const char *esp_err_to_name(esp_err_t code);
@@ -0,0 +1,14 @@
+/*
+ * @Author      : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @Date        : 2024-07-01 20:10:00
+ * @LastEditors : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @LastEditTime: 2024-07-01 20:10:00
+ * @FilePath    : /OpenSmartHome/components/osh_node/host_test/stubs/esp_event.h
+ * @Description : event base of ESP-IDF
+ * Copyright (c) 2024 by Zheng, Yang, All Rights Reserved.
+ */
+#pragma once
+
+#include "esp_err.h"
+
+typedef const char *esp_event_base_t;
@@ -0,0 +1,18 @@
+/*
+ * @Author      : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @Date        : 2024-07-01 20:10:00
+ * @LastEditors : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @LastEditTime: 2024-07-01 20:10:00
+ * @FilePath    : /OpenSmartHome/components/osh_node/host_test/stubs/esp_log.h
+ * @Description : logging to stdout
+ * Copyright (c) 2024 by Zheng, Yang, All Rights Reserved.
+ */
+#pragma once
+
+#include <stdio.h>
+
+#define ESP_LOGE(tag, fmt, ...) printf("E %s: " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) printf("W %s: " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...) printf("I %s: " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGD(tag, fmt, ...) do { if (0) printf(fmt, ##__VA_ARGS__); } while (0)
+#define ESP_LOGV(tag, fmt, ...) do { if (0) printf(fmt, ##__VA_ARGS__); } while (0)
@@ -0,0 +1,14 @@
+/*
+ * @Author      : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @Date        : 2024-07-01 20:10:00
+ * @LastEditors : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @LastEditTime: 2024-07-01 20:10:00
+ * @FilePath    : /OpenSmartHome/components/osh_node/host_test/stubs/esp_timer.h
+ * @Description : microseconds since start on monotonic clock
+ * Copyright (c) 2024 by Zheng, Yang, All Rights Reserved.
+ */
+#pragma once
+
+#include <stdint.h>
+
+int64_t esp_timer_get_time(void);
@@ -0,0 +1,45 @@
+/*
+ * @Author      : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @Date        : 2024-07-01 20:10:00
+ * @LastEditors : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @LastEditTime: 2024-07-01 20:10:00
+ * @FilePath    : /OpenSmartHome/components/osh_node/host_test/stubs/freertos/FreeRTOS.h
+ * @Description : FreeRTOS on pthreads, just what osh_node uses
+ * Copyright (c) 2024 by Zheng, Yang, All Rights Reserved.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "sdkconfig.h"
+#include "esp_err.h"
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+
+#define pdTRUE                  1
+#define pdFALSE                 0
+#define pdPASS                  pdTRUE
+#define pdFAIL                  pdFALSE
+#define portMAX_DELAY           ((TickType_t)0xFFFFFFFFUL)
+#define configTICK_RATE_HZ      100
+#define portTICK_PERIOD_MS      (1000 / configTICK_RATE_HZ)
+#define pdMS_TO_TICKS(ms)       ((TickType_t)(((uint64_t)(ms) * configTICK_RATE_HZ) / 1000))
+#define portYIELD_FROM_ISR(x)   (void)(x)
+#define IRAM_ATTR
+
+/* one lock for all critical sections, nests like on target */
+typedef struct { int unused; } portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED    {0}
+
+void host_critical_enter(void);
+void host_critical_exit(void);
+
+#define portENTER_CRITICAL(m)           host_critical_enter()
+#define portEXIT_CRITICAL(m)            host_critical_exit()
+#define portENTER_CRITICAL_SAFE(m)      host_critical_enter()
+#define portEXIT_CRITICAL_SAFE(m)       host_critical_exit()
@@ -0,0 +1,26 @@
+/*
+ * @Author      : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @Date        : 2024-07-01 20:10:00
+ * @LastEditors : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @LastEditTime: 2024-07-01 20:10:00
+ * @FilePath    : /OpenSmartHome/components/osh_node/host_test/stubs/freertos/list.h
+ * @Description : list types of FreeRTOS, declarations only
+ * Copyright (c) 2024 by Zheng, Yang, All Rights Reserved.
+ */
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+
+typedef struct xLIST_ITEM {
+    TickType_t                      xItemValue;
+    struct xLIST_ITEM              *pxNext;
+    struct xLIST_ITEM              *pxPrevious;
+    void                           *pvOwner;
+    void                           *pvContainer;
+} ListItem_t;
+
+typedef struct xLIST {
+    UBaseType_t                     uxNumberOfItems;
+    ListItem_t                     *pxIndex;
+    ListItem_t                      xListEnd;
+} List_t;
@@ -0,0 +1,275 @@
+/*
+ * @Author      : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @Date        : 2024-07-01 20:10:00
+ * @LastEditors : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @LastEditTime: 2024-07-01 20:10:00
+ * @FilePath    : /OpenSmartHome/components/osh_node/host_test/stubs/host_rtos.c
+ * @Description : FreeRTOS and esp_timer on pthreads for host tests
+ * Copyright (c) 2024 by Zheng, Yang, All Rights Reserved.
+ */
+
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/timers.h"
+#include "esp_timer.h"
+
+/* counting semaphore, mutex is one with count 1 */
+typedef struct {
+    pthread_mutex_t                lock;
+    pthread_cond_t                 cond;
+    UBaseType_t                   count;
+} host_sem_t;
+
+typedef struct {
+    pthread_t                    thread;
+    TaskFunction_t                 func;
+    void                           *arg;
+} host_task_t;
+
+/* one shot or reloaded, due on monotonic clock */
+typedef struct host_timer_stru {
+    struct host_timer_stru        *next;
+    TimerCallbackFunction_t    callback;
+    void                            *id;
+    TickType_t                   period;
+    bool                         reload;
+    bool                         active;
+    uint64_t                     due_us;
+} host_timer_t;
+
+static pthread_mutex_t g_critical = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+static pthread_mutex_t g_timer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_timer_cond;
+static pthread_once_t g_timer_once = PTHREAD_ONCE_INIT;
+static host_timer_t *g_timers = NULL;
+static __thread host_task_t *g_current = NULL;
+
+/* monotonic clock */
+static uint64_t host_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static void *host_task_main(void *arg) {
+    g_current = (host_task_t *)arg;
+    g_current->func(g_current->arg);
+    return NULL;
+}
+
+/* timer service, callbacks run one at a time without lock */
+static void *host_timer_main(void *arg) {
+    pthread_mutex_lock(&g_timer_lock);
+    while (1) {
+        host_timer_t *first = NULL;
+        for (host_timer_t *t = g_timers; NULL != t; t = t->next) {
+            if (t->active && (NULL == first || t->due_us < first->due_us)) first = t;
+        }
+        if (NULL == first) {
+            pthread_cond_wait(&g_timer_cond, &g_timer_lock);
+            continue;
+        }
+        uint64_t now = host_now_us();
+        if (now < first->due_us) {
+            struct timespec until = {first->due_us / 1000000, (first->due_us % 1000000) * 1000};
+            pthread_cond_timedwait(&g_timer_cond, &g_timer_lock, &until);
+            continue;
+        }
+        first->active = first->reload;
+        first->due_us += (uint64_t)first->period * (1000000 / configTICK_RATE_HZ);
+        pthread_mutex_unlock(&g_timer_lock);
+        first->callback(first);
+        pthread_mutex_lock(&g_timer_lock);
+    }
+    return NULL;
+}
+
+static void host_timer_start(void) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&g_timer_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_t thread;
+    pthread_create(&thread, NULL, host_timer_main, NULL);
+    pthread_detach(thread);
+}
+
+/** -------------------------------
+ *            functions
+ *  -------------------------------
+*/
+
+const char *esp_err_to_name(esp_err_t code) {
+    return (ESP_OK == code) ? "ESP_OK" : "ERROR";
+}
+
+int64_t esp_timer_get_time(void) {
+    return (int64_t)host_now_us();
+}
+
+void host_critical_enter(void) {
+    pthread_mutex_lock(&g_critical);
+}
+
+void host_critical_exit(void) {
+    pthread_mutex_unlock(&g_critical);
+}
+
+BaseType_t xTaskCreate(TaskFunction_t func, const char *name, uint32_t stack,
+                       void *arg, UBaseType_t prio, TaskHandle_t *handle) {
+    host_task_t *task = calloc(1, sizeof(host_task_t));
+    if (NULL == task) return pdFAIL;
+    task->func = func;
+    task->arg = arg;
+    if (0 != pthread_create(&task->thread, NULL, host_task_main, task)) {
+        free(task);
+        return pdFAIL;
+    }
+    pthread_detach(task->thread);
+    if (NULL != handle) *handle = task;
+    return pdPASS;
+}
+
+/* only a task deleting itself */
+void vTaskDelete(TaskHandle_t task) {
+    if (NULL != task && task != g_current) return;
+    free(g_current);
+    g_current = NULL;
+    pthread_exit(NULL);
+}
+
+void vTaskDelay(TickType_t ticks) {
+    struct timespec ts = {ticks / configTICK_RATE_HZ,
+                          (long)(ticks % configTICK_RATE_HZ) * (1000000000L / configTICK_RATE_HZ)};
+    nanosleep(&ts, NULL);
+}
+
+TickType_t xTaskGetTickCount(void) {
+    return (TickType_t)(host_now_us() / (1000000 / configTICK_RATE_HZ));
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void) {
+    return g_current;
+}
+
+static SemaphoreHandle_t host_sem_create(UBaseType_t count) {
+    host_sem_t *sem = calloc(1, sizeof(host_sem_t));
+    if (NULL == sem) return NULL;
+    pthread_mutex_init(&sem->lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&sem->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    sem->count = count;
+    return sem;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void) {
+    return host_sem_create(1);
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void) {
+    return host_sem_create(0);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t handle, TickType_t ticks) {
+    host_sem_t *sem = (host_sem_t *)handle;
+    struct timespec until;
+    clock_gettime(CLOCK_MONOTONIC, &until);
+    uint64_t ns = (uint64_t)until.tv_nsec + (uint64_t)ticks * (1000000000ULL / configTICK_RATE_HZ);
+    until.tv_sec += ns / 1000000000ULL;
+    until.tv_nsec = ns % 1000000000ULL;
+
+    BaseType_t res = pdTRUE;
+    pthread_mutex_lock(&sem->lock);
+    while (0 == sem->count) {
+        if (portMAX_DELAY == ticks) {
+            pthread_cond_wait(&sem->cond, &sem->lock);
+        } else if (0 == ticks ||
+                   ETIMEDOUT == pthread_cond_timedwait(&sem->cond, &sem->lock, &until)) {
+            res = pdFALSE;
+            break;
+        }
+    }
+    if (pdTRUE == res) sem->count--;
+    pthread_mutex_unlock(&sem->lock);
+    return res;
+}
+
+/* binary and mutex saturate at 1 */
+BaseType_t xSemaphoreGive(SemaphoreHandle_t handle) {
+    host_sem_t *sem = (host_sem_t *)handle;
+    BaseType_t res = pdFALSE;
+    pthread_mutex_lock(&sem->lock);
+    if (0 == sem->count) {
+        sem->count = 1;
+        pthread_cond_signal(&sem->cond);
+        res = pdTRUE;
+    }
+    pthread_mutex_unlock(&sem->lock);
+    return res;
+}
+
+BaseType_t xSemaphoreGiveFromISR(SemaphoreHandle_t handle, BaseType_t *woken) {
+    if (NULL != woken) *woken = pdFALSE;
+    return xSemaphoreGive(handle);
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t handle) {
+    host_sem_t *sem = (host_sem_t *)handle;
+    pthread_cond_destroy(&sem->cond);
+    pthread_mutex_destroy(&sem->lock);
+    free(sem);
+}
+
+TimerHandle_t xTimerCreate(const char *name, TickType_t period, UBaseType_t reload,
+                           void *id, TimerCallbackFunction_t callback) {
+    pthread_once(&g_timer_once, host_timer_start);
+    host_timer_t *timer = calloc(1, sizeof(host_timer_t));
+    if (NULL == timer) return NULL;
+    timer->callback = callback;
+    timer->id = id;
+    timer->period = period;
+    timer->reload = (pdFALSE != reload);
+    pthread_mutex_lock(&g_timer_lock);
+    timer->next = g_timers;
+    g_timers = timer;
+    pthread_mutex_unlock(&g_timer_lock);
+    return timer;
+}
+
+/* applied at once, not queued to the service like on target */
+BaseType_t xTimerChangePeriod(TimerHandle_t handle, TickType_t period, TickType_t wait) {
+    host_timer_t *timer = (host_timer_t *)handle;
+    pthread_mutex_lock(&g_timer_lock);
+    timer->period = period;
+    // expires on a tick boundary like on target
+    timer->due_us = ((uint64_t)xTaskGetTickCount() + period) * (1000000 / configTICK_RATE_HZ);
+    timer->active = true;
+    pthread_cond_signal(&g_timer_cond);
+    pthread_mutex_unlock(&g_timer_lock);
+    return pdPASS;
+}
+
+BaseType_t xTimerStart(TimerHandle_t handle, TickType_t wait) {
+    return xTimerChangePeriod(handle, ((host_timer_t *)handle)->period, wait);
+}
+
+BaseType_t xTimerStop(TimerHandle_t handle, TickType_t wait) {
+    pthread_mutex_lock(&g_timer_lock);
+    ((host_timer_t *)handle)->active = false;
+    pthread_mutex_unlock(&g_timer_lock);
+    return pdPASS;
+}
+
+/* stopped, kept allocated as the service may be running it */
+BaseType_t xTimerDelete(TimerHandle_t handle, TickType_t wait) {
+    return xTimerStop(handle, wait);
+}
@@ -0,0 +1,25 @@
+/*
+ * @Author      : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @Date        : 2024-07-01 20:10:00
+ * @LastEditors : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @LastEditTime: 2024-07-01 20:10:00
+ * @FilePath    : /OpenSmartHome/components/osh_node/host_test/stubs/sdkconfig.h
+ * @Description : configuration of host tests, values as in sdkconfig unless noted
+ * Copyright (c) 2024 by Zheng, Yang, All Rights Reserved.
+ */
+#pragma once
+
+#define CONFIG_NODE_PROTO_BUFF_SIZE             512
+#define CONFIG_NODE_PROTO_CACHE_NUM             4
+#define CONFIG_NODE_PROTO_CSM_PEER_NUM          8
+#define CONFIG_NODE_PROTO_FLIGHT_NUM            4
+#define CONFIG_NODE_PROTO_FLIGHT_WAITER_NUM     4
+#define CONFIG_NODE_PEER_CAPACITY               16
+#define CONFIG_NODE_TRANSPORT_UDP_MTU           1472
+#define CONFIG_NODE_TRANSPORT_LOOP_RING         2048
+#define CONFIG_NODE_FSM_QUEUE_LEN               16
+#define CONFIG_NODE_FSM_PAYLOAD_SIZE            16
+#define CONFIG_NODE_FSM_TASK_STACK              4096
+#define CONFIG_NODE_FSM_TASK_PRIORITY           2
+#define CONFIG_NODE_TIMER_TICK_MS               10      // one FreeRTOS tick, tests run fast
+#define CONFIG_NODE_FSM_PREEMPT                 1
@@ -0,0 +1,154 @@
+/*
+ * @Author      : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @Date        : 2024-07-02 20:40:00
+ * @LastEditors : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @LastEditTime: 2024-07-02 20:40:00
+ * @FilePath    : /OpenSmartHome/components/osh_node/host_test/test_fsm.c
+ * @Description : node FSM table on host, transitions of events taken in one batch
+ * Copyright (c) 2024 by Zheng, Yang, All Rights Reserved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "freertos/semphr.h"
+
+#include "osh_node_fsm.h"
+#include "osh_node_fsm_table.inc"
+
+#define CHECK(cond) do { if (!(cond)) { \
+    printf("FAIL %s:%d %s\n", __FILE__, __LINE__, #cond); exit(1); } } while (0)
+
+#define WAIT_MS         1000
+
+/* handlers called, one letter each */
+static char g_calls[32];
+static volatile size_t g_call_num = 0;
+
+static esp_err_t record(char call) {
+    if (sizeof(g_calls) - 1 > g_call_num) g_calls[g_call_num++] = call;
+    return ESP_OK;
+}
+
+esp_err_t osh_node_wifi_init_poweron(void *e_conf_arg, void *run_arg) {
+    return record('P');
+}
+
+esp_err_t osh_node_wifi_init_connect(void *e_conf_arg, void *run_arg) {
+    return record('C');
+}
+
+esp_err_t osh_node_wifi_on_disconnect(void *e_conf_arg, void *run_arg) {
+    return record('D');
+}
+
+esp_err_t osh_node_power_on_save(void *e_conf_arg, void *run_arg) {
+    return record('S');
+}
+
+esp_err_t osh_node_power_on_wakeup(void *e_conf_arg, void *run_arg) {
+    return record('W');
+}
+
+esp_err_t osh_node_power_on_eval(void *e_conf_arg, void *run_arg) {
+    return record('E');
+}
+
+/* other FSM holding the FSM task, so events queue up for one batch */
+static osh_node_fsm_handle_t g_gate = NULL;
+static SemaphoreHandle_t g_gate_open = NULL;
+static SemaphoreHandle_t g_gate_held = NULL;
+
+static esp_err_t gate_cb(void *e_conf_arg, void *run_arg) {
+    xSemaphoreGive(g_gate_held);
+    xSemaphoreTake(g_gate_open, portMAX_DELAY);
+    return ESP_OK;
+}
+
+static void gate_hold(void) {
+    CHECK(ESP_OK == osh_node_fsm_invoke_event(g_gate, OSH_NODE_EVENT_INVOKE));
+    CHECK(pdTRUE == xSemaphoreTake(g_gate_held, pdMS_TO_TICKS(WAIT_MS)));
+}
+
+static void gate_release(void) {
+    xSemaphoreGive(g_gate_open);
+}
+
+/* handlers called so far are calls, then nothing else for a while */
+static void expect_calls(const char *calls) {
+    size_t len = strlen(calls);
+    for (int i = 0; i < WAIT_MS / 10 && len > g_call_num; i++) vTaskDelay(pdMS_TO_TICKS(10));
+    vTaskDelay(pdMS_TO_TICKS(50));
+    g_calls[g_call_num] = '\0';
+    if (0 != strcmp(calls, g_calls)) printf("calls %s, expected %s\n", g_calls, calls);
+    CHECK(0 == strcmp(calls, g_calls));
+}
+
+/* link lost while T_SAVE is queued in IDLE, saving waits for IDLE again */
+static void test_disconnect_then_save(osh_node_fsm_handle_t fsm) {
+    CHECK(OSH_FSM_STATE_IDLE == osh_node_fsm_get_state(fsm));
+    gate_hold();
+    CHECK(ESP_OK == osh_node_fsm_invoke_event(fsm, OSH_NODE_EVENT_DISCONNECT));
+    CHECK(ESP_OK == osh_node_fsm_invoke_event(fsm, OSH_NODE_EVENT_T_SAVE));
+    gate_release();
+    expect_calls("PCD");
+    CHECK(OSH_FSM_STATE_INIT == osh_node_fsm_get_state(fsm));
+
+    CHECK(ESP_OK == osh_node_fsm_invoke_event(fsm, OSH_NODE_EVENT_CONNECT));
+    expect_calls("PCDCS");
+    CHECK(OSH_FSM_STATE_SAVING == osh_node_fsm_get_state(fsm));
+}
+
+/* link lost while T_WAKEUP is queued in SAVING, node connects again */
+static void test_disconnect_then_wakeup(osh_node_fsm_handle_t fsm) {
+    CHECK(OSH_FSM_STATE_SAVING == osh_node_fsm_get_state(fsm));
+    gate_hold();
+    CHECK(ESP_OK == osh_node_fsm_invoke_event(fsm, OSH_NODE_EVENT_DISCONNECT));
+    CHECK(ESP_OK == osh_node_fsm_invoke_event(fsm, OSH_NODE_EVENT_T_WAKEUP));
+    gate_release();
+    expect_calls("PCDCSD");
+    CHECK(OSH_FSM_STATE_INIT == osh_node_fsm_get_state(fsm));
+
+    CHECK(ESP_OK == osh_node_fsm_invoke_event(fsm, OSH_NODE_EVENT_CONNECT));
+    expect_calls("PCDCSDC");
+    CHECK(OSH_FSM_STATE_IDLE == osh_node_fsm_get_state(fsm));
+}
+
+/* events of one state in one batch go on while it stays, T_WAKEUP left
+   queued from SAVING is dispatched once SAVING is entered again */
+static void test_same_state_batch(osh_node_fsm_handle_t fsm) {
+    CHECK(OSH_FSM_STATE_IDLE == osh_node_fsm_get_state(fsm));
+    osh_node_fsm_stats_t before, after;
+    CHECK(ESP_OK == osh_node_fsm_get_stats(fsm, &before));
+    gate_hold();
+    CHECK(ESP_OK == osh_node_fsm_invoke_event(fsm, OSH_NODE_EVENT_REQUEST));
+    CHECK(ESP_OK == osh_node_fsm_invoke_event(fsm, OSH_NODE_EVENT_INVOKE));
+    CHECK(ESP_OK == osh_node_fsm_invoke_event(fsm, OSH_NODE_EVENT_T_SAVE));
+    gate_release();
+    expect_calls("PCDCSDCSW");
+    CHECK(OSH_FSM_STATE_IDLE == osh_node_fsm_get_state(fsm));
+    CHECK(ESP_OK == osh_node_fsm_get_stats(fsm, &after));
+    CHECK(4 == after.dispatched - before.dispatched);
+}
+
+int main(void) {
+    g_gate_open = xSemaphoreCreateBinary();
+    g_gate_held = xSemaphoreCreateBinary();
+    CHECK(ESP_OK == osh_node_fsm_create("gate", 1, 1, 0, &g_gate));
+    CHECK(ESP_OK == osh_node_fsm_register_event(g_gate, 0, OSH_NODE_EVENT_INVOKE, gate_cb, NULL));
+    CHECK(ESP_OK == osh_node_fsm_start(g_gate, 0, NULL));
+
+    osh_node_fsm_handle_t fsm = NULL;
+    CHECK(ESP_OK == osh_node_fsm_create_from_table("net", &g_osh_node_fsm_table, 0, &fsm));
+    CHECK(ESP_OK == osh_node_fsm_start(fsm, OSH_FSM_STATE_INIT, NULL));
+    CHECK(ESP_OK == osh_node_fsm_invoke_event(fsm, OSH_NODE_EVENT_POWERON));
+    CHECK(ESP_OK == osh_node_fsm_invoke_event(fsm, OSH_NODE_EVENT_CONNECT));
+    expect_calls("PC");
+    CHECK(OSH_FSM_STATE_IDLE == osh_node_fsm_get_state(fsm));
+
+    test_disconnect_then_save(fsm);
+    test_disconnect_then_wakeup(fsm);
+    test_same_state_batch(fsm);
+    printf("fsm: all passed\n");
+    return 0;
+}
@@ -0,0 +1,127 @@
+/*
+ * @Author      : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @Date        : 2024-07-02 21:30:00
+ * @LastEditors : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @LastEditTime: 2024-07-02 21:30:00
+ * @FilePath    : /OpenSmartHome/components/osh_node/host_test/test_power_policy.c
+ * @Description : power save policy on host, a synthetic trace replayed over clock wrap
+ * Copyright (c) 2024 by Zheng, Yang, All Rights Reserved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "osh_node_power_policy.inc"
+
+#define CHECK(cond) do { if (!(cond)) { \
+    printf("FAIL %s:%d %s\n", __FILE__, __LINE__, #cond); exit(1); } } while (0)
+
+/* clock wraps 30 s into the trace */
+#define BASE_MS         ((uint32_t)(0 - 30000))
+
+/* step of trace: request, expected window or evaluation with its decision */
+typedef struct {
+    uint32_t                      at_ms;
+    char                             op;    // 'R'equest, e'X'pect, 'E'val
+    uint32_t                    from_ms;    // window of e'X'pect, from trace start
+    uint32_t                   until_ms;
+    uint8_t                        mode;    // decision of 'E'val
+    uint8_t                      listen;
+    uint32_t                    next_ms;
+} step_t;
+
+static void replay(osh_power_policy_t *policy, const step_t *steps, size_t num) {
+    for (size_t i = 0; i < num; i++) {
+        const step_t *step = &steps[i];
+        uint32_t now = BASE_MS + step->at_ms;
+        if ('R' == step->op) {
+            osh_power_policy_traffic(policy, now);
+        } else if ('X' == step->op) {
+            osh_power_policy_expect(policy, now, BASE_MS + step->from_ms, BASE_MS + step->until_ms);
+        } else {
+            osh_power_decision_t decision;
+            osh_power_policy_eval(policy, now, &decision);
+            if (step->mode != decision.mode || step->listen != decision.listen ||
+                step->next_ms != decision.next_ms) {
+                printf("step %u at %u ms: mode %u listen %u next %u ms, expected %u %u %u\n",
+                       (unsigned)i, (unsigned)step->at_ms, decision.mode, decision.listen,
+                       (unsigned)decision.next_ms, step->mode, step->listen,
+                       (unsigned)step->next_ms);
+            }
+            CHECK(step->mode == decision.mode);
+            CHECK(step->listen == decision.listen);
+            CHECK(step->next_ms == decision.next_ms);
+        }
+    }
+}
+
+/**
+ * quiet start, requests every 2 s, an expected answer, long idle to light
+ * sleep, then a rare request letting the radio sleep through the latency
+*/
+static void test_trace(void) {
+    static const step_t steps[] = {
+        {     0, 'E', 0, 0, OSH_POWER_AWAKE,  1,  5000},
+        {  5000, 'E', 0, 0, OSH_POWER_MODEM, 10, 55000},   // no gap known, latency bound
+        {  6000, 'R'},
+        {  6000, 'E', 0, 0, OSH_POWER_AWAKE,  1,  5000},
+        {  8000, 'R'},
+        { 10000, 'R'},
+        { 12000, 'R'},
+        { 17000, 'E', 0, 0, OSH_POWER_MODEM,  3, 55000},   // 2 s gap less 562 ms deviation
+        { 17000, 'X', 20000, 23000},
+        { 17000, 'E', 0, 0, OSH_POWER_MODEM,  3,  2500},   // up 200 ms + 3 beacons ahead
+        { 19500, 'E', 0, 0, OSH_POWER_AWAKE,  1,  3500},
+        { 23000, 'E', 0, 0, OSH_POWER_MODEM,  3, 49000},   // window over
+        { 72000, 'E', 0, 0, OSH_POWER_LIGHT,  3,     0},
+        {100000, 'R'},
+        {105000, 'E', 0, 0, OSH_POWER_MODEM, 10, 55000},   // gap of 12.7 s
+    };
+    osh_power_conf_t conf = {
+        .idle_ms = 5000,
+        .light_ms = 60000,
+        .latency_ms = 1000,
+        .beacon_ms = 100,
+        .early_ms = 200,
+        .listen_max = 10,
+    };
+    osh_power_policy_t policy;
+    osh_power_policy_init(&policy, &conf, BASE_MS);
+    replay(&policy, steps, sizeof(steps) / sizeof(steps[0]));
+
+    CHECK(5 == policy.requests);
+    CHECK(7 == policy.changes);
+    CHECK(105000 == policy.time_ms[OSH_POWER_AWAKE] + policy.time_ms[OSH_POWER_MODEM] +
+                    policy.time_ms[OSH_POWER_LIGHT]);
+    CHECK(33000 == policy.time_ms[OSH_POWER_LIGHT]);
+}
+
+/* no light sleep, evaluated again on traffic only, listen capped */
+static void test_modem_only(void) {
+    static const step_t steps[] = {
+        {   0, 'E', 0, 0, OSH_POWER_AWAKE, 1, 500},
+        { 500, 'E', 0, 0, OSH_POWER_MODEM, 4,   0},
+        {9000, 'E', 0, 0, OSH_POWER_MODEM, 4,   0},
+        {9000, 'R'},
+        {9000, 'E', 0, 0, OSH_POWER_AWAKE, 1, 500},
+    };
+    osh_power_conf_t conf = {
+        .idle_ms = 500,
+        .light_ms = 0,
+        .latency_ms = 1000,
+        .beacon_ms = 102,
+        .early_ms = 0,
+        .listen_max = 4,
+    };
+    osh_power_policy_t policy;
+    osh_power_policy_init(&policy, &conf, BASE_MS);
+    replay(&policy, steps, sizeof(steps) / sizeof(steps[0]));
+    CHECK(2 == policy.changes);
+}
+
+int main(void) {
+    test_trace();
+    test_modem_only();
+    printf("power policy: all passed\n");
+    return 0;
+}
@@ -0,0 +1,143 @@
+/*
+ * @Author      : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @Date        : 2024-07-01 21:30:00
+ * @LastEditors : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @LastEditTime: 2024-07-01 21:30:00
+ * @FilePath    : /OpenSmartHome/components/osh_node/host_test/test_timer.c
+ * @Description : timer wheel on host, delays kept and idle ticks not woken for
+ * Copyright (c) 2024 by Zheng, Yang, All Rights Reserved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "esp_timer.h"
+
+#include "osh_node_timer.h"
+
+#define CHECK(cond) do { if (!(cond)) { \
+    printf("FAIL %s:%d %s\n", __FILE__, __LINE__, #cond); exit(1); } } while (0)
+
+#define TICK_US         (CONFIG_NODE_TIMER_TICK_MS * 1000)
+#define SLACK_US        (2 * TICK_US + 5000)
+#define ONE_SHOTS       40
+
+/* a timeout and when it fired */
+typedef struct {
+    osh_node_timer_t              timer;
+    int64_t                       armed;
+    uint32_t                   delay_ms;
+    volatile int64_t              fired;
+    volatile uint32_t             count;
+} probe_t;
+
+static void probe_cb(void *arg) {
+    probe_t *probe = (probe_t *)arg;
+    if (0 == probe->count) probe->fired = esp_timer_get_time();
+    probe->count++;
+}
+
+static void probe_arm_cb(probe_t *probe, osh_node_timer_cb_t callback,
+                         uint32_t delay_ms, uint32_t period_ms) {
+    osh_node_timer_setup(&probe->timer, callback, probe);
+    probe->armed = esp_timer_get_time();
+    probe->delay_ms = delay_ms;
+    probe->fired = 0;
+    probe->count = 0;
+    CHECK(ESP_OK == osh_node_timer_arm(&probe->timer, delay_ms, period_ms));
+}
+
+static void probe_arm(probe_t *probe, uint32_t delay_ms, uint32_t period_ms) {
+    probe_arm_cb(probe, probe_cb, delay_ms, period_ms);
+}
+
+static void probe_check(const probe_t *probe) {
+    int64_t late = probe->fired - probe->armed - (int64_t)probe->delay_ms * 1000;
+    if (1 != probe->count || -TICK_US > late || SLACK_US < late) {
+        printf("delay %u ms fired %u times, %lld us late\n",
+               (unsigned)probe->delay_ms, (unsigned)probe->count, (long long)late);
+    }
+    CHECK(1 == probe->count);
+    CHECK(-TICK_US <= late && SLACK_US >= late);
+}
+
+static uint32_t wakeups(void) {
+    osh_node_timer_stats_t stats;
+    osh_node_timer_get_stats(&stats);
+    return stats.wakeups;
+}
+
+/* delays on all levels fire within a tick or two */
+static void test_one_shots(void) {
+    static probe_t probes[ONE_SHOTS];
+    srand(7);
+    for (int i = 0; i < ONE_SHOTS; i++) {
+        // spread over levels 0 to 2, up to 3 s
+        uint32_t delay_ms = 10 + (uint32_t)(rand() % 3000);
+        if (0 == i % 8) delay_ms = 10 + (uint32_t)(rand() % 600);
+        probe_arm(&probes[i], delay_ms, 0);
+    }
+    vTaskDelay(pdMS_TO_TICKS(3200));
+    for (int i = 0; i < ONE_SHOTS; i++) probe_check(&probes[i]);
+
+    osh_node_timer_stats_t stats;
+    osh_node_timer_get_stats(&stats);
+    CHECK(0 == stats.pending);
+}
+
+/* one periodic timeout wakes the wheel about once per period, not every tick */
+static void test_idle_ticks_skipped(void) {
+    probe_t probe;
+    uint32_t before = wakeups();
+    probe_arm(&probe, 500, 500);
+    vTaskDelay(pdMS_TO_TICKS(2250));
+    osh_node_timer_cancel(&probe.timer);
+    uint32_t woken = wakeups() - before;
+    printf("4 periods of 500 ms in %d ms ticks: %u wakeups\n",
+           CONFIG_NODE_TIMER_TICK_MS, (unsigned)woken);
+    CHECK(4 == probe.count);
+    // expiry and block entry of upper level at most
+    CHECK(2 * probe.count + 1 >= woken);
+}
+
+/* a sooner timeout armed while the wheel sleeps for a later one */
+static void test_sooner_arm(void) {
+    probe_t later, sooner;
+    probe_arm(&later, 2000, 0);
+    vTaskDelay(pdMS_TO_TICKS(100));
+    probe_arm(&sooner, 50, 0);
+    vTaskDelay(pdMS_TO_TICKS(200));
+    probe_check(&sooner);
+    CHECK(0 == later.count);
+    osh_node_timer_cancel(&later.timer);
+    CHECK(!osh_node_timer_pending(&later.timer));
+}
+
+/* callback arms the next one of a chain, in the timer task */
+static probe_t g_chain[3];
+
+static void chain_cb(void *arg) {
+    probe_t *probe = (probe_t *)arg;
+    probe_cb(probe);
+    if (probe != &g_chain[2]) probe_arm_cb(probe + 1, chain_cb, 120, 0);
+}
+
+static void test_chain(void) {
+    probe_t other;
+    probe_arm(&other, 1000, 0);
+    probe_arm_cb(&g_chain[0], chain_cb, 120, 0);
+    vTaskDelay(pdMS_TO_TICKS(500));
+    for (int i = 0; i < 3; i++) probe_check(&g_chain[i]);
+    CHECK(0 == other.count);
+    osh_node_timer_cancel(&other.timer);
+}
+
+int main(void) {
+    CHECK(ESP_OK == osh_node_timer_init());
+    test_one_shots();
+    test_idle_ticks_skipped();
+    test_sooner_arm();
+    test_chain();
+    printf("timer: all passed\n");
+    return 0;
+}
@@ -0,0 +1,231 @@
+/*
+ * @Author      : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @Date        : 2024-07-01 20:30:00
+ * @LastEditors : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @LastEditTime: 2024-07-01 20:30:00
+ * @FilePath    : /OpenSmartHome/components/osh_node/host_test/test_transport.c
+ * @Description : loopback transport on host, fragmentation, concurrent senders and benchmark
+ * Copyright (c) 2024 by Zheng, Yang, All Rights Reserved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "esp_timer.h"
+
+#include "osh_node_transport.h"
+#include "osh_node_proto.inc"
+
+#define CHECK(cond) do { if (!(cond)) { \
+    printf("FAIL %s:%d %s\n", __FILE__, __LINE__, #cond); exit(1); } } while (0)
+
+#define SENDERS         4
+#define FRAMES          2000
+#define BENCH_MS        1000
+
+/* UDP is not linked to sockets here */
+int osh_proto_sendto(int sock, const void *data, size_t len,
+                     const struct sockaddr_in *addr, OSH_TRAFFIC_CLASS_ENUM tc) {
+    return -1;
+}
+
+/* PDU of length len, first byte never a fragment mark */
+static void fill_pdu(uint8_t *pdu, size_t len, uint8_t seed) {
+    pdu[0] = 0x40;
+    for (size_t i = 1; i < len; i++) pdu[i] = (uint8_t)(seed + i);
+}
+
+static bool check_pdu(const uint8_t *pdu, size_t len) {
+    for (size_t i = 2; i < len; i++) {
+        if (pdu[i] != (uint8_t)(pdu[1] - 1 + i)) return false;
+    }
+    return true;
+}
+
+static void test_whole_and_fragments(void) {
+    static const size_t mtus[] = {0, 64};
+    uint8_t pdu[CONFIG_NODE_PROTO_BUFF_SIZE];
+    uint8_t buff[CONFIG_NODE_PROTO_BUFF_SIZE];
+    struct sockaddr_in from;
+
+    for (size_t m = 0; m < sizeof(mtus) / sizeof(mtus[0]); m++) {
+        osh_node_transport_t a, b;
+        CHECK(ESP_OK == osh_node_transport_loop_pair(&a, &b, mtus[m]));
+        for (size_t len = 1; len <= sizeof(pdu); len += 37) {
+            fill_pdu(pdu, len, (uint8_t)len);
+            CHECK(ESP_OK == osh_node_transport_send(&a, pdu, len, NULL, 0));
+            CHECK((int)len == osh_node_transport_recv(&b, buff, sizeof(buff), &from, 100));
+            CHECK(0 == memcmp(pdu, buff, len));
+        }
+        osh_node_transport_fini(&a);
+        osh_node_transport_fini(&b);
+    }
+}
+
+static void test_timeout(void) {
+    osh_node_transport_t a, b;
+    uint8_t buff[16];
+    struct sockaddr_in from;
+    CHECK(ESP_OK == osh_node_transport_loop_pair(&a, &b, 0));
+
+    int64_t begin = esp_timer_get_time();
+    CHECK(0 == osh_node_transport_recv(&b, buff, sizeof(buff), &from, 50));
+    int64_t spent = esp_timer_get_time() - begin;
+    CHECK(40000 <= spent && 200000 > spent);
+
+    osh_node_transport_fini(&a);
+    osh_node_transport_fini(&b);
+}
+
+/* several tasks send on one end, as proto task, flights and worker do */
+typedef struct {
+    osh_node_transport_t           *tp;
+    uint8_t                        seed;
+    SemaphoreHandle_t              done;
+} sender_arg_t;
+
+static void sender_task(void *arg) {
+    sender_arg_t *sender = (sender_arg_t *)arg;
+    uint8_t pdu[96];
+    for (int i = 0; i < FRAMES; i++) {
+        size_t len = 8 + (size_t)((sender->seed + i) % 88);
+        fill_pdu(pdu, len, (uint8_t)(sender->seed * 64 + i));
+        while (ESP_OK != osh_node_transport_send(sender->tp, pdu, len, NULL, 0)) {
+            // ring full, receiver catches up
+            vTaskDelay(1);
+        }
+    }
+    xSemaphoreGive(sender->done);
+    vTaskDelete(NULL);
+}
+
+static void test_concurrent_senders(void) {
+    osh_node_transport_t a, b;
+    uint8_t buff[CONFIG_NODE_PROTO_BUFF_SIZE];
+    struct sockaddr_in from;
+    sender_arg_t senders[SENDERS];
+    CHECK(ESP_OK == osh_node_transport_loop_pair(&a, &b, 0));
+
+    for (int i = 0; i < SENDERS; i++) {
+        senders[i].tp = &a;
+        senders[i].seed = (uint8_t)i;
+        senders[i].done = xSemaphoreCreateBinary();
+        CHECK(pdPASS == xTaskCreate(sender_task, "sender", 4096, &senders[i], 5, NULL));
+    }
+    int received = 0;
+    while (SENDERS * FRAMES > received) {
+        int len = osh_node_transport_recv(&b, buff, sizeof(buff), &from, 1000);
+        CHECK(0 < len);
+        CHECK(check_pdu(buff, len));
+        received++;
+    }
+    for (int i = 0; i < SENDERS; i++) {
+        CHECK(pdTRUE == xSemaphoreTake(senders[i].done, portMAX_DELAY));
+        vSemaphoreDelete(senders[i].done);
+    }
+    CHECK(0 == osh_node_transport_recv(&b, buff, sizeof(buff), &from, 20));
+
+    osh_node_transport_fini(&a);
+    osh_node_transport_fini(&b);
+}
+
+/* both ends closed at once, the pair freed once */
+#define CLOSE_ROUNDS    200
+
+typedef struct {
+    osh_node_transport_t           *tp;
+    SemaphoreHandle_t              go;
+    SemaphoreHandle_t              done;
+} closer_arg_t;
+
+static void closer_task(void *arg) {
+    closer_arg_t *closer = (closer_arg_t *)arg;
+    xSemaphoreTake(closer->go, portMAX_DELAY);
+    osh_node_transport_fini(closer->tp);
+    xSemaphoreGive(closer->done);
+    vTaskDelete(NULL);
+}
+
+static void test_close_race(void) {
+    for (int r = 0; r < CLOSE_ROUNDS; r++) {
+        osh_node_transport_t ends[2];
+        closer_arg_t closers[2];
+        CHECK(ESP_OK == osh_node_transport_loop_pair(&ends[0], &ends[1], 0));
+        for (int i = 0; i < 2; i++) {
+            closers[i].tp = &ends[i];
+            closers[i].go = xSemaphoreCreateBinary();
+            closers[i].done = xSemaphoreCreateBinary();
+            CHECK(pdPASS == xTaskCreate(closer_task, "closer", 4096, &closers[i], 5, NULL));
+        }
+        for (int i = 0; i < 2; i++) xSemaphoreGive(closers[i].go);
+        for (int i = 0; i < 2; i++) {
+            CHECK(pdTRUE == xSemaphoreTake(closers[i].done, portMAX_DELAY));
+            vSemaphoreDelete(closers[i].go);
+            vSemaphoreDelete(closers[i].done);
+        }
+    }
+}
+
+/* other end echoes until stopped */
+typedef struct {
+    osh_node_transport_t           *tp;
+    volatile bool                  stop;
+    SemaphoreHandle_t              done;
+} echo_arg_t;
+
+static void echo_task(void *arg) {
+    echo_arg_t *echo = (echo_arg_t *)arg;
+    uint8_t buff[CONFIG_NODE_PROTO_BUFF_SIZE];
+    struct sockaddr_in from;
+    while (!echo->stop) {
+        int len = osh_node_transport_recv(echo->tp, buff, sizeof(buff), &from, 10);
+        if (0 < len) osh_node_transport_send(echo->tp, buff, len, &from, 0);
+    }
+    xSemaphoreGive(echo->done);
+    vTaskDelete(NULL);
+}
+
+/* request and reply round trips, no socket in the way */
+static void bench_round_trip(size_t mtu, size_t len) {
+    osh_node_transport_t a, b;
+    uint8_t pdu[CONFIG_NODE_PROTO_BUFF_SIZE];
+    uint8_t buff[CONFIG_NODE_PROTO_BUFF_SIZE];
+    struct sockaddr_in from;
+    CHECK(ESP_OK == osh_node_transport_loop_pair(&a, &b, mtu));
+
+    echo_arg_t echo = {.tp = &b, .stop = false, .done = xSemaphoreCreateBinary()};
+    CHECK(pdPASS == xTaskCreate(echo_task, "echo", 4096, &echo, 5, NULL));
+
+    fill_pdu(pdu, len, 1);
+    uint32_t trips = 0;
+    int64_t begin = esp_timer_get_time();
+    int64_t spent = 0;
+    while (BENCH_MS * 1000 > spent) {
+        CHECK(ESP_OK == osh_node_transport_send(&a, pdu, len, NULL, 0));
+        CHECK((int)len == osh_node_transport_recv(&a, buff, sizeof(buff), &from, 1000));
+        trips++;
+        spent = esp_timer_get_time() - begin;
+    }
+    CHECK(0 == memcmp(pdu, buff, len));
+    printf("loop mtu %4u, PDU %3u bytes: %7lu round trips/s, %.1f us each\n",
+           (unsigned)mtu, (unsigned)len, (unsigned long)(trips * 1000000ULL / spent),
+           (double)spent / trips);
+
+    echo.stop = true;
+    xSemaphoreTake(echo.done, portMAX_DELAY);
+    vSemaphoreDelete(echo.done);
+    osh_node_transport_fini(&a);
+    osh_node_transport_fini(&b);
+}
+
+int main(void) {
+    test_whole_and_fragments();
+    test_timeout();
+    test_concurrent_senders();
+    test_close_race();
+    bench_round_trip(0, 64);
+    bench_round_trip(0, 480);
+    bench_round_trip(64, 480);
+    printf("transport: all passed\n");
+    return 0;
+}
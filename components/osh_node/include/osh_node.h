@@ -43,6 +43,14 @@ typedef struct {
      * W: network module
     */
     char                        *dev_name;
+
+    /**
+     * FSM of network, NULL until network init
+     *
+     * R: all modules
+     * W: network module
+    */
+    struct osh_node_fsm_stru     *net_fsm;
 } osh_node_bb_t;
 
 /* callback for module init */
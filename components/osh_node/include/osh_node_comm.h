@@ -32,6 +32,18 @@ extern "C" {
         owner = (type *)listGET_LIST_ITEM_OWNER(pos), pos != listGET_END_MARKER(plist); \
         pos = listGET_NEXT(pos))
 
+/* FNV-1a hash, chain calls by passing the previous hash as seed */
+#define OSH_FNV1A_SEED      0x811C9DC5UL
+
+static inline uint32_t osh_node_fnv1a(uint32_t hash, const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+    while (len--) {
+        hash ^= *p++;
+        hash *= 0x01000193UL;
+    }
+    return hash;
+}
+
 #ifdef __cplusplus
 }
 #endif
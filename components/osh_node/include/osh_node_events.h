@@ -18,25 +18,28 @@ extern "C" {
 #include <string.h>
 
 #include <freertos/FreeRTOS.h>
-#include <freertos/event_groups.h>
 
 #include "esp_event.h"
 
 
+/* events are IDs below OSH_NODE_EVENT_NUM, queued to FSM with payload */
+#define OSH_NODE_EVENT_NUM                  64
+
 // events for NODE_STATE_INIT
-#define OSH_NODE_EVENT_POWERON              BIT0
-#define OSH_NODE_EVENT_CONNECT              BIT1
-#define OSH_NODE_EVENT_DISCONNECT           BIT2
-
-#define OSH_NODE_EVENT_INVOKE               BIT16
-#define OSH_NODE_EVENT_REQUEST              BIT17
-#define OSH_NODE_EVENT_UPDATE               BIT18
-#define OSH_NODE_EVENT_OTA_COMPLETE         BIT19
-#define OSH_NODE_EVENT_OTA_ROLLBACK         BIT20
-
-#define OSH_NODE_EVENT_T_IDLE               BIT32
-#define OSH_NODE_EVENT_T_SAVE               BIT33
-#define OSH_NODE_EVENT_T_WAKEUP             BIT34
+#define OSH_NODE_EVENT_POWERON              0
+#define OSH_NODE_EVENT_CONNECT              1       // esp_netif_ip_info_t
+#define OSH_NODE_EVENT_DISCONNECT           2
+
+#define OSH_NODE_EVENT_INVOKE               16
+#define OSH_NODE_EVENT_REQUEST              17
+#define OSH_NODE_EVENT_UPDATE               18
+#define OSH_NODE_EVENT_OTA_COMPLETE         19
+#define OSH_NODE_EVENT_OTA_ROLLBACK         20
+#define OSH_NODE_EVENT_DOWNLOAD             21
+
+#define OSH_NODE_EVENT_T_IDLE               32      // power policy due, state kept
+#define OSH_NODE_EVENT_T_SAVE               33
+#define OSH_NODE_EVENT_T_WAKEUP             34
 
 #ifdef __cplusplus
 }
@@ -29,7 +29,7 @@ extern "C" {
 #define OSH_ERR_FSM_INVALID_STATE       (OSH_ERR_FSM_BASE +     7)
 #define OSH_ERR_FSM_INVALID_EVENT       (OSH_ERR_FSM_BASE +     8)
 
-/* Finite State Machine States Enumerate */
+/* States of network FSM */
 typedef enum {
     OSH_FSM_STATE_INIT          = 0,        // init state
     OSH_FSM_STATE_IDLE          = 1,        // idle
@@ -39,31 +39,124 @@ typedef enum {
     OSH_FSM_STATE_BUTT
 } OSH_FSM_STATES_ENUM;
 
-/* Callback for FSM */
+/* state of no FSM */
+#define OSH_FSM_STATE_NONE              0xFF
+
+/* what a repeated event does while one is still queued */
+typedef enum {
+    OSH_FSM_COALESCE_LATEST     = 0,        // merged, payload replaced (default)
+    OSH_FSM_COALESCE_FIRST      = 1,        // merged, first payload kept
+    OSH_FSM_COALESCE_NONE       = 2,        // queued again, each dispatched
+    OSH_FSM_COALESCE_BUTT
+} OSH_FSM_COALESCE_ENUM;
+
+/* priority of event, an urgent one goes before the others queued */
+typedef enum {
+    OSH_FSM_PRIO_NORMAL         = 0,        // in order (default)
+    OSH_FSM_PRIO_URGENT         = 1,        // first, may preempt a batch
+    OSH_FSM_PRIO_BUTT
+} OSH_FSM_PRIO_ENUM;
+
+/* statistics of event queue */
+typedef struct {
+    uint32_t                       posted;
+    uint32_t                    coalesced;      // merged into a queued one
+    uint32_t                    overflows;      // dropped, queue full
+    uint32_t                   dispatched;
+    uint32_t                         peak;      // most events queued
+    uint32_t                    preempted;      // batches cut by urgent event
+} osh_node_fsm_stats_t;
+
+/**
+ * dump of trace ring, big endian, records oldest first
+ *
+ *  0       version
+ *  1       length of record
+ *  2..3    number of records
+ *  4..7    sequence of first record
+ *  8..11   sequence of next record to be written
+ *  12..15  0
+ *
+ * record
+ *  0..3    time in us since boot
+ *  4..7    us of callback
+ *  8..11   address of callback, 0 for transition only
+ *  12..15  result of callback
+ *  16      id of FSM, by order of creation
+ *  17      state dispatched in
+ *  18      event
+ *  19      state after callback
+*/
+#define OSH_NODE_FSM_TRACE_VER          1
+#define OSH_NODE_FSM_TRACE_HEAD_LEN     16
+#define OSH_NODE_FSM_TRACE_RECORD_LEN   20
+
+/* FSM instance, dispatched by the shared FSM task */
+typedef struct osh_node_fsm_stru *osh_node_fsm_handle_t;
+
+/* const transition table, see tools/node_state.py */
+typedef struct osh_node_fsm_table_stru osh_node_fsm_table_t;
+
+/* Callback for FSM, run_arg given at start */
 typedef esp_err_t (* osh_node_fsm_event_cb)(void *e_conf_arg, void *run_arg);
 
-/* init FSM */
-esp_err_t osh_node_fsm_init(osh_node_bb_t *node_bb, void *f_conf_arg);
+/* create FSM of state_num states with room for slot_num callbacks and
+   queue_len events, 0 for NODE_FSM_QUEUE_LEN, all in one allocation */
+esp_err_t osh_node_fsm_create(const char *name, uint8_t state_num, uint8_t slot_num,
+                              uint8_t queue_len, osh_node_fsm_handle_t *fsm);
 
-/* register a event and corresponding callback to a state */
-esp_err_t osh_node_fsm_register_event(const OSH_FSM_STATES_ENUM state, const EventBits_t uxBitsToWaitFor,
+/* create FSM running a const table, nothing registered at runtime */
+esp_err_t osh_node_fsm_create_from_table(const char *name, const osh_node_fsm_table_t *table,
+                                         uint8_t queue_len, osh_node_fsm_handle_t *fsm);
+
+/* stop and free FSM */
+esp_err_t osh_node_fsm_delete(osh_node_fsm_handle_t fsm);
+
+/* register a event and corresponding callback to a state, not for FSM
+   of const table */
+esp_err_t osh_node_fsm_register_event(osh_node_fsm_handle_t fsm, const uint8_t state,
+                                     const uint32_t event,
                                      osh_node_fsm_event_cb handle, void *e_conf_arg);
 
-/* run FSM */
-esp_err_t osh_node_fsm_loop_step(void *run_arg);
+/* set coalescing policy of event */
+esp_err_t osh_node_fsm_set_policy(osh_node_fsm_handle_t fsm, const uint32_t event,
+                                  OSH_FSM_COALESCE_ENUM policy);
 
-/* fini FSM */
-esp_err_t osh_node_fsm_fini(void);
+/* set priority of event, urgent ones of a const table are set at create */
+esp_err_t osh_node_fsm_set_priority(osh_node_fsm_handle_t fsm, const uint32_t event,
+                                    OSH_FSM_PRIO_ENUM prio);
+
+/* enter state and hand FSM to the FSM task, events queued before are kept */
+esp_err_t osh_node_fsm_start(osh_node_fsm_handle_t fsm, const uint8_t state, void *run_arg);
 
 /* invoke event */
-esp_err_t osh_node_fsm_invoke_event(const EventBits_t uxBitsToSet);
-esp_err_t osh_node_fsm_invoke_event_from_ISR(const EventBits_t uxBitsToSet);
+esp_err_t osh_node_fsm_invoke_event(osh_node_fsm_handle_t fsm, const uint32_t event);
+esp_err_t osh_node_fsm_invoke_event_from_ISR(osh_node_fsm_handle_t fsm, const uint32_t event);
+
+/* queue event with payload up to NODE_FSM_PAYLOAD_SIZE bytes, copied,
+   ESP_ERR_NO_MEM if the queue is full */
+esp_err_t osh_node_fsm_post_event(osh_node_fsm_handle_t fsm, const uint32_t event,
+                                  const void *payload, size_t len);
+esp_err_t osh_node_fsm_post_event_from_ISR(osh_node_fsm_handle_t fsm, const uint32_t event,
+                                           const void *payload, size_t len);
 
-/* get state */
-OSH_FSM_STATES_ENUM osh_node_fsm_get_state(void);
+/* payload of the event being dispatched, only valid in its callback */
+const void *osh_node_fsm_event_payload(size_t *len);
+
+/* get statistics of event queue */
+esp_err_t osh_node_fsm_get_stats(osh_node_fsm_handle_t fsm, osh_node_fsm_stats_t *stats);
+
+/* get state, OSH_FSM_STATE_NONE without FSM */
+uint8_t osh_node_fsm_get_state(osh_node_fsm_handle_t fsm);
 
 /* set state */
-esp_err_t osh_node_fsm_set_state(OSH_FSM_STATES_ENUM state);
+esp_err_t osh_node_fsm_set_state(osh_node_fsm_handle_t fsm, uint8_t state);
+
+#if CONFIG_NODE_FSM_TRACE_ENABLE
+/* dump trace records from sequence from, the oldest kept if from is gone,
+   bytes written to buff, more set if records after the last one dumped */
+size_t osh_node_fsm_trace_dump(uint32_t from, uint8_t *buff, size_t size, bool *more);
+#endif
 
 #ifdef __cplusplus
 }
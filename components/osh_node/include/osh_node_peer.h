@@ -0,0 +1,48 @@
+/***
+ * @Author      : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @Date        : 2024-06-12 20:31:17
+ * @LastEditors : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @LastEditTime: 2024-06-12 20:31:19
+ * @FilePath    : /OpenSmartHome/components/osh_node/include/osh_node_peer.h
+ * @Description : peer directory built from heartbeats
+ * @Copyright (c) 2024 by Zheng, Yang, All Rights Reserved.
+ */
+#ifndef OSH_NODE_PEER_H
+#define OSH_NODE_PEER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <netinet/in.h>
+
+#include "osh_node_comm.h"
+#include "osh_node_errors.h"
+
+#define OSH_NODE_PEER_NAME_LEN          32
+
+/* peer heard on report group */
+typedef struct {
+    char       node_name[OSH_NODE_PEER_NAME_LEN];   // logical name, may be empty
+    char        dev_name[OSH_NODE_PEER_NAME_LEN];   // device name, unique
+    struct sockaddr_in                    addr;   // unicast address for APP
+    TickType_t                       last_seen;
+} osh_node_peer_t;
+
+/* visitor for enumeration, return false to stop */
+typedef bool (*osh_node_peer_visit_cb)(const osh_node_peer_t *peer, void *arg);
+
+/* find peer by device name or node name */
+esp_err_t osh_node_peer_lookup(const char *name, osh_node_peer_t *peer);
+
+/* enumerate alive peers */
+esp_err_t osh_node_peer_foreach(osh_node_peer_visit_cb visit, void *arg);
+
+/* number of alive peers */
+size_t osh_node_peer_count(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* OSH_NODE_PEER_H */
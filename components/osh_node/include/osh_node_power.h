@@ -0,0 +1,63 @@
+/***
+ * @Author      : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @Date        : 2024-06-30 20:03:18
+ * @LastEditors : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @LastEditTime: 2024-06-30 21:55:02
+ * @FilePath    : /OpenSmartHome/components/osh_node/include/osh_node_power.h
+ * @Description : adaptive power save of node, in OSH_FSM_STATE_SAVING
+ * @Copyright (c) 2024 by Zheng, Yang, All Rights Reserved.
+ */
+#ifndef OSH_NODE_POWER_H
+#define OSH_NODE_POWER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "osh_node.h"
+#include "osh_node_comm.h"
+#include "osh_node_errors.h"
+
+/* errors */
+#define OSH_ERR_POWER_BASE              (OSH_ERR_NODE_BASE + 0x40000)
+#define OSH_ERR_POWER_INNER             (OSH_ERR_POWER_BASE +     1)
+#define OSH_ERR_POWER_NOT_INIT          (OSH_ERR_POWER_BASE +     2)
+
+/* statistics of power save */
+typedef struct {
+    uint8_t                        mode;    // OSH_POWER_MODE_ENUM in force
+    uint8_t                      listen;    // beacons per wake up in force
+    uint32_t                   requests;
+    uint32_t                    changes;    // mode changed
+    uint32_t                     gap_ms;    // smoothed inter-arrival of requests
+    uint32_t                   awake_ms;    // time radio always on
+    uint32_t                   modem_ms;    // time in modem sleep
+    uint32_t                   light_ms;    // time in light sleep
+} osh_node_power_stats_t;
+
+/* init power save of node on network FSM */
+esp_err_t osh_node_power_init(osh_node_bb_t *node_bb);
+
+/* set listen interval of station, negotiated at association so before connect */
+esp_err_t osh_node_power_set_listen(void);
+
+/* start policy when connected, awake */
+esp_err_t osh_node_power_start(void);
+
+/* stop policy and keep radio awake */
+esp_err_t osh_node_power_stop(void);
+
+/* a request arrived, wakes the node if saving */
+void osh_node_power_traffic(void);
+
+/* traffic expected from from_ms until until_ms later, awake ahead of it */
+void osh_node_power_expect(uint32_t from_ms, uint32_t until_ms);
+
+/* get statistics of power save */
+esp_err_t osh_node_power_get_stats(osh_node_power_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* OSH_NODE_POWER_H */
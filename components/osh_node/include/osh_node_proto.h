@@ -20,9 +20,19 @@ extern "C" {
 
 #include "osh_node.h"
 #include "osh_node_proto_dataframe.h"
+#include "osh_node_transport.h"
 
 #define OSH_NODE_PROTO_VER          0
 
+// OPTIONS lists registered entries
+#define OSH_NODE_ENTRY_DIRECTORY    0xC0000001UL
+
+// POST applies several PUTs as one transaction
+#define OSH_NODE_ENTRY_TRANSACTION  0xC0000002UL
+
+// GET dumps FSM trace ring, decoded by tools/fsm_trace.py
+#define OSH_NODE_ENTRY_FSM_TRACE    0xC0000003UL
+
 #define OSH_ERR_PROTO_BASE              (OSH_ERR_NODE_BASE + 0x10000)
 #define OSH_ERR_PROTO_INNER             (OSH_ERR_PROTO_BASE +     1)
 #define OSH_ERR_PROTO_PDU_LEN           (OSH_ERR_PROTO_BASE +     2)
@@ -31,7 +41,30 @@ extern "C" {
 #define OSH_ERR_PROTO_PDU_FMT           (OSH_ERR_PROTO_BASE +     5)
 #define OSH_ERR_PROTO_INVALID_ENTRY     (OSH_ERR_PROTO_BASE +     6)
 #define OSH_ERR_PROTO_NOT_FOUND         (OSH_ERR_PROTO_BASE +     7)
-
+#define OSH_ERR_PROTO_DEFERRED          (OSH_ERR_PROTO_BASE +     8)    // server not respond, handler replies if needed
+#define OSH_ERR_PROTO_ROUTE_EXIST       (OSH_ERR_PROTO_BASE +     9)
+#define OSH_ERR_PROTO_OVERRUN           (OSH_ERR_PROTO_BASE +    10)    // handler over latency budget
+
+
+/* content version of entry, changes whenever the content changes, 0 if unknown */
+typedef uint32_t (*osh_node_proto_version_t) (uint32_t entry,
+            osh_node_bb_t *node_bb);
+
+/* route statistics */
+typedef struct {
+    uint32_t                      calls;    // handler called
+    uint32_t                     errors;    // handler failed
+    uint32_t                 cache_hits;    // served from response cache
+    uint32_t               cache_misses;    // cache enabled but handler called
+    uint32_t               not_modified;    // answered 2.03 Valid without content
+    uint32_t                 arena_peak;    // most scratch bytes used by one request
+    uint32_t                  coalesced;    // parked on identical read in flight
+    uint32_t                   overruns;    // handler over latency budget
+    uint32_t                     max_us;    // longest handler run
+    bool                           slow;    // ever over latency budget
+    bool                        demoted;    // run by the low-priority worker
+    uint32_t                     worker;    // requests run by the worker
+} osh_node_route_stats_t;
 
 typedef esp_err_t (*osh_node_proto_handler_t) (uint32_t entry,
             osh_node_bb_t *node_bb,
@@ -39,6 +72,33 @@ typedef esp_err_t (*osh_node_proto_handler_t) (uint32_t entry,
             const osh_node_proto_pdu_t *request,
             osh_node_proto_pdu_t *response);
 
+/* transaction operations of a PUT route, entries of one transaction are
+   all validated before any is applied, nothing is persisted until commit */
+typedef struct {
+    // check payload without side effect
+    esp_err_t (*validate) (uint32_t entry, uint32_t sub_index,
+                osh_node_bb_t *node_bb, const uint8_t *data, size_t len);
+    // apply payload in memory
+    esp_err_t (*apply) (uint32_t entry, uint32_t sub_index,
+                osh_node_bb_t *node_bb, const uint8_t *data, size_t len);
+    // undo apply when a later step failed
+    void (*abort) (uint32_t entry, uint32_t sub_index, osh_node_bb_t *node_bb);
+} osh_node_route_txn_t;
+
+/* persist all applied changes of a transaction at once, e.g. one NVS commit */
+typedef esp_err_t (*osh_node_proto_commit_t) (osh_node_bb_t *node_bb, void *arg);
+
+/* handle of a deferred request, 0 if invalid */
+typedef uint32_t osh_node_proto_flight_t;
+
+/* route definition, for const tables e.g. generated by tools/entry_gen.py */
+typedef struct {
+    uint32_t                      entry;
+    uint32_t                       mask;    // 0xFFFFFFFF for a single entry
+    OSH_CODE_METHOD_ENUM         method;
+    osh_node_proto_handler_t    handler;
+} osh_node_route_def_t;
+
 #define proto_response_err_head(req, rsp, cls, code) \
 do {\
     (rsp)->version = OSH_NODE_PROTO_VER; \
@@ -74,11 +134,90 @@ esp_err_t osh_node_proto_start(void *run_arg);
 /* stop proto */
 esp_err_t osh_node_proto_stop(void);
 
+/* announce changed names or entries to DNS-SD, nothing sent if unchanged */
+void osh_node_proto_advertise(void);
+
+/* wait up to timeout_ms for one request on link and answer it over the
+   same link, ESP_ERR_TIMEOUT if none, called from the task owning the link */
+esp_err_t osh_node_proto_serve(osh_node_transport_t *tp, uint32_t timeout_ms);
+
+/* allocate scratch memory for the request being handled, 8 bytes aligned,
+   NULL if the arena is exhausted, all freed once the response is sent */
+void *osh_node_proto_session_alloc(osh_node_proto_session_t *session, size_t size);
+
+/* take over request to answer it later from any task, the handler then
+   returns OSH_ERR_PROTO_DEFERRED. identical GET/FETCH requests arriving
+   meanwhile are parked and answered with the same result. 0 if no room */
+osh_node_proto_flight_t osh_node_proto_defer(const osh_node_proto_pdu_t *request);
+
+/* answer a deferred request and all requests parked on it */
+esp_err_t osh_node_proto_resolve(osh_node_proto_flight_t flight,
+                                 OSH_CODE_CLASS_ENUM code_class,
+                                 uint8_t code_code,
+                                 OSH_CONTENT_TYPE_ENUM con_type,
+                                 const void *data,
+                                 size_t len);
+
+/* reserve len bytes of response content right in the send buffer, NULL if
+   no room, call again to append, the header is written in front on sending */
+uint8_t *osh_node_proto_response_reserve(osh_node_proto_pdu_t *response, size_t len);
+
+/* commit len bytes written into the reserved content */
+esp_err_t osh_node_proto_response_commit(osh_node_proto_pdu_t *response, size_t len);
+
 /* register route callback */
 esp_err_t osh_node_route_register(uint32_t entry,
                                   OSH_CODE_METHOD_ENUM method,
                                   osh_node_proto_handler_t handler);
 
+/* register route callback for all entries under a contiguous mask, e.g.
+   0x00001000/0xFFFFFFC0 for 64 channels, handler gets request->sub_index,
+   the longest matched prefix wins */
+esp_err_t osh_node_route_register_range(uint32_t entry,
+                                  uint32_t mask,
+                                  OSH_CODE_METHOD_ENUM method,
+                                  osh_node_proto_handler_t handler);
+
+/* register a table of routes */
+esp_err_t osh_node_route_register_table(const osh_node_route_def_t *table,
+                                  size_t num);
+
+/* cache GET responses of the route serving entry, for ttl_ms or until
+   invalidated when ttl_ms is 0, the handler is not called on a hit */
+esp_err_t osh_node_route_cache_enable(uint32_t entry, uint32_t ttl_ms);
+
+/* drop the cached GET response of entry, call when its content changed */
+esp_err_t osh_node_route_cache_invalidate(uint32_t entry);
+
+/* version callback of the GET route serving entry, used as content tag in
+   hash instead of hashing the content, a request carrying the current tag
+   gets 2.03 Valid without calling the handler */
+esp_err_t osh_node_route_set_version(uint32_t entry,
+                                     osh_node_proto_version_t version_cb);
+
+/* transaction operations of the PUT route serving entry, ops must be
+   kept until unregistered, NULL to leave transactions */
+esp_err_t osh_node_route_set_txn(uint32_t entry,
+                                 const osh_node_route_txn_t *ops);
+
+/* commit hook called once after all updates of a transaction applied,
+   a failing commit aborts them */
+esp_err_t osh_node_proto_set_commit(osh_node_proto_commit_t commit, void *arg);
+
+/* latency budget of the route serving entry with method, 0 for none, a
+   handler running longer is answered 5.04 and counted as overrun; with
+   demote the route moves to the low-priority worker after
+   NODE_PROTO_WORKER_DEMOTE overruns, if the worker is enabled */
+esp_err_t osh_node_route_set_budget(uint32_t entry,
+                                    OSH_CODE_METHOD_ENUM method,
+                                    uint32_t budget_us,
+                                    bool demote);
+
+/* statistics of the route serving entry with method */
+esp_err_t osh_node_route_get_stats(uint32_t entry,
+                                   OSH_CODE_METHOD_ENUM method,
+                                   osh_node_route_stats_t *stats);
+
 #ifdef __cplusplus
 }
 #endif
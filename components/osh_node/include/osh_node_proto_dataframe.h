@@ -129,6 +129,23 @@ typedef enum {
     OSH_SESSION_STATE_BUTT
 } OSH_SESSION_STATE_ENUM;
 
+/* capabilities and settings of a session, see CSM payload */
+typedef struct {
+    uint16_t               max_msg_size;    // largest PDU the remote receives
+    uint16_t                 block_size;    // preferred block-wise size
+    uint8_t                    features;    // OSH_CSM_FEATURE_*
+    uint8_t                     version;    // protocol version
+} osh_node_proto_csm_t;
+
+/* scratch arena, bump allocated while a request is handled */
+typedef struct {
+    uint8_t                       *base;
+    size_t                         size;
+    size_t                         used;
+} osh_node_proto_arena_t;
+
+struct osh_node_transport_stru;
+
 /* session */
 typedef struct {
     OSH_SESSION_STATE_ENUM        state;
@@ -136,10 +153,13 @@ typedef struct {
     struct sockaddr_in      remote_addr;
     struct sockaddr_in       local_addr;
     int                            sock;    // socket
+    struct osh_node_transport_stru *transport;    // link of remote
     uint32_t                ack_timeout;    // tick for ack timeout
     uint32_t                 last_token;
     uint16_t               last_ack_mid;
     uint16_t               last_con_mid;
+    osh_node_proto_csm_t            csm;    // negotiated with remote
+    osh_node_proto_arena_t       *arena;    // scratch of current request
 } osh_node_proto_session_t;
 
 /* pdu */
@@ -157,6 +177,7 @@ typedef struct {
     uint32_t                      token;
     uint32_t                       hash;
     uint32_t                      entry;
+    uint32_t                  sub_index;    // entry bits out of the matched route mask
     void                          *data;    // data for App
 
     osh_node_proto_session_t   *session;
@@ -173,6 +194,74 @@ typedef struct {
 // max pdu header length
 #define OSH_NODE_PROTO_PDU_HEADER_MAX_LEN    24
 
+/**
+ * CONNECT payload, forwarded by proxy node
+ *
+ *  0..3    target IPv4 address (network order)
+ *  4..5    target port (network order)
+ *  6..     inner request PDU
+*/
+#define OSH_NODE_PROTO_CONNECT_TARGET_LEN     6
+
+/**
+ * HEARTBEAT payload, multicast on report group
+ *
+ *  0..1    APP port (network order)
+ *  2       length of device name, then device name
+ *  n       length of node name, then node name
+*/
+#define OSH_NODE_PROTO_HB_NAME_MAX_LEN       31
+#define OSH_NODE_PROTO_HB_MAX_LEN             (2 + 2 * (1 + OSH_NODE_PROTO_HB_NAME_MAX_LEN))
+
+/**
+ * CSM payload, list of options each as type(1) length(1) value(network order)
+ *
+ *  1       max message size (2)
+ *  2       block size (2)
+ *  3       features bitmap (1)
+ *  4       protocol version (1)
+ *
+ * unknown options are skipped, a missing one keeps its default
+*/
+#define OSH_CSM_OPT_MAX_MSG_SIZE              1
+#define OSH_CSM_OPT_BLOCK_SIZE                2
+#define OSH_CSM_OPT_FEATURES                  3
+#define OSH_CSM_OPT_VERSION                   4
+
+#define OSH_CSM_FEATURE_BLOCK              0x01    // block-wise transfer
+#define OSH_CSM_FEATURE_BATCH              0x02    // several PDUs in one datagram
+#define OSH_CSM_FEATURE_COMPRESS           0x04    // compressed content
+#define OSH_CSM_FEATURE_OBSERVE            0x08    // observe entries
+#define OSH_CSM_FEATURE_ETAG               0x10    // content tag in hash
+
+#define OSH_NODE_PROTO_CSM_MAX_LEN           14
+
+/**
+ * OPTIONS on directory entry, request content is optional first record (2)
+ * response content is records from the first one, each as
+ *
+ *  0..3    entry prefix
+ *  4       prefix length, 32 for a single entry
+ *  5..6    bitmap of methods, bit n set for method n
+ *
+ * 2.31 Continue when more records follow, 2.05 Content on the last page,
+ * hash is the directory version
+*/
+#define OSH_NODE_PROTO_DIR_RECORD_LEN         7
+
+/**
+ * POST on transaction entry, request content is updates applied as one,
+ * each as
+ *
+ *  0..3    entry
+ *  4..5    length of payload
+ *  6..     payload, same as content of PUT on the entry
+ *
+ * 2.04 Changed when all applied and committed, otherwise nothing is
+ * changed and the error content is the index of the failed update (1)
+*/
+#define OSH_NODE_PROTO_TXN_RECORD_HEAD_LEN    6
+
 #ifdef __cplusplus
 }
 #endif
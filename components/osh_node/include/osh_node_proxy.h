@@ -0,0 +1,38 @@
+/***
+ * @Author      : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @Date        : 2024-06-10 21:12:36
+ * @LastEditors : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @LastEditTime: 2024-06-10 21:12:38
+ * @FilePath    : /OpenSmartHome/components/osh_node/include/osh_node_proxy.h
+ * @Description : forwarding proxy for CONNECT method
+ * @Copyright (c) 2024 by Zheng, Yang, All Rights Reserved.
+ */
+#ifndef OSH_NODE_PROXY_H
+#define OSH_NODE_PROXY_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "osh_node_comm.h"
+#include "osh_node_errors.h"
+
+/* statistics of proxy */
+typedef struct {
+    uint32_t                  forwarded;    // requests sent to upstream
+    uint32_t                 cache_hits;    // answered from cache
+    uint32_t                  coalesced;    // parked on an identical request
+    uint32_t                   timeouts;    // upstream not answered
+    uint32_t               stale_served;    // answered from expired cache on timeout
+    uint32_t                   rejected;    // no room for request
+    uint32_t                  oversized;    // upstream response over requester's size
+} osh_node_proxy_stats_t;
+
+/* get statistics of proxy */
+esp_err_t osh_node_proxy_get_stats(osh_node_proxy_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* OSH_NODE_PROXY_H */
@@ -0,0 +1,37 @@
+/***
+ * @Author      : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @Date        : 2024-06-22 10:18:40
+ * @LastEditors : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @LastEditTime: 2024-06-22 10:18:43
+ * @FilePath    : /OpenSmartHome/components/osh_node/include/osh_node_res.h
+ * @Description : static resources served from flash partition
+ * @Copyright (c) 2024 by Zheng, Yang, All Rights Reserved.
+ */
+#ifndef OSH_NODE_RES_H
+#define OSH_NODE_RES_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "osh_node_comm.h"
+#include "osh_node_errors.h"
+#include "osh_node_proto_dataframe.h"
+
+// data partition holding the image packed by tools/res_pack.py
+#define OSH_NODE_RES_PARTITION_SUBTYPE      0x40
+
+/* number of resources served, 0 if no image */
+size_t osh_node_res_count(void);
+
+/* content of resource mapped in flash, valid until proto fini */
+esp_err_t osh_node_res_find(uint32_t entry,
+                            const void **data,
+                            size_t *len,
+                            OSH_CONTENT_TYPE_ENUM *con_type);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* OSH_NODE_RES_H */
@@ -22,9 +22,12 @@ extern "C" {
 /* init RGB LED for status indicator */
 esp_err_t osh_node_status_init(osh_node_bb_t *node_bb, void *conf_arg);
 
-/* start status task */
+/* start blinking status on timer wheel */
 esp_err_t osh_node_status_start(void *run_arg);
 
+/* LED off and blink stopped while saving */
+void osh_node_status_saving(bool saving);
+
 /* init GPIO button for reset network config */
 esp_err_t osh_node_reset_btn_init(osh_node_bb_t *node_bb, void *conf_arg);
 
@@ -0,0 +1,72 @@
+/***
+ * @Author      : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @Date        : 2024-06-27 20:05:31
+ * @LastEditors : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @LastEditTime: 2024-06-27 20:05:34
+ * @FilePath    : /OpenSmartHome/components/osh_node/include/osh_node_timer.h
+ * @Description : timeouts of node on one timer wheel
+ * @Copyright (c) 2024 by Zheng, Yang, All Rights Reserved.
+ */
+#ifndef OSH_NODE_TIMER_H
+#define OSH_NODE_TIMER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "osh_node_comm.h"
+#include "osh_node_errors.h"
+
+/* errors */
+#define OSH_ERR_TIMER_BASE              (OSH_ERR_NODE_BASE + 0x30000)
+#define OSH_ERR_TIMER_INNER             (OSH_ERR_TIMER_BASE +     1)
+#define OSH_ERR_TIMER_NOT_INIT          (OSH_ERR_TIMER_BASE +     2)
+
+/* run in timer service task when expired, must not block */
+typedef void (*osh_node_timer_cb_t) (void *arg);
+
+/**
+ * timeout kept by its owner, linked into the wheel while pending, so
+ * arming and cancelling neither allocate nor search
+*/
+typedef struct osh_node_timer_stru {
+    struct osh_node_timer_stru     *next;
+    struct osh_node_timer_stru   **pprev;   // NULL when not pending
+    uint32_t                    expires;    // wheel tick
+    uint32_t                     period;    // ticks, 0 for once
+    osh_node_timer_cb_t        callback;
+    void                           *arg;
+} osh_node_timer_t;
+
+/* statistics of timer wheel */
+typedef struct {
+    uint32_t                    pending;
+    uint32_t                       peak;    // most pending
+    uint32_t                      fired;
+    uint32_t                   cascaded;    // moved down a level
+    uint32_t                    wakeups;    // FreeRTOS timer expired
+} osh_node_timer_stats_t;
+
+/* create the FreeRTOS timer driving the wheel */
+esp_err_t osh_node_timer_init(void);
+
+/* set callback of timeout, not pending */
+void osh_node_timer_setup(osh_node_timer_t *timer, osh_node_timer_cb_t callback, void *arg);
+
+/* fire after delay_ms, then every period_ms unless 0, a pending one is armed again */
+esp_err_t osh_node_timer_arm(osh_node_timer_t *timer, uint32_t delay_ms, uint32_t period_ms);
+
+/* stop timeout, nothing if not pending */
+void osh_node_timer_cancel(osh_node_timer_t *timer);
+
+/* true until fired or cancelled, periodic one pending until cancelled */
+bool osh_node_timer_pending(const osh_node_timer_t *timer);
+
+/* get statistics of timer wheel */
+void osh_node_timer_get_stats(osh_node_timer_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* OSH_NODE_TIMER_H */
@@ -0,0 +1,120 @@
+/***
+ * @Author      : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @Date        : 2024-06-23 09:42:16
+ * @LastEditors : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @LastEditTime: 2024-06-23 09:42:19
+ * @FilePath    : /OpenSmartHome/components/osh_node/include/osh_node_transport.h
+ * @Description : links carrying proto PDUs, fragmented to link MTU
+ * @Copyright (c) 2024 by Zheng, Yang, All Rights Reserved.
+ */
+#ifndef OSH_NODE_TRANSPORT_H
+#define OSH_NODE_TRANSPORT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <netinet/in.h>
+
+#include "freertos/semphr.h"
+
+#include "osh_node_comm.h"
+#include "osh_node_errors.h"
+
+/* traffic class of outgoing datagram, marked in IP TOS */
+typedef enum {
+    OSH_TC_CONTROL = 0,         // commands and their answers
+    OSH_TC_DEFAULT,             // content of reads
+    OSH_TC_BULK,                // heartbeats and block transfers
+    OSH_TC_BUTT
+} OSH_TRAFFIC_CLASS_ENUM;
+
+/* kind of address on link, carried in sockaddr_in */
+typedef enum {
+    OSH_ADDR_IPV4 = 0,          // address and port
+    OSH_ADDR_LOOPBACK,          // 127.0.0.1 and endpoint id as port
+    OSH_ADDR_BUTT
+} OSH_ADDR_TYPE_ENUM;
+
+/**
+ * fragment of a PDU over MTU, version bits 3 never start a PDU
+ *
+ *  0       0xC0, 0x01 set when more fragments follow
+ *  1       id of the PDU
+ *  2..3    offset of payload in the PDU
+ *  4..     payload
+*/
+#define OSH_NODE_FRAG_MARK              0xC0
+#define OSH_NODE_FRAG_MORE              0x01
+#define OSH_NODE_FRAG_HEAD_LEN          4
+
+typedef struct osh_node_transport_stru osh_node_transport_t;
+
+/* link operations, a frame is never over mtu */
+typedef struct {
+    const char                    *name;
+    OSH_ADDR_TYPE_ENUM        addr_type;
+    // send one frame, bytes sent or < 0
+    int (*send) (osh_node_transport_t *tp, const uint8_t *frame, size_t len,
+                const struct sockaddr_in *to, OSH_TRAFFIC_CLASS_ENUM tc);
+    // receive one frame, bytes received, 0 if none in timeout_ms, < 0 on error
+    int (*recv) (osh_node_transport_t *tp, uint8_t *frame, size_t size,
+                struct sockaddr_in *from, uint32_t timeout_ms);
+    // largest frame of link
+    size_t (*mtu) (osh_node_transport_t *tp);
+    // release link context
+    void (*close) (osh_node_transport_t *tp);
+} osh_node_transport_ops_t;
+
+/* link with fragmentation state */
+struct osh_node_transport_stru {
+    const osh_node_transport_ops_t *ops;
+    void                           *ctx;    // of link
+    size_t                          mtu;
+    SemaphoreHandle_t           tx_lock;    // fragments of one PDU kept together
+    uint8_t                   *tx_frame;    // NULL if PDU always fits
+    uint8_t                     tx_id;
+    uint8_t                   *rx_frame;
+    bool                      rx_active;    // reassembly in progress
+    uint8_t                       rx_id;
+    size_t                       rx_len;    // payload reassembled so far
+    struct sockaddr_in          rx_from;
+};
+
+/* set up transport over link, frame buffers allocated when MTU is small */
+esp_err_t osh_node_transport_init(osh_node_transport_t *tp,
+                                  const osh_node_transport_ops_t *ops,
+                                  void *ctx);
+
+/* close link and free buffers */
+void osh_node_transport_fini(osh_node_transport_t *tp);
+
+/* send PDU, fragmented when over MTU */
+esp_err_t osh_node_transport_send(osh_node_transport_t *tp,
+                                  const uint8_t *pdu,
+                                  size_t len,
+                                  const struct sockaddr_in *to,
+                                  OSH_TRAFFIC_CLASS_ENUM tc);
+
+/* receive PDU into buff, reassembled from fragments, length of PDU,
+   0 if none complete in timeout_ms, < 0 on error */
+int osh_node_transport_recv(osh_node_transport_t *tp,
+                            uint8_t *buff,
+                            size_t size,
+                            struct sockaddr_in *from,
+                            uint32_t timeout_ms);
+
+/* UDP over bound socket, the socket is not closed with the transport */
+esp_err_t osh_node_transport_udp(osh_node_transport_t *tp, int sock);
+
+/* in-process pair, frames sent on one are received on the other, for
+   benchmarks and tests without sockets, mtu 0 for NODE_PROTO_BUFF_SIZE */
+esp_err_t osh_node_transport_loop_pair(osh_node_transport_t *a,
+                                       osh_node_transport_t *b,
+                                       size_t mtu);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* OSH_NODE_TRANSPORT_H */
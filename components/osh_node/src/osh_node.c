@@ -10,6 +10,8 @@
 
 #include "osh_node.h"
 #include "osh_node.inc"
+#include "osh_node_proto.h"
+#include "osh_node_timer.h"
 
 #include "nvs_flash.h"
 
@@ -121,6 +123,9 @@ esp_err_t osh_node_init(void) {
     /* Initialize the event loop */
     ESP_ERROR_CHECK(esp_event_loop_create_default());
 
+    /* Initialize timer wheel for timeouts of modules */
+    ESP_ERROR_CHECK(osh_node_timer_init());
+
     /* restore node name from nvs flash */
     ESP_ERROR_CHECK(read_string_from_nvs("node_name", &g_node.node_bb.node_name));
 
@@ -182,8 +187,11 @@ esp_err_t osh_node_node_name_update(const char *name) {
 
     // set and save
     g_node.node_bb.node_name = strdup(name);
+    esp_err_t res = write_string_to_nvs("node_name", g_node.node_bb.node_name);
 
-    return write_string_to_nvs("node_name", g_node.node_bb.node_name);
+    // tell controllers the new name
+    osh_node_proto_advertise();
+    return res;
 }
 
 /**
@@ -200,6 +208,9 @@ esp_err_t osh_node_dev_name_update(const char *name) {
 
     // set and save
     g_node.node_bb.dev_name = strdup(name);
+    esp_err_t res = write_string_to_nvs("dev_name", g_node.node_bb.dev_name);
 
-    return write_string_to_nvs("dev_name", g_node.node_bb.dev_name);
+    // tell controllers the new name
+    osh_node_proto_advertise();
+    return res;
 }
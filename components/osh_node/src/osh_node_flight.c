@@ -0,0 +1,241 @@
+/*
+ * @Author      : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @Date        : 2024-06-18 21:05:40
+ * @LastEditors : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @LastEditTime: 2024-06-18 23:12:31
+ * @FilePath    : /OpenSmartHome/components/osh_node/src/osh_node_flight.c
+ * @Description : deferred requests and coalescing of identical reads
+ * Copyright (c) 2024 by Zheng, Yang, All Rights Reserved.
+ */
+
+#include <string.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "osh_node_proto.h"
+#include "osh_node_proto.inc"
+#include "osh_node_flight.inc"
+
+static const char *FLIGHT_TAG = "FLIGHT";
+
+static osh_node_flight_table_t g_flight;
+
+// id carries slot in low byte and generation above
+#define flight_slot(id)     ((id) & 0xFF)
+
+/* hash of request content, with its type */
+static uint32_t flight_con_hash(const osh_node_proto_pdu_t *req) {
+    uint8_t con_type = (uint8_t)req->con_type;
+    uint32_t hash = osh_node_fnv1a(OSH_FNV1A_SEED, &con_type, sizeof(con_type));
+    return osh_node_fnv1a(hash, req->oct_rd, req->con_len);
+}
+
+/* lock held */
+static void flight_add_waiter(osh_node_flight_t *flight, const osh_node_proto_pdu_t *req) {
+    osh_node_flight_waiter_t *waiter = &flight->waiters[flight->waiter_num++];
+    waiter->remote_addr = req->session->remote_addr;
+    waiter->transport = req->session->transport;
+    waiter->type = req->type;
+    waiter->token_ind = req->token_ind;
+    waiter->hash_ind = req->hash_ind;
+    waiter->token = req->token;
+    waiter->hash = req->hash;
+    waiter->max_msg_size = req->session->csm.max_msg_size;
+}
+
+/* answer one waiter with result, lock held */
+static void flight_reply(const osh_node_flight_t *flight,
+                        const osh_node_flight_waiter_t *waiter,
+                        const osh_node_proto_pdu_t *result) {
+    bool success = (OSH_CC_SUCCESS == result->code_class);
+    // same as server, success only answered when confirmable
+    if (success && OSH_REQUEST_CONFIRM != waiter->type) return;
+
+    osh_node_proto_pdu_t rsp;
+    memset(&rsp, 0, sizeof(osh_node_proto_pdu_t));
+    rsp.version = OSH_NODE_PROTO_VER;
+    rsp.type = success ? OSH_RESPONSE_ACK : OSH_RESPONSE_RESET;
+    rsp.code_class = result->code_class;
+    rsp.code_code = result->code_code;
+    rsp.token_ind = waiter->token_ind;
+    rsp.hash_ind = waiter->hash_ind;
+    rsp.con_type = result->con_type;
+    rsp.con_len = result->con_len;
+    rsp.data = result->data;
+    if (1 == result->hash_ind) {
+        // content tag, the requester may have it already
+        rsp.hash_ind = 1;
+        rsp.hash = result->hash;
+        if (1 == waiter->hash_ind && waiter->hash == rsp.hash) {
+            rsp.code_code = OSH_SUCCESS_VALID;
+            rsp.con_len = 0;
+            rsp.data = NULL;
+        }
+    }
+    size_t size = MIN(sizeof(g_flight.buff), waiter->max_msg_size);
+    rsp.session = &g_flight.session;
+    rsp.octets = rsp.oct_rd = rsp.oct_wr = g_flight.buff;
+    rsp.octets_size = size;
+
+    // token of the request being answered
+    g_flight.session.last_token = waiter->token;
+    if (ESP_OK != osh_proto_encode_pdu(&g_flight.session, &rsp, g_flight.buff, size)) {
+        ESP_LOGE(FLIGHT_TAG, "failed to encode reply of 0x%lx", flight->entry);
+        return;
+    }
+    if (ESP_OK != osh_node_transport_send(waiter->transport, rsp.oct_rd, rsp.oct_wr - rsp.oct_rd,
+                &waiter->remote_addr, osh_proto_traffic_class(&rsp))) {
+        ESP_LOGE(FLIGHT_TAG, "failed to reply to %s", inet_ntoa(waiter->remote_addr.sin_addr));
+    }
+}
+
+/* answer all waiters and free flight, lock held */
+static void flight_finish(osh_node_flight_t *flight, const osh_node_proto_pdu_t *result) {
+    for (size_t i = 0; i < flight->waiter_num; i++) {
+        flight_reply(flight, &flight->waiters[i], result);
+    }
+    flight->id = 0;
+    flight->waiter_num = 0;
+}
+
+/** -------------------------------
+ *            functions
+ *  -------------------------------
+*/
+
+/* init flights */
+esp_err_t osh_flight_init(void) {
+    if (NULL == g_flight.lock) {
+        g_flight.lock = xSemaphoreCreateMutex();
+        if (NULL == g_flight.lock) {
+            ESP_LOGE(FLIGHT_TAG, "failed to create flight lock");
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    xSemaphoreTake(g_flight.lock, portMAX_DELAY);
+    memset(&g_flight.session, 0, sizeof(g_flight.session));
+    memset(g_flight.flights, 0, sizeof(g_flight.flights));
+    xSemaphoreGive(g_flight.lock);
+    return ESP_OK;
+}
+
+/* fini flights */
+void osh_flight_fini(void) {
+    if (NULL == g_flight.lock) return;
+    xSemaphoreTake(g_flight.lock, portMAX_DELAY);
+    memset(g_flight.flights, 0, sizeof(g_flight.flights));
+    xSemaphoreGive(g_flight.lock);
+}
+
+/* park on identical read */
+bool osh_flight_join(const osh_node_proto_pdu_t *request) {
+    if (NULL == g_flight.lock) return false;
+
+    bool joined = false;
+    uint32_t con_hash = flight_con_hash(request);
+    xSemaphoreTake(g_flight.lock, portMAX_DELAY);
+    for (int i = 0; i < CONFIG_NODE_PROTO_FLIGHT_NUM; i++) {
+        osh_node_flight_t *flight = &g_flight.flights[i];
+        if (0 == flight->id || !flight->coalesce || request->entry != flight->entry ||
+            request->code_code != flight->method || con_hash != flight->con_hash) continue;
+        if (CONFIG_NODE_PROTO_FLIGHT_WAITER_NUM <= flight->waiter_num) break;
+        flight_add_waiter(flight, request);
+        joined = true;
+        ESP_LOGD(FLIGHT_TAG, "0x%lx joined flight 0x%lx. [0x%x]",
+                request->entry, flight->id, request->mid);
+        break;
+    }
+    xSemaphoreGive(g_flight.lock);
+    return joined;
+}
+
+/* answer flights out of time */
+size_t osh_flight_expire(void) {
+    if (NULL == g_flight.lock) return 0;
+
+    size_t num = 0;
+    TickType_t now = xTaskGetTickCount();
+    xSemaphoreTake(g_flight.lock, portMAX_DELAY);
+    for (int i = 0; i < CONFIG_NODE_PROTO_FLIGHT_NUM; i++) {
+        osh_node_flight_t *flight = &g_flight.flights[i];
+        if (0 == flight->id) continue;
+        if ((TickType_t)(now - flight->start) >= pdMS_TO_TICKS(CONFIG_NODE_PROTO_FLIGHT_TIMEOUT)) {
+            ESP_LOGW(FLIGHT_TAG, "flight 0x%lx of 0x%lx timeout", flight->id, flight->entry);
+            osh_node_proto_pdu_t result;
+            memset(&result, 0, sizeof(osh_node_proto_pdu_t));
+            result.code_class = OSH_CC_SERVER_ERR;
+            result.code_code = OSH_SERR_TIMEOUT;
+            result.con_type = OSH_CONTENT_OCTETS;
+            flight_finish(flight, &result);
+            continue;
+        }
+        num++;
+    }
+    xSemaphoreGive(g_flight.lock);
+    return num;
+}
+
+/* defer request */
+osh_node_proto_flight_t osh_node_proto_defer(const osh_node_proto_pdu_t *request) {
+    if (NULL == request || NULL == request->session) return 0;
+    if (NULL == g_flight.lock) return 0;
+
+    osh_node_proto_flight_t id = 0;
+    xSemaphoreTake(g_flight.lock, portMAX_DELAY);
+    for (int i = 0; i < CONFIG_NODE_PROTO_FLIGHT_NUM; i++) {
+        osh_node_flight_t *flight = &g_flight.flights[i];
+        if (0 != flight->id) continue;
+
+        if (0 == ++g_flight.gen || 0xFFFFFF < g_flight.gen) g_flight.gen = 1;
+        id = (g_flight.gen << 8) | (uint32_t)i;
+        flight->id = id;
+        flight->entry = request->entry;
+        flight->method = request->code_code;
+        flight->con_hash = flight_con_hash(request);
+        flight->coalesce = (OSH_METHOD_GET == request->code_code ||
+                            OSH_METHOD_FETCH == request->code_code);
+        flight->start = xTaskGetTickCount();
+        flight->waiter_num = 0;
+        flight_add_waiter(flight, request);
+        break;
+    }
+    xSemaphoreGive(g_flight.lock);
+
+    if (0 == id) ESP_LOGW(FLIGHT_TAG, "no flight left for 0x%lx. [0x%x]", request->entry, request->mid);
+    return id;
+}
+
+/* resolve deferred request */
+esp_err_t osh_node_proto_resolve(osh_node_proto_flight_t id,
+                                 OSH_CODE_CLASS_ENUM code_class,
+                                 uint8_t code_code,
+                                 OSH_CONTENT_TYPE_ENUM con_type,
+                                 const void *data,
+                                 size_t len) {
+    if (0 == id || CONFIG_NODE_PROTO_FLIGHT_NUM <= flight_slot(id)) return ESP_ERR_INVALID_ARG;
+    if (0 < len && NULL == data) return ESP_ERR_INVALID_ARG;
+    if (NULL == g_flight.lock) return ESP_ERR_INVALID_STATE;
+
+    osh_node_proto_pdu_t result;
+    memset(&result, 0, sizeof(osh_node_proto_pdu_t));
+    result.code_class = code_class;
+    result.code_code = code_code;
+    result.con_type = con_type;
+    result.con_len = len;
+    result.data = (void *)data;
+
+    esp_err_t res = ESP_ERR_NOT_FOUND;
+    xSemaphoreTake(g_flight.lock, portMAX_DELAY);
+    osh_node_flight_t *flight = &g_flight.flights[flight_slot(id)];
+    if (id == flight->id) {
+        // tagged and cached as a direct read of the route
+        osh_proto_tag_result(flight->entry, flight->method, &result);
+        // already answered 5.04 if not found
+        flight_finish(flight, &result);
+        res = ESP_OK;
+    }
+    xSemaphoreGive(g_flight.lock);
+    return res;
+}
@@ -8,391 +8,647 @@
  * Copyright (c) 2024 by Zheng, Yang, All Rights Reserved.
  */
 
+#include <sys/param.h>
+
+#include "freertos/task.h"
+#include "esp_timer.h"
+
 #include "osh_node_fsm.h"
 #include "osh_node_fsm.inc"
 
 static const char *FSM_TAG = "FSM";
 
-/* singleton FSM */
- osh_node_fsm_t *g_osh_fsm = NULL;
-
-/* check and create if FSM not exists */
-esp_err_t osh_fsm_verify(void) {
-    if (NULL != g_osh_fsm) return ESP_OK;
-    g_osh_fsm = malloc(sizeof( osh_node_fsm_t));
-    if (NULL == g_osh_fsm) {
-        ESP_LOGE(FSM_TAG, "failed to malloc FSM");
-        return ESP_ERR_NO_MEM;
-    }
-    memset(g_osh_fsm, 0, sizeof( osh_node_fsm_t));
-    g_osh_fsm->event_group = xEventGroupCreate();
-    if (NULL == g_osh_fsm->event_group) {
-        ESP_LOGE(FSM_TAG, "failed to create event group");
-        free(g_osh_fsm);
-        return OSH_ERR_FSM_INNER;
-    }
-    g_osh_fsm->current_state = OSH_FSM_STATE_BUTT;
-
-    return ESP_OK;
+/* FSM task */
+static osh_node_fsm_disp_t g_fsm_disp = {
+    .lock = portMUX_INITIALIZER_UNLOCKED,
+};
+
+#define FSM_EVENT_BIT(e)    ((uint64_t)1 << (e))
+
+/* id of next FSM created */
+static uint8_t g_fsm_id = 0;
+
+#if CONFIG_NODE_FSM_TRACE_ENABLE
+_Static_assert(0 == (CONFIG_NODE_FSM_TRACE_NUM & (CONFIG_NODE_FSM_TRACE_NUM - 1)),
+                "NODE_FSM_TRACE_NUM must be power of 2");
+_Static_assert(OSH_NODE_FSM_TRACE_RECORD_LEN == sizeof(osh_node_fsm_trace_t),
+                "trace record layout");
+
+/* trace of dispatched events */
+static osh_node_fsm_ring_t g_fsm_trace = {0};
+
+/* record one dispatched event, a plain store in ring, published by head */
+static inline void fsm_trace_put(const osh_node_fsm_t *fsm, uint8_t state,
+                        const osh_node_fsm_msg_t *msg, const osh_node_fsm_slot_t *slot,
+                        esp_err_t res, uint32_t time, uint32_t cost) {
+    uint32_t head = g_fsm_trace.head;
+    osh_node_fsm_trace_t *rec = &g_fsm_trace.records[head & (CONFIG_NODE_FSM_TRACE_NUM - 1)];
+    rec->time = time;
+    rec->cost = cost;
+    rec->callback = (uint32_t)(uintptr_t)slot->callback;
+    rec->result = res;
+    rec->fsm = fsm->id;
+    rec->state = state;
+    rec->event = msg->event;
+    rec->next = fsm->current_state;
+    __atomic_store_n(&g_fsm_trace.head, head + 1, __ATOMIC_RELEASE);
 }
 
-static esp_err_t osh_fsm_create_state(OSH_FSM_STATES_ENUM state,
-                osh_node_fsm_state_t **fsm_state) {
-    // create
-    osh_node_fsm_state_t *tmp_state = malloc(sizeof(osh_node_fsm_state_t));
-    if (NULL == tmp_state) {
-        ESP_LOGE(FSM_TAG, "failedto malloc FSM state %d", state);
-        *fsm_state = NULL;
-        return ESP_ERR_NO_MEM;
-    }
-
-    // init
-    memset(tmp_state, 0, sizeof(osh_node_fsm_state_t));
-    vListInitialiseItem(&tmp_state->state_item);
-    vListInitialise(&tmp_state->events_list);
-    listSET_LIST_ITEM_OWNER(&tmp_state->state_item, tmp_state);
-    tmp_state->state = state;
-
-    // insert to list
-    tmp_state->state_item.xItemValue = (int)state;  // using state as value
-    vListInsert(&g_osh_fsm->states_list, &tmp_state->state_item);
-
-    ESP_LOGI(FSM_TAG, "create state %d", state);
-    *fsm_state = tmp_state;
-    return ESP_OK;
+/* big endian */
+static inline uint8_t *fsm_put_u32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+    return p + 4;
+}
+#endif
+
+/* slot of event in state, event registered */
+static inline const osh_node_fsm_slot_t *fsm_slot(const osh_node_fsm_t *fsm,
+                        uint8_t state, uint32_t event) {
+    const osh_node_fsm_row_t *row = &fsm->rows[state];
+    return &fsm->slots[row->first +
+                __builtin_popcountll(row->events & (FSM_EVENT_BIT(event) - 1))];
 }
 
-/* get or create if state not exists */
-esp_err_t osh_fsm_fetch_state(OSH_FSM_STATES_ENUM state,
-                osh_node_fsm_state_t **fsm_state) {
-    if (NULL == g_osh_fsm) return OSH_ERR_FSM_NOT_INIT;
+/* rows and slots registered at runtime, right after the instance */
+static inline osh_node_fsm_row_t *fsm_rows_rw(osh_node_fsm_t *fsm) {
+    return (osh_node_fsm_row_t *)&fsm[1];
+}
 
-    // traverse to find the state
-    if (listLIST_IS_EMPTY(&g_osh_fsm->states_list)) {
-        // empty list
-        return osh_fsm_create_state(state, fsm_state);
-    }
+static inline osh_node_fsm_slot_t *fsm_slots_rw(osh_node_fsm_t *fsm) {
+    return (osh_node_fsm_slot_t *)&fsm_rows_rw(fsm)[fsm->state_num];
+}
 
-    // ESP_LOGI(FSM_TAG, "searching state %d...", (int)state);
-    osh_node_fsm_state_t *tmp_state = NULL;
-    listFOR_EACH_ENTRY(&g_osh_fsm->states_list, osh_node_fsm_state_t, tmp_state) {
-        if (state == tmp_state->state) {
-            ESP_LOGI(FSM_TAG, "find state %d", (int)state);
-            *fsm_state = tmp_state;
-            return ESP_OK;
+/* queue event, coalesced by its policy, lock held */
+static esp_err_t fsm_enqueue(osh_node_fsm_t *fsm, uint32_t event, const void *payload, size_t len) {
+    fsm->stats.posted++;
+    if (0 != (fsm->urgent & FSM_EVENT_BIT(event))) g_fsm_disp.urgent_seq++;
+    if (0 == (fsm->queue_each & FSM_EVENT_BIT(event)) &&
+        0 != (fsm->queued & FSM_EVENT_BIT(event))) {
+        fsm->stats.coalesced++;
+        if (0 != (fsm->keep_first & FSM_EVENT_BIT(event))) return ESP_OK;
+        for (size_t i = 0; i < fsm->queue_num; i++) {
+            osh_node_fsm_msg_t *msg = &fsm->queue[i];
+            if (event != msg->event) continue;
+            msg->len = (uint8_t)len;
+            if (0 < len) memcpy(msg->payload, payload, len);
+            break;
         }
+        return ESP_OK;
     }
 
-    // ESP_LOGI(FSM_TAG, "searching state %d end", (int)state);
-    if (state != tmp_state->state) {
-        ESP_LOGI(FSM_TAG, "can't find state %d", (int)state);
-        return osh_fsm_create_state(state, fsm_state);
+    if (fsm->queue_len <= fsm->queue_num) {
+        fsm->stats.overflows++;
+        return ESP_ERR_NO_MEM;
     }
-
+    osh_node_fsm_msg_t *msg = &fsm->queue[fsm->queue_num++];
+    msg->event = (uint8_t)event;
+    msg->len = (uint8_t)len;
+    if (0 < len) memcpy(msg->payload, payload, len);
+    fsm->queued |= FSM_EVENT_BIT(event);
+    if (fsm->stats.peak < fsm->queue_num) fsm->stats.peak = fsm->queue_num;
     return ESP_OK;
 }
 
-/* find state */
-esp_err_t osh_fsm_find_state(OSH_FSM_STATES_ENUM state,
-                osh_node_fsm_state_t **fsm_state) {
-    if (NULL == g_osh_fsm) return OSH_ERR_FSM_NOT_INIT;
-
-    // ESP_LOGI(FSM_TAG, "searching state %d...", (int)state);
-    osh_node_fsm_state_t *tmp_state = NULL;
-    listFOR_EACH_ENTRY(&g_osh_fsm->states_list, osh_node_fsm_state_t, tmp_state) {
-        if (state == tmp_state->state) {
-            ESP_LOGI(FSM_TAG, "find state %d", (int)state);
-            *fsm_state = tmp_state;
-            return ESP_OK;
+/* move queued events of current state into batch, urgent ones first, each
+   kind in order, others stay queued, number moved, lock held */
+static size_t fsm_take_batch(osh_node_fsm_t *fsm) {
+    uint64_t events = fsm->queued & fsm->rows[fsm->current_state].events;
+    if (0 == events) return 0;
+
+    uint64_t urgent = events & fsm->urgent;
+    size_t num = 0, kept = 0;
+    uint64_t queued = 0;
+    if (0 != urgent) {
+        for (size_t i = 0; i < fsm->queue_num; i++) {
+            const osh_node_fsm_msg_t *msg = &fsm->queue[i];
+            if (0 != (urgent & FSM_EVENT_BIT(msg->event))) g_fsm_disp.batch[num++] = *msg;
         }
     }
-
-    *fsm_state = NULL;
-    return OSH_ERR_FSM_UNKNOW_STATE;
+    for (size_t i = 0; i < fsm->queue_num; i++) {
+        const osh_node_fsm_msg_t *msg = &fsm->queue[i];
+        uint64_t bit = FSM_EVENT_BIT(msg->event);
+        if (0 != (events & bit)) {
+            if (0 == (urgent & bit)) g_fsm_disp.batch[num++] = *msg;
+        } else {
+            if (kept != i) fsm->queue[kept] = *msg;
+            queued |= bit;
+            kept++;
+        }
+    }
+    fsm->queue_num = kept;
+    fsm->queued = queued;
+    return num;
 }
 
-/* get event */
-esp_err_t osh_fsm_get_event(osh_node_fsm_state_t *fsm_state,
-                EventBits_t bits, osh_node_fsm_event_t **fsm_event){
-
-    if (NULL == fsm_state) {
-        ESP_LOGE(FSM_TAG, "can't fetch event with NULL state");
-        return OSH_ERR_FSM_MISS_STATE;
+/* put batch from index first back to front of queue, lock held. one
+   posted again meanwhile is merged as if it had stayed queued, the ones
+   over the queue are dropped */
+static void fsm_requeue(osh_node_fsm_t *fsm, size_t first, size_t num) {
+    size_t back = 0;
+    for (size_t i = first; i < num; i++) {
+        const osh_node_fsm_msg_t *msg = &g_fsm_disp.batch[i];
+        uint64_t bit = FSM_EVENT_BIT(msg->event);
+        if (0 == (fsm->queue_each & bit) && 0 != (fsm->queued & bit)) {
+            fsm->stats.coalesced++;
+            if (0 == (fsm->keep_first & bit)) continue;
+            for (size_t j = 0; j < fsm->queue_num; j++) {
+                if (msg->event == fsm->queue[j].event) {
+                    fsm->queue[j] = *msg;
+                    break;
+                }
+            }
+            continue;
+        }
+        g_fsm_disp.batch[first + back++] = *msg;
     }
 
-    // traverse to find the event
-    if (listLIST_IS_EMPTY(&fsm_state->events_list)) {
-        // empty list
-        ESP_LOGW(FSM_TAG, "state %d empty events", (int)fsm_state->state);
-        return OSH_ERR_FSM_MISS_EVENT;
+    size_t room = fsm->queue_len - fsm->queue_num;
+    if (back > room) {
+        fsm->stats.overflows += back - room;
+        back = room;
     }
+    memmove(&fsm->queue[back], fsm->queue, fsm->queue_num * sizeof(osh_node_fsm_msg_t));
+    memcpy(fsm->queue, &g_fsm_disp.batch[first], back * sizeof(osh_node_fsm_msg_t));
+    for (size_t i = 0; i < back; i++) fsm->queued |= FSM_EVENT_BIT(fsm->queue[i].event);
+    fsm->queue_num += back;
+    if (fsm->stats.peak < fsm->queue_num) fsm->stats.peak = fsm->queue_num;
+}
 
-    osh_node_fsm_event_t *tmp_event = NULL;
-    listFOR_EACH_ENTRY(&fsm_state->events_list, osh_node_fsm_event_t, tmp_event) {
-        if (bits == tmp_event->bits) {
-            ESP_LOGD(FSM_TAG, "find event %d", (int)bits);
-            *fsm_event = tmp_event;
-            return ESP_OK;
-        }
+#if CONFIG_NODE_FSM_PREEMPT
+/* an urgent event of its state queued to a FSM, lock held */
+static bool fsm_urgent_ready(void) {
+    for (osh_node_fsm_t *fsm = g_fsm_disp.head; NULL != fsm; fsm = fsm->next) {
+        if (0 != (fsm->queued & fsm->urgent & fsm->rows[fsm->current_state].events)) return true;
     }
-    ESP_LOGW(FSM_TAG, "can't find event %d at state %d",
-            (int)bits, (int)fsm_state->state);
-    *fsm_event = NULL;
-    return OSH_ERR_FSM_MISS_EVENT;
+    return false;
 }
-
-/* create event */
-esp_err_t osh_fsm_create_event(osh_node_fsm_state_t *fsm_state, EventBits_t bits,
-                osh_node_fsm_event_cb callback, osh_node_fsm_event_t **fsm_event) {
-    if (NULL == fsm_state) {
-        ESP_LOGE(FSM_TAG, "can't create event with NULL state");
-        return OSH_ERR_FSM_MISS_STATE;
+#endif
+
+/* take FSM out of the FSM task, lock held */
+static void fsm_detach(osh_node_fsm_t *fsm) {
+    if (!fsm->started) return;
+    for (osh_node_fsm_t **pp = &g_fsm_disp.head; NULL != *pp; pp = &(*pp)->next) {
+        if (fsm == *pp) {
+            *pp = fsm->next;
+            break;
+        }
     }
+    if (g_fsm_disp.cursor == fsm) g_fsm_disp.cursor = fsm->next;
+    fsm->next = NULL;
+    fsm->started = false;
+}
 
-    // Orthogonal event bits
-    if (0 != (bits & fsm_state->group_bits)) {
-        ESP_LOGE(FSM_TAG, "state %d bits %d already set",
-                (int)fsm_state->state, (int)bits);
-        return OSH_ERR_FSM_DUP_EVENT;
+/* next FSM with events of its state from cursor on, batch taken, lock held */
+static osh_node_fsm_t *fsm_next_ready(size_t *num) {
+    // urgent events go before any turn, round robin goes on after
+    for (osh_node_fsm_t *fsm = g_fsm_disp.head; NULL != fsm; fsm = fsm->next) {
+        if (0 != (fsm->queued & fsm->urgent & fsm->rows[fsm->current_state].events)) {
+            *num = fsm_take_batch(fsm);
+            return fsm;
+        }
     }
 
-    // create
-    osh_node_fsm_event_t *tmp_event = malloc(sizeof(osh_node_fsm_event_t));
-    if (NULL == tmp_event) {
-        ESP_LOGE(FSM_TAG, "failedto malloc FSM state %d", (int)fsm_state->state);
-        *fsm_event = NULL;
-        return ESP_ERR_NO_MEM;
+    osh_node_fsm_t *start = (NULL == g_fsm_disp.cursor) ? g_fsm_disp.head : g_fsm_disp.cursor;
+    osh_node_fsm_t *fsm = start;
+    while (NULL != fsm) {
+        *num = fsm_take_batch(fsm);
+        osh_node_fsm_t *next = (NULL == fsm->next) ? g_fsm_disp.head : fsm->next;
+        if (0 < *num) {
+            g_fsm_disp.cursor = next;
+            return fsm;
+        }
+        fsm = (next == start) ? NULL : next;
     }
+    return NULL;
+}
 
-    // init
-    memset(tmp_event, 0, sizeof(osh_node_fsm_event_t));
-    vListInitialiseItem(&tmp_event->event_item);
-    listSET_LIST_ITEM_OWNER(&tmp_event->event_item, tmp_event);
-    tmp_event->callback = callback;
-    tmp_event->bits = bits;
+/* dispatch events of all FSMs, one batch of a FSM at a time in turn */
+static void fsm_task(void *arg) {
+    while (1) {
+        size_t num = 0;
+        portENTER_CRITICAL_SAFE(&g_fsm_disp.lock);
+        osh_node_fsm_t *fsm = fsm_next_ready(&num);
+        g_fsm_disp.running = fsm;
+#if CONFIG_NODE_FSM_PREEMPT
+        uint32_t urgent_seq = g_fsm_disp.urgent_seq;
+#endif
+        portEXIT_CRITICAL_SAFE(&g_fsm_disp.lock);
+        if (NULL == fsm) {
+            xSemaphoreTake(g_fsm_disp.wake, portMAX_DELAY);
+            continue;
+        }
 
-    // register bits
-    fsm_state->group_bits |= bits;
+        // dispatch events taken for the state, the rest put back once it is
+        // left, or when an urgent event is posted meanwhile
+        uint8_t state = fsm->current_state;
+        for (size_t i = 0; i < num && !fsm->deleted; i++) {
+            const osh_node_fsm_msg_t *msg = &g_fsm_disp.batch[i];
+            const osh_node_fsm_slot_t *slot = fsm_slot(fsm, state, msg->event);
+            g_fsm_disp.current = msg;
+            fsm->stats.dispatched++;
+#if CONFIG_NODE_FSM_TRACE_ENABLE
+            // FSM task is not pinned, cycle counters of cores differ
+            int64_t begin = esp_timer_get_time();
+#endif
+            esp_err_t res = (NULL == slot->callback) ? ESP_OK :
+                            slot->callback(slot->conf_arg, fsm->run_arg);
+#if CONFIG_NODE_FSM_TRACE_ENABLE
+            uint32_t cost = (uint32_t)(esp_timer_get_time() - begin);
+#endif
+            g_fsm_disp.current = NULL;
+            if (ESP_OK == res && OSH_FSM_STATE_NONE != slot->next) {
+                fsm->current_state = slot->next;
+            }
+#if CONFIG_NODE_FSM_TRACE_ENABLE
+            fsm_trace_put(fsm, state, msg, slot, res, (uint32_t)begin, cost);
+#endif
+            if (ESP_OK != res) {
+                // FSM failed, the others go on
+                ESP_LOGE(FSM_TAG, "%s stopped, event %d@%d err:%d",
+                        fsm->name, msg->event, state, res);
+                portENTER_CRITICAL_SAFE(&g_fsm_disp.lock);
+                fsm_detach(fsm);
+                portEXIT_CRITICAL_SAFE(&g_fsm_disp.lock);
+                break;
+            }
+            if (i + 1 < num && state != fsm->current_state) {
+                // the rest was taken for the state left, filtered again by the new one
+                portENTER_CRITICAL_SAFE(&g_fsm_disp.lock);
+                if (!fsm->deleted) fsm_requeue(fsm, i + 1, num);
+                portEXIT_CRITICAL_SAFE(&g_fsm_disp.lock);
+                break;
+            }
+#if CONFIG_NODE_FSM_PREEMPT
+            // callback boundary, urgent rest of batch goes on anyway
+            if (i + 1 < num && urgent_seq != g_fsm_disp.urgent_seq &&
+                0 == (fsm->urgent & FSM_EVENT_BIT(g_fsm_disp.batch[i + 1].event))) {
+                bool preempted = false;
+                portENTER_CRITICAL_SAFE(&g_fsm_disp.lock);
+                urgent_seq = g_fsm_disp.urgent_seq;
+                if (!fsm->deleted && fsm_urgent_ready()) {
+                    fsm_requeue(fsm, i + 1, num);
+                    fsm->stats.preempted++;
+                    preempted = true;
+                }
+                portEXIT_CRITICAL_SAFE(&g_fsm_disp.lock);
+                if (preempted) break;
+            }
+#endif
+        }
 
-    // insert to list
-    tmp_event->event_item.xItemValue = (int)bits;  // using bits as value
-    vListInsert(&fsm_state->events_list, &tmp_event->event_item);
-    *fsm_event = tmp_event;
+        // deleted while running is freed here, otherwise by deleter once
+        // running is cleared, so fsm is not touched after the lock
+        portENTER_CRITICAL_SAFE(&g_fsm_disp.lock);
+        bool freeing = fsm->deleted;
+        g_fsm_disp.running = NULL;
+        portEXIT_CRITICAL_SAFE(&g_fsm_disp.lock);
+        if (freeing) free(fsm);
+    }
+}
 
-    ESP_LOGI(FSM_TAG, "create event %d@%d", (int)bits, (int)fsm_state->state);
+static esp_err_t fsm_check_event(osh_node_fsm_t *fsm, uint32_t event, size_t len) {
+    if (NULL == fsm) return OSH_ERR_FSM_NOT_INIT;
+    if (OSH_NODE_EVENT_NUM <= event) return OSH_ERR_FSM_INVALID_EVENT;
+    if (CONFIG_NODE_FSM_PAYLOAD_SIZE < len) return ESP_ERR_INVALID_SIZE;
     return ESP_OK;
 }
 
-/* init FSM */
-esp_err_t osh_node_fsm_init(osh_node_bb_t *node_bb, void *f_conf_arg)
-{
-    if (ESP_OK != osh_fsm_verify()) return OSH_ERR_FSM_INNER;
+/** -------------------------------
+ *            functions
+ *  -------------------------------
+*/
 
-    // init on NOT empty
-    if (!listLIST_IS_EMPTY(&g_osh_fsm->states_list)) {
-        ESP_LOGE(FSM_TAG, "Init FSM  states");
+/* create FSM task if not exists */
+esp_err_t osh_fsm_verify(void) {
+    if (NULL != g_fsm_disp.task) return ESP_OK;
+    if (NULL == g_fsm_disp.wake) {
+        g_fsm_disp.wake = xSemaphoreCreateBinary();
+        if (NULL == g_fsm_disp.wake) {
+            ESP_LOGE(FSM_TAG, "failed to create wake semaphore");
+            return OSH_ERR_FSM_INNER;
+        }
+    }
+    if (pdPASS != xTaskCreate(fsm_task, "fsm", CONFIG_NODE_FSM_TASK_STACK, NULL,
+                        CONFIG_NODE_FSM_TASK_PRIORITY, &g_fsm_disp.task)) {
+        ESP_LOGE(FSM_TAG, "failed to create FSM task");
         return OSH_ERR_FSM_INNER;
     }
+    return ESP_OK;
+}
 
-    // init state list
-    vListInitialise(&g_osh_fsm->states_list);
+/* allocate FSM with its queue, and rows and slots unless fixed */
+static osh_node_fsm_t *fsm_alloc(const char *name, uint8_t state_num, uint8_t slot_num,
+                        uint8_t queue_len, bool fixed) {
+    size_t table = fixed ? 0 : state_num * sizeof(osh_node_fsm_row_t) +
+                                slot_num * sizeof(osh_node_fsm_slot_t);
+    size_t size = sizeof(osh_node_fsm_t) + table + queue_len * sizeof(osh_node_fsm_msg_t);
+    osh_node_fsm_t *tmp = calloc(1, size);
+    if (NULL == tmp) {
+        ESP_LOGE(FSM_TAG, "failed to malloc FSM %s", name);
+        return NULL;
+    }
+    tmp->name = (NULL == name) ? "fsm" : name;
+    tmp->id = g_fsm_id++;
+    tmp->state_num = state_num;
+    tmp->slot_num = slot_num;
+    tmp->queue_len = queue_len;
+    tmp->fixed = fixed;
+    tmp->current_state = OSH_FSM_STATE_NONE;
+    tmp->queue = (osh_node_fsm_msg_t *)((uint8_t *)&tmp[1] + table);
+    if (!fixed) {
+        tmp->rows = fsm_rows_rw(tmp);
+        tmp->slots = fsm_slots_rw(tmp);
+    }
+    ESP_LOGI(FSM_TAG, "create %s (id %d) of %d bytes", tmp->name, tmp->id, size);
+    return tmp;
+}
 
-    g_osh_fsm->node_bb = node_bb;
-    g_osh_fsm->conf_arg = f_conf_arg;
+/* create FSM */
+esp_err_t osh_node_fsm_create(const char *name, uint8_t state_num, uint8_t slot_num,
+                              uint8_t queue_len, osh_node_fsm_handle_t *fsm) {
+    if (NULL == fsm || 0 == state_num || OSH_FSM_STATE_NONE == state_num || 0 == slot_num ||
+        CONFIG_NODE_FSM_QUEUE_LEN < queue_len) return ESP_ERR_INVALID_ARG;
+    if (ESP_OK != osh_fsm_verify()) return OSH_ERR_FSM_INNER;
+    if (0 == queue_len) queue_len = CONFIG_NODE_FSM_QUEUE_LEN;
 
-    // callback
-    if (NULL != g_osh_fsm->init_callback) {
-        ESP_LOGI(FSM_TAG, "init callback...");
-        return g_osh_fsm->init_callback(f_conf_arg);
-    }
+    *fsm = fsm_alloc(name, state_num, slot_num, queue_len, false);
+    return (NULL == *fsm) ? ESP_ERR_NO_MEM : ESP_OK;
+}
+
+/* create FSM running a const table */
+esp_err_t osh_node_fsm_create_from_table(const char *name, const osh_node_fsm_table_t *table,
+                                         uint8_t queue_len, osh_node_fsm_handle_t *fsm) {
+    if (NULL == fsm || NULL == table || 0 == table->state_num ||
+        OSH_FSM_STATE_NONE == table->state_num ||
+        CONFIG_NODE_FSM_QUEUE_LEN < queue_len) return ESP_ERR_INVALID_ARG;
+    if (ESP_OK != osh_fsm_verify()) return OSH_ERR_FSM_INNER;
+    if (0 == queue_len) queue_len = CONFIG_NODE_FSM_QUEUE_LEN;
+
+    osh_node_fsm_t *tmp = fsm_alloc(name, table->state_num, table->slot_num, queue_len, true);
+    if (NULL == tmp) return ESP_ERR_NO_MEM;
+    tmp->rows = table->rows;
+    tmp->slots = table->slots;
+    tmp->slot_used = table->slot_num;
+    tmp->urgent = table->urgent;
+    *fsm = tmp;
     return ESP_OK;
 }
 
-/* register a event and corresponding callback to a state */
-esp_err_t osh_node_fsm_register_event(const OSH_FSM_STATES_ENUM state, const EventBits_t uxBitsToWaitFor,
-                            osh_node_fsm_event_cb handle, void *e_conf_arg)
-{
-    // ESP_LOGI(FSM_TAG, "register event [%d]@[%d] ...", (int)uxBitsToWaitFor, (int)state);
-    if (NULL == g_osh_fsm) {
-        ESP_LOGE(FSM_TAG, "failed to step forward with NULL FSM");
-        return OSH_ERR_FSM_NOT_INIT;
+/* stop and free FSM */
+esp_err_t osh_node_fsm_delete(osh_node_fsm_handle_t fsm) {
+    if (NULL == fsm) return ESP_OK;
+
+    portENTER_CRITICAL_SAFE(&g_fsm_disp.lock);
+    fsm_detach(fsm);
+    bool running = (g_fsm_disp.running == fsm);
+    if (running) fsm->deleted = true;
+    portEXIT_CRITICAL_SAFE(&g_fsm_disp.lock);
+    if (!running) {
+        free(fsm);
+        return ESP_OK;
     }
 
-    // find state
-    esp_err_t res = ESP_FAIL;
-    osh_node_fsm_state_t *fsm_state = NULL;
-    if (ESP_OK != (res = osh_fsm_fetch_state(state, &fsm_state))
-        || NULL == fsm_state) return res;
-
-    // find event before create a new one
-    osh_node_fsm_event_t *fsm_event = NULL;
-    if (ESP_OK == (res = osh_fsm_get_event(fsm_state, uxBitsToWaitFor, &fsm_event))
-        && NULL != fsm_event) {
-        ESP_LOGE(FSM_TAG, "failed to register event %d state %d",
-                (int)uxBitsToWaitFor, (int)state);
-        return OSH_ERR_FSM_DUP_EVENT;
+    // freed by FSM task once its batch is done
+    if (xTaskGetCurrentTaskHandle() == g_fsm_disp.task) return ESP_OK;
+    while (1) {
+        portENTER_CRITICAL_SAFE(&g_fsm_disp.lock);
+        running = (g_fsm_disp.running == fsm);
+        portEXIT_CRITICAL_SAFE(&g_fsm_disp.lock);
+        if (!running) break;
+        vTaskDelay(1);
     }
-    if (ESP_OK != (res = osh_fsm_create_event(fsm_state, uxBitsToWaitFor, handle, &fsm_event))
-        || NULL == fsm_event) return res;
-    fsm_event->conf_arg = e_conf_arg;
-
-    ESP_LOGI(FSM_TAG, "register event [%d]@[%d]",
-                (int)uxBitsToWaitFor, (int)state);
     return ESP_OK;
 }
 
-/* run FSM */
-esp_err_t osh_node_fsm_loop_step(void *run_arg)
+/* register a event and corresponding callback to a state */
+esp_err_t osh_node_fsm_register_event(osh_node_fsm_handle_t fsm, const uint8_t state,
+                                     const uint32_t event,
+                                     osh_node_fsm_event_cb handle, void *e_conf_arg)
 {
-    if (NULL == g_osh_fsm) {
-        ESP_LOGE(FSM_TAG, "failed to step forward with NULL FSM");
+    if (NULL == fsm) {
+        ESP_LOGE(FSM_TAG, "failed to register with NULL FSM");
         return OSH_ERR_FSM_NOT_INIT;
     }
-
-    // find current state
-    esp_err_t res = ESP_FAIL;
-    osh_node_fsm_state_t *fsm_state = NULL;
-    if (ESP_OK != (res = osh_fsm_find_state(g_osh_fsm->current_state, &fsm_state))
-        || NULL == fsm_state) {
-        ESP_LOGE(FSM_TAG, "unknow state %d", (int)g_osh_fsm->current_state);
-
-        if (NULL != g_osh_fsm->miss_callback) {
-            ESP_LOGI(FSM_TAG, "miss state callback...");
-            return g_osh_fsm->miss_callback(g_osh_fsm->conf_arg);
-        }
-
+    if (fsm->fixed) {
+        ESP_LOGE(FSM_TAG, "%s runs a const table", fsm->name);
+        return ESP_ERR_NOT_SUPPORTED;
     }
-    if (0 == fsm_state->group_bits || listLIST_IS_EMPTY(&fsm_state->events_list)) {
-        ESP_LOGE(FSM_TAG, "no event config for state %d", (int)fsm_state->state);
-        return OSH_ERR_FSM_INVALID_STATE;
+    if (fsm->state_num <= state) {
+        ESP_LOGE(FSM_TAG, "invalid state %d of %s", (int)state, fsm->name);
+        return OSH_ERR_FSM_UNKNOW_STATE;
     }
-
-    // dispatch
-    EventBits_t bits = xEventGroupWaitBits(g_osh_fsm->event_group, fsm_state->group_bits,
-                            pdTRUE, pdFALSE, portMAX_DELAY);
-    ESP_LOGI(FSM_TAG, "event happened @%d", fsm_state->state);
-
-    // pre callback
-    if (NULL != g_osh_fsm->pre_callback) {
-        ESP_LOGI(FSM_TAG, "pre callback...");
-        if (ESP_OK != (res = g_osh_fsm->pre_callback(g_osh_fsm->current_state,
-                                                bits, g_osh_fsm->conf_arg))) return res;
+    if (NULL == handle || OSH_NODE_EVENT_NUM <= event) {
+        ESP_LOGE(FSM_TAG, "invalid event %d for state %d", (int)event, (int)state);
+        return OSH_ERR_FSM_INVALID_EVENT;
     }
-
-    osh_node_fsm_event_t *fsm_event = NULL;
-    listFOR_EACH_ENTRY(&fsm_state->events_list, osh_node_fsm_event_t, fsm_event) {
-        if (0 != (bits & fsm_event->bits)) {
-            ESP_LOGI(FSM_TAG, "matched %d@%d",
-                    (int)fsm_event->bits, (int)fsm_state->state);
-            if (NULL == fsm_event->callback) {
-                ESP_LOGE(FSM_TAG, "invalid cb for %d@%d",
-                    (int)fsm_event->bits, (int)fsm_state->state);
-                return OSH_ERR_FSM_INVALID_EVENT;
-            }
-            ESP_LOGI(FSM_TAG, "%d@%d callback...",
-                    (int)fsm_event->bits, (int)fsm_state->state);
-            if (ESP_OK != (res = fsm_event->callback(fsm_event->conf_arg, run_arg))) return res;
-            // DO NOT break, tranverse all events
-        }
+    if (0 != (FSM_EVENT_BIT(event) & fsm->rows[state].events)) {
+        ESP_LOGE(FSM_TAG, "failed to register event %d state %d", (int)event, (int)state);
+        return OSH_ERR_FSM_DUP_EVENT;
     }
-
-    // post callback
-    if (NULL != g_osh_fsm->post_callback) {
-        ESP_LOGI(FSM_TAG, "post callback...");
-        if (ESP_OK != (res = g_osh_fsm->post_callback(g_osh_fsm->current_state,
-                                                bits, g_osh_fsm->conf_arg))) return res;
+    if (fsm->slot_num <= fsm->slot_used) {
+        ESP_LOGE(FSM_TAG, "no slot left in %s", fsm->name);
+        return ESP_ERR_NO_MEM;
     }
+
+    // slots kept in state and event order, insert in place
+    osh_node_fsm_row_t *rows = fsm_rows_rw(fsm);
+    portENTER_CRITICAL_SAFE(&g_fsm_disp.lock);
+    rows[state].events |= FSM_EVENT_BIT(event);
+    size_t index = fsm_slot(fsm, state, event) - fsm->slots;
+    osh_node_fsm_slot_t *slot = &fsm_slots_rw(fsm)[index];
+    memmove(&slot[1], slot, (fsm->slot_used - index) * sizeof(osh_node_fsm_slot_t));
+    slot->callback = handle;
+    slot->conf_arg = e_conf_arg;
+    slot->next = OSH_FSM_STATE_NONE;
+    fsm->slot_used++;
+    for (uint8_t i = state + 1; i < fsm->state_num; i++) rows[i].first++;
+    portEXIT_CRITICAL_SAFE(&g_fsm_disp.lock);
+
+    ESP_LOGI(FSM_TAG, "register event [%d]@[%d] of %s", (int)event, (int)state, fsm->name);
     return ESP_OK;
 }
 
-/* fini FSM */
-esp_err_t osh_node_fsm_fini(void)
-{
-    if (NULL == g_osh_fsm) return ESP_OK;
-
-    esp_err_t res = ESP_FAIL;
-
-    // callback
-    if (NULL != g_osh_fsm->fini_callback) {
-        ESP_LOGI(FSM_TAG, "fini callback...");
-        if (ESP_OK != (res = g_osh_fsm->fini_callback(g_osh_fsm->conf_arg))) return res;
+/* set priority of event */
+esp_err_t osh_node_fsm_set_priority(osh_node_fsm_handle_t fsm, const uint32_t event,
+                                    OSH_FSM_PRIO_ENUM prio) {
+    if (NULL == fsm) return OSH_ERR_FSM_NOT_INIT;
+    if (OSH_NODE_EVENT_NUM <= event || OSH_FSM_PRIO_BUTT <= prio) {
+        return OSH_ERR_FSM_INVALID_EVENT;
     }
+    uint64_t bit = FSM_EVENT_BIT(event);
+    portENTER_CRITICAL_SAFE(&g_fsm_disp.lock);
+    fsm->urgent = (OSH_FSM_PRIO_URGENT == prio) ? (fsm->urgent | bit) : (fsm->urgent & ~bit);
+    portEXIT_CRITICAL_SAFE(&g_fsm_disp.lock);
+    return ESP_OK;
+}
 
-    // clear list
-    if (!listLIST_IS_EMPTY(&g_osh_fsm->states_list)) {
-        // not empty list
-        osh_node_fsm_state_t *fsm_state = NULL;
-        listFOR_EACH_ENTRY(&g_osh_fsm->states_list, osh_node_fsm_state_t, fsm_state) {
-            if (!listLIST_IS_EMPTY(&fsm_state->events_list)) {
-                // not empty list
-                osh_node_fsm_event_t *fsm_event = NULL;
-                listFOR_EACH_ENTRY(&fsm_state->events_list, osh_node_fsm_event_t, fsm_event) {
-                    ESP_LOGI(FSM_TAG, "free state %d event %d",
-                            (int)fsm_state->state, (int)fsm_event->bits);
-                    uxListRemove(&fsm_event->event_item);   // remove from list
-                    free(fsm_event);    // free mem
-                }
-            }
-            ESP_LOGI(FSM_TAG, "free state %d", (int)fsm_state->state);
-            uxListRemove(&fsm_state->state_item);   // remove from list
-            free(fsm_state);
-        }
+/* set coalescing policy of event */
+esp_err_t osh_node_fsm_set_policy(osh_node_fsm_handle_t fsm, const uint32_t event,
+                                  OSH_FSM_COALESCE_ENUM policy) {
+    if (NULL == fsm) return OSH_ERR_FSM_NOT_INIT;
+    if (OSH_NODE_EVENT_NUM <= event || OSH_FSM_COALESCE_BUTT <= policy) {
+        return OSH_ERR_FSM_INVALID_EVENT;
     }
+    uint64_t bit = FSM_EVENT_BIT(event);
+    portENTER_CRITICAL_SAFE(&g_fsm_disp.lock);
+    fsm->keep_first = (OSH_FSM_COALESCE_FIRST == policy) ?
+                        (fsm->keep_first | bit) : (fsm->keep_first & ~bit);
+    fsm->queue_each = (OSH_FSM_COALESCE_NONE == policy) ?
+                        (fsm->queue_each | bit) : (fsm->queue_each & ~bit);
+    portEXIT_CRITICAL_SAFE(&g_fsm_disp.lock);
+    return ESP_OK;
+}
 
-    ESP_LOGI(FSM_TAG, "free FSM");
-    if (NULL != g_osh_fsm->event_group) vEventGroupDelete(g_osh_fsm->event_group);
-    free(g_osh_fsm);
-    g_osh_fsm = NULL;
-
+/* enter state and hand FSM to the FSM task */
+esp_err_t osh_node_fsm_start(osh_node_fsm_handle_t fsm, const uint8_t state, void *run_arg) {
+    if (NULL == fsm) return OSH_ERR_FSM_NOT_INIT;
+    if (fsm->state_num <= state) return OSH_ERR_FSM_UNKNOW_STATE;
+
+    portENTER_CRITICAL_SAFE(&g_fsm_disp.lock);
+    fsm->run_arg = run_arg;
+    fsm->current_state = state;
+    if (!fsm->started) {
+        fsm->next = g_fsm_disp.head;
+        g_fsm_disp.head = fsm;
+        fsm->started = true;
+    }
+    portEXIT_CRITICAL_SAFE(&g_fsm_disp.lock);
+    xSemaphoreGive(g_fsm_disp.wake);
     return ESP_OK;
 }
 
 /* invoke event */
-esp_err_t osh_node_fsm_invoke_event(const EventBits_t uxBitsToSet)
+esp_err_t osh_node_fsm_invoke_event(osh_node_fsm_handle_t fsm, const uint32_t event)
 {
-    if (NULL == g_osh_fsm) return OSH_ERR_FSM_NOT_INIT;
-    xEventGroupSetBits(g_osh_fsm->event_group, uxBitsToSet);
-    return ESP_OK;
+    return osh_node_fsm_post_event(fsm, event, NULL, 0);
+}
+
+esp_err_t osh_node_fsm_invoke_event_from_ISR(osh_node_fsm_handle_t fsm, const uint32_t event)
+{
+    return osh_node_fsm_post_event_from_ISR(fsm, event, NULL, 0);
+}
+
+/* queue event with payload */
+esp_err_t osh_node_fsm_post_event(osh_node_fsm_handle_t fsm, const uint32_t event,
+                                  const void *payload, size_t len)
+{
+    esp_err_t res = fsm_check_event(fsm, event, len);
+    if (ESP_OK != res) return res;
+
+    portENTER_CRITICAL_SAFE(&g_fsm_disp.lock);
+    res = fsm_enqueue(fsm, event, payload, len);
+    portEXIT_CRITICAL_SAFE(&g_fsm_disp.lock);
+    if (ESP_OK == res) xSemaphoreGive(g_fsm_disp.wake);
+    return res;
 }
 
-esp_err_t osh_node_fsm_invoke_event_from_ISR(const EventBits_t uxBitsToSet)
+esp_err_t osh_node_fsm_post_event_from_ISR(osh_node_fsm_handle_t fsm, const uint32_t event,
+                                           const void *payload, size_t len)
 {
-    if (NULL == g_osh_fsm) return OSH_ERR_FSM_NOT_INIT;
-    xEventGroupSetBits(g_osh_fsm->event_group, uxBitsToSet);
+    esp_err_t res = fsm_check_event(fsm, event, len);
+    if (ESP_OK != res) return res;
+
+    portENTER_CRITICAL_SAFE(&g_fsm_disp.lock);
+    res = fsm_enqueue(fsm, event, payload, len);
+    portEXIT_CRITICAL_SAFE(&g_fsm_disp.lock);
+    if (ESP_OK != res) return res;
 
     // xHigherPriorityTaskWoken must be initialised to pdFALSE.
     BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+    xSemaphoreGiveFromISR(g_fsm_disp.wake, &xHigherPriorityTaskWoken);
+    portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
+    return ESP_OK;
+}
 
-    // Set bit 0 and bit 4 in xEventGroup.
-     BaseType_t xResult = xEventGroupSetBitsFromISR(
-                                g_osh_fsm->event_group,
-                                uxBitsToSet,
-                                &xHigherPriorityTaskWoken);
-
-    // Was the message posted successfully?
-    if (xResult == pdPASS) {
-        // If xHigherPriorityTaskWoken is now set to pdTRUE then a context
-        // switch should be requested.  The macro used is port specific and
-        // will be either portYIELD_FROM_ISR() or portEND_SWITCHING_ISR() -
-        // refer to the documentation page for the port being used.
-        portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
-     }
+/* payload of event being dispatched */
+const void *osh_node_fsm_event_payload(size_t *len)
+{
+    const osh_node_fsm_msg_t *msg = g_fsm_disp.current;
+    if (NULL != len) *len = (NULL == msg) ? 0 : msg->len;
+    return (NULL == msg || 0 == msg->len) ? NULL : msg->payload;
+}
 
+/* get statistics of event queue */
+esp_err_t osh_node_fsm_get_stats(osh_node_fsm_handle_t fsm, osh_node_fsm_stats_t *stats)
+{
+    if (NULL == stats) return ESP_ERR_INVALID_ARG;
+    if (NULL == fsm) return OSH_ERR_FSM_NOT_INIT;
+    portENTER_CRITICAL_SAFE(&g_fsm_disp.lock);
+    *stats = fsm->stats;
+    portEXIT_CRITICAL_SAFE(&g_fsm_disp.lock);
     return ESP_OK;
 }
 
 /* get state */
-OSH_FSM_STATES_ENUM osh_node_fsm_get_state(void) {
-    return (NULL == g_osh_fsm) ? OSH_FSM_STATE_BUTT : g_osh_fsm->current_state;
+uint8_t osh_node_fsm_get_state(osh_node_fsm_handle_t fsm) {
+    return (NULL == fsm) ? OSH_FSM_STATE_NONE : fsm->current_state;
 }
 
-/* set state */
-esp_err_t osh_node_fsm_set_state(OSH_FSM_STATES_ENUM state) {
-    if (OSH_FSM_STATE_BUTT <= state) {
-        ESP_LOGE(FSM_TAG, "invalid state %d", state);
+/* set state, queued events of the new state are dispatched next */
+esp_err_t osh_node_fsm_set_state(osh_node_fsm_handle_t fsm, uint8_t state) {
+    if (NULL == fsm) return OSH_ERR_FSM_NOT_INIT;
+    if (fsm->state_num <= state) {
+        ESP_LOGE(FSM_TAG, "invalid state %d of %s", state, fsm->name);
         return OSH_ERR_FSM_INNER;
-    } else {
-        g_osh_fsm->current_state = state;
-        return ESP_OK;
     }
+    fsm->current_state = state;
+    xSemaphoreGive(g_fsm_disp.wake);
+    return ESP_OK;
+}
+
+#if CONFIG_NODE_FSM_TRACE_ENABLE
+/* dump trace, records overwritten while copied are dropped */
+size_t osh_node_fsm_trace_dump(uint32_t from, uint8_t *buff, size_t size, bool *more) {
+    if (NULL != more) *more = false;
+    if (NULL == buff || OSH_NODE_FSM_TRACE_HEAD_LEN > size) return 0;
+
+    // slot of oldest may be written right now, so one less is kept
+    uint32_t head = __atomic_load_n(&g_fsm_trace.head, __ATOMIC_ACQUIRE);
+    uint32_t oldest = (CONFIG_NODE_FSM_TRACE_NUM <= head) ? head - CONFIG_NODE_FSM_TRACE_NUM + 1 : 0;
+    if (from < oldest || from > head) from = oldest;
+    size_t num = MIN((size - OSH_NODE_FSM_TRACE_HEAD_LEN) / OSH_NODE_FSM_TRACE_RECORD_LEN,
+                     head - from);
+
+    uint8_t *p = &buff[OSH_NODE_FSM_TRACE_HEAD_LEN];
+    for (size_t i = 0; i < num; i++) {
+        const osh_node_fsm_trace_t *rec =
+                    &g_fsm_trace.records[(from + i) & (CONFIG_NODE_FSM_TRACE_NUM - 1)];
+        p = fsm_put_u32(p, rec->time);
+        p = fsm_put_u32(p, rec->cost);
+        p = fsm_put_u32(p, rec->callback);
+        p = fsm_put_u32(p, (uint32_t)rec->result);
+        *p++ = rec->fsm;
+        *p++ = rec->state;
+        *p++ = rec->event;
+        *p++ = rec->next;
+    }
+
+    // drop the front overwritten meanwhile
+    uint32_t after = __atomic_load_n(&g_fsm_trace.head, __ATOMIC_ACQUIRE);
+    uint32_t safe = (CONFIG_NODE_FSM_TRACE_NUM <= after) ? after - CONFIG_NODE_FSM_TRACE_NUM + 1 : 0;
+    if (from < safe) {
+        size_t lost = MIN(safe - from, num);
+        memmove(&buff[OSH_NODE_FSM_TRACE_HEAD_LEN],
+                &buff[OSH_NODE_FSM_TRACE_HEAD_LEN + lost * OSH_NODE_FSM_TRACE_RECORD_LEN],
+                (num - lost) * OSH_NODE_FSM_TRACE_RECORD_LEN);
+        from += lost;
+        num -= lost;
+    }
+
+    buff[0] = OSH_NODE_FSM_TRACE_VER;
+    buff[1] = OSH_NODE_FSM_TRACE_RECORD_LEN;
+    buff[2] = num >> 8;
+    buff[3] = num;
+    fsm_put_u32(&buff[4], from);
+    fsm_put_u32(&buff[8], after);
+    buff[12] = 0;
+    buff[13] = 0;
+    buff[14] = 0;
+    buff[15] = 0;
+    if (NULL != more) *more = (from + num < after);
+    return OSH_NODE_FSM_TRACE_HEAD_LEN + num * OSH_NODE_FSM_TRACE_RECORD_LEN;
 }
+#endif
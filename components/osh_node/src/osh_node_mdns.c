@@ -0,0 +1,137 @@
+/*
+ * @Author      : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @Date        : 2024-06-24 20:21:07
+ * @LastEditors : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @LastEditTime: 2024-06-24 22:40:16
+ * @FilePath    : /OpenSmartHome/components/osh_node/src/osh_node_mdns.c
+ * @Description : DNS-SD advertisement of node, found by one query
+ * Copyright (c) 2024 by Zheng, Yang, All Rights Reserved.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_app_desc.h"
+
+#include "osh_node_mdns.inc"
+
+static const char *MDNS_TAG = "MDNS";
+
+static const char *g_txt_keys[OSH_MDNS_TXT_BUTT] = {"node", "dev", "fw", "dir"};
+
+static osh_node_mdns_t g_mdns = {0};
+
+/* current value of TXT record */
+static void mdns_txt_value(OSH_MDNS_TXT_ENUM txt, uint32_t dir_version, char *value) {
+    const char *str = NULL;
+    switch (txt) {
+        case OSH_MDNS_TXT_NODE: str = g_mdns.node_bb->node_name; break;
+        case OSH_MDNS_TXT_DEV:  str = g_mdns.node_bb->dev_name; break;
+        case OSH_MDNS_TXT_FW:   str = esp_app_get_description()->version; break;
+        case OSH_MDNS_TXT_DIR:
+            snprintf(value, OSH_NODE_MDNS_TXT_MAX_LEN + 1, "%08lx", dir_version);
+            return;
+        default: break;
+    }
+    // same cut as names in heartbeat
+    snprintf(value, OSH_NODE_MDNS_TXT_MAX_LEN + 1, "%s", (NULL == str) ? "" : str);
+}
+
+/* instance shown when browsing, node name once given */
+static const char *mdns_instance(void) {
+    const char *node = g_mdns.value[OSH_MDNS_TXT_NODE];
+    return ('\0' != node[0]) ? node : g_mdns.value[OSH_MDNS_TXT_DEV];
+}
+
+/** -------------------------------
+ *            functions
+ *  -------------------------------
+*/
+
+/* start responder */
+esp_err_t osh_mdns_start(osh_node_bb_t *node_bb, uint32_t dir_version) {
+    if (NULL == node_bb) return ESP_ERR_INVALID_ARG;
+    if (NULL == g_mdns.lock) {
+        g_mdns.lock = xSemaphoreCreateMutex();
+        if (NULL == g_mdns.lock) {
+            ESP_LOGE(MDNS_TAG, "failed to create lock");
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    xSemaphoreTake(g_mdns.lock, portMAX_DELAY);
+    if (g_mdns.started) {
+        xSemaphoreGive(g_mdns.lock);
+        return ESP_OK;
+    }
+    g_mdns.node_bb = node_bb;
+    for (int i = 0; i < OSH_MDNS_TXT_BUTT; i++) {
+        mdns_txt_value((OSH_MDNS_TXT_ENUM)i, dir_version, g_mdns.value[i]);
+        g_mdns.txt[i].key = g_txt_keys[i];
+        g_mdns.txt[i].value = g_mdns.value[i];
+    }
+
+    esp_err_t res = mdns_init();
+    if (ESP_OK != res) {
+        ESP_LOGE(MDNS_TAG, "failed to init mDNS, err:%d", res);
+        xSemaphoreGive(g_mdns.lock);
+        return res;
+    }
+    mdns_hostname_set(g_mdns.value[OSH_MDNS_TXT_DEV]);
+    mdns_instance_name_set(mdns_instance());
+    res = mdns_service_add(mdns_instance(), OSH_NODE_MDNS_SERVICE, OSH_NODE_MDNS_PROTO,
+                        CONFIG_NODE_PROTO_PORT, g_mdns.txt, OSH_MDNS_TXT_BUTT);
+    if (ESP_OK != res) {
+        ESP_LOGE(MDNS_TAG, "failed to add service, err:%d", res);
+        mdns_free();
+        xSemaphoreGive(g_mdns.lock);
+        return res;
+    }
+    g_mdns.started = true;
+    xSemaphoreGive(g_mdns.lock);
+    ESP_LOGI(MDNS_TAG, "%s.%s.%s.local advertised", mdns_instance(),
+                        OSH_NODE_MDNS_SERVICE, OSH_NODE_MDNS_PROTO);
+    return ESP_OK;
+}
+
+/* stop responder */
+void osh_mdns_stop(void) {
+    if (NULL == g_mdns.lock) return;
+    xSemaphoreTake(g_mdns.lock, portMAX_DELAY);
+    if (g_mdns.started) {
+        mdns_service_remove(OSH_NODE_MDNS_SERVICE, OSH_NODE_MDNS_PROTO);
+        mdns_free();
+        g_mdns.started = false;
+    }
+    xSemaphoreGive(g_mdns.lock);
+}
+
+/* announce changed TXT records only, nothing sent when all are the same */
+void osh_mdns_refresh(uint32_t dir_version) {
+    if (NULL == g_mdns.lock) return;
+    xSemaphoreTake(g_mdns.lock, portMAX_DELAY);
+    if (!g_mdns.started) {
+        xSemaphoreGive(g_mdns.lock);
+        return;
+    }
+
+    char value[OSH_NODE_MDNS_TXT_MAX_LEN + 1];
+    for (int i = 0; i < OSH_MDNS_TXT_BUTT; i++) {
+        mdns_txt_value((OSH_MDNS_TXT_ENUM)i, dir_version, value);
+        if (0 == strcmp(value, g_mdns.value[i])) continue;
+
+        strcpy(g_mdns.value[i], value);
+        if (OSH_MDNS_TXT_NODE == i) {
+            mdns_service_instance_name_set(OSH_NODE_MDNS_SERVICE, OSH_NODE_MDNS_PROTO,
+                        mdns_instance());
+        } else if (OSH_MDNS_TXT_DEV == i) {
+            mdns_hostname_set(g_mdns.value[OSH_MDNS_TXT_DEV]);
+        }
+        esp_err_t res = mdns_service_txt_item_set(OSH_NODE_MDNS_SERVICE, OSH_NODE_MDNS_PROTO,
+                        g_txt_keys[i], g_mdns.value[i]);
+        if (ESP_OK != res) {
+            ESP_LOGW(MDNS_TAG, "failed to update TXT %s, err:%d", g_txt_keys[i], res);
+        }
+    }
+    xSemaphoreGive(g_mdns.lock);
+}
@@ -0,0 +1,189 @@
+/*
+ * @Author      : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @Date        : 2024-06-12 20:34:05
+ * @LastEditors : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @LastEditTime: 2024-06-12 22:18:51
+ * @FilePath    : /OpenSmartHome/components/osh_node/src/osh_node_peer.c
+ * @Description : peer directory built from heartbeats
+ * Copyright (c) 2024 by Zheng, Yang, All Rights Reserved.
+ */
+
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "osh_node_peer.h"
+#include "osh_node_peer.inc"
+
+static const char *PEER_TAG = "PEER";
+
+static osh_node_peer_dir_t g_peer_dir;
+
+// peer is dead after missing some heartbeats
+#define PEER_EXPIRE_TICKS \
+    pdMS_TO_TICKS(CONFIG_NODE_PROTO_HB_PERIOD * 1000 * CONFIG_NODE_PEER_EXPIRE_MISSES)
+
+#define peer_slot(hash)     ((hash) & (OSH_PEER_INDEX_SIZE - 1))
+
+static uint32_t peer_hash(const char *name) {
+    return osh_node_fnv1a(OSH_FNV1A_SEED, name, strlen(name));
+}
+
+/* find peer through index, -1 if not found */
+static int peer_index_find(const uint8_t *index, const char *name, bool by_dev) {
+    for (uint32_t slot = peer_slot(peer_hash(name)); 0 != index[slot];
+         slot = peer_slot(slot + 1)) {
+        osh_node_peer_t *peer = &g_peer_dir.peers[index[slot] - 1];
+        if (0 == strcmp(by_dev ? peer->dev_name : peer->node_name, name)) {
+            return index[slot] - 1;
+        }
+    }
+    return -1;
+}
+
+static void peer_index_add(uint8_t *index, const char *name, int idx) {
+    uint32_t slot = peer_slot(peer_hash(name));
+    while (0 != index[slot]) slot = peer_slot(slot + 1);
+    index[slot] = (uint8_t)(idx + 1);
+}
+
+/* rebuild indexes after peers moved */
+static void peer_index_rebuild(void) {
+    memset(g_peer_dir.dev_index, 0, sizeof(g_peer_dir.dev_index));
+    memset(g_peer_dir.name_index, 0, sizeof(g_peer_dir.name_index));
+    for (size_t i = 0; i < g_peer_dir.num; i++) {
+        osh_node_peer_t *peer = &g_peer_dir.peers[i];
+        peer_index_add(g_peer_dir.dev_index, peer->dev_name, i);
+        if ('\0' != peer->node_name[0]) peer_index_add(g_peer_dir.name_index, peer->node_name, i);
+    }
+}
+
+/* drop expired peers, keep array dense, lock held */
+static void peer_expire(TickType_t now) {
+    size_t num = 0;
+    for (size_t i = 0; i < g_peer_dir.num; i++) {
+        osh_node_peer_t *peer = &g_peer_dir.peers[i];
+        if ((TickType_t)(now - peer->last_seen) > PEER_EXPIRE_TICKS) {
+            ESP_LOGI(PEER_TAG, "peer %s expired", peer->dev_name);
+            continue;
+        }
+        if (num != i) g_peer_dir.peers[num] = *peer;
+        num++;
+    }
+    if (num != g_peer_dir.num) {
+        g_peer_dir.num = num;
+        peer_index_rebuild();
+    }
+}
+
+/** -------------------------------
+ *            functions
+ *  -------------------------------
+*/
+
+/* init peer directory */
+esp_err_t osh_peer_init(void) {
+    if (NULL == g_peer_dir.lock) {
+        g_peer_dir.lock = xSemaphoreCreateMutex();
+        if (NULL == g_peer_dir.lock) {
+            ESP_LOGE(PEER_TAG, "failed to create peer lock");
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    xSemaphoreTake(g_peer_dir.lock, portMAX_DELAY);
+    g_peer_dir.num = 0;
+    peer_index_rebuild();
+    xSemaphoreGive(g_peer_dir.lock);
+    return ESP_OK;
+}
+
+/* add or refresh a peer from heartbeat */
+esp_err_t osh_peer_update(const char *dev_name, const char *node_name,
+                        const struct sockaddr_in *addr) {
+    if (NULL == dev_name || '\0' == dev_name[0] || NULL == addr) return ESP_ERR_INVALID_ARG;
+    if (NULL == g_peer_dir.lock) return ESP_ERR_INVALID_STATE;
+    if (NULL == node_name) node_name = "";
+
+    TickType_t now = xTaskGetTickCount();
+    xSemaphoreTake(g_peer_dir.lock, portMAX_DELAY);
+
+    int idx = peer_index_find(g_peer_dir.dev_index, dev_name, true);
+    bool fresh = (-1 == idx);
+    if (fresh) {
+        peer_expire(now);
+        if (CONFIG_NODE_PEER_CAPACITY <= g_peer_dir.num) {
+            // full, replace the one not heard for the longest time
+            idx = 0;
+            for (size_t i = 1; i < g_peer_dir.num; i++) {
+                if ((TickType_t)(now - g_peer_dir.peers[i].last_seen) >
+                    (TickType_t)(now - g_peer_dir.peers[idx].last_seen)) idx = i;
+            }
+            ESP_LOGW(PEER_TAG, "directory full, replace %s", g_peer_dir.peers[idx].dev_name);
+        } else {
+            idx = g_peer_dir.num++;
+        }
+        ESP_LOGI(PEER_TAG, "new peer %s at %s", dev_name, inet_ntoa(addr->sin_addr));
+    }
+
+    osh_node_peer_t *peer = &g_peer_dir.peers[idx];
+    bool renamed = fresh || (0 != strncmp(peer->dev_name, dev_name, OSH_NODE_PEER_NAME_LEN) ||
+                    0 != strncmp(peer->node_name, node_name, OSH_NODE_PEER_NAME_LEN));
+    strlcpy(peer->dev_name, dev_name, OSH_NODE_PEER_NAME_LEN);
+    strlcpy(peer->node_name, node_name, OSH_NODE_PEER_NAME_LEN);
+    peer->addr = *addr;
+    peer->last_seen = now;
+    if (renamed) peer_index_rebuild();
+
+    xSemaphoreGive(g_peer_dir.lock);
+    return ESP_OK;
+}
+
+/* drop peers not heard for a while */
+void osh_peer_age(void) {
+    if (NULL == g_peer_dir.lock) return;
+    xSemaphoreTake(g_peer_dir.lock, portMAX_DELAY);
+    peer_expire(xTaskGetTickCount());
+    xSemaphoreGive(g_peer_dir.lock);
+}
+
+/* find peer by device name or node name */
+esp_err_t osh_node_peer_lookup(const char *name, osh_node_peer_t *peer) {
+    if (NULL == name || NULL == peer) return ESP_ERR_INVALID_ARG;
+    if (NULL == g_peer_dir.lock) return ESP_ERR_INVALID_STATE;
+
+    esp_err_t res = ESP_ERR_NOT_FOUND;
+    xSemaphoreTake(g_peer_dir.lock, portMAX_DELAY);
+    int idx = peer_index_find(g_peer_dir.dev_index, name, true);
+    if (-1 == idx) idx = peer_index_find(g_peer_dir.name_index, name, false);
+    if (-1 != idx && (TickType_t)(xTaskGetTickCount() - g_peer_dir.peers[idx].last_seen)
+                    <= PEER_EXPIRE_TICKS) {
+        *peer = g_peer_dir.peers[idx];
+        res = ESP_OK;
+    }
+    xSemaphoreGive(g_peer_dir.lock);
+    return res;
+}
+
+/* enumerate alive peers */
+esp_err_t osh_node_peer_foreach(osh_node_peer_visit_cb visit, void *arg) {
+    if (NULL == visit) return ESP_ERR_INVALID_ARG;
+    if (NULL == g_peer_dir.lock) return ESP_ERR_INVALID_STATE;
+
+    xSemaphoreTake(g_peer_dir.lock, portMAX_DELAY);
+    peer_expire(xTaskGetTickCount());
+    for (size_t i = 0; i < g_peer_dir.num; i++) {
+        if (!visit(&g_peer_dir.peers[i], arg)) break;
+    }
+    xSemaphoreGive(g_peer_dir.lock);
+    return ESP_OK;
+}
+
+/* number of alive peers */
+size_t osh_node_peer_count(void) {
+    if (NULL == g_peer_dir.lock) return 0;
+
+    xSemaphoreTake(g_peer_dir.lock, portMAX_DELAY);
+    peer_expire(xTaskGetTickCount());
+    size_t num = g_peer_dir.num;
+    xSemaphoreGive(g_peer_dir.lock);
+    return num;
+}
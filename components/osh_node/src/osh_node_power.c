@@ -0,0 +1,292 @@
+/*
+ * @Author      : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @Date        : 2024-06-30 20:41:27
+ * @LastEditors : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @LastEditTime: 2024-06-30 22:16:40
+ * @FilePath    : /OpenSmartHome/components/osh_node/src/osh_node_power.c
+ * @Description : adaptive power save, policy applied to WiFi in OSH_FSM_STATE_SAVING
+ * Copyright (c) 2024 by Zheng, Yang, All Rights Reserved.
+ */
+
+#include "esp_wifi.h"
+#include "esp_timer.h"
+#if CONFIG_NODE_POWER_LIGHT_SLEEP
+#include "esp_pm.h"
+#endif
+
+#include "osh_node_power.inc"
+#include "osh_node_events.h"
+#include "osh_node_fsm.h"
+#include "osh_node_fsm_table.inc"
+#include "osh_node_status.h"
+
+static const char *POWER_TAG = "POWER";
+
+static osh_node_power_t g_power = {0};
+
+/* millisecond clock of policy, wraps */
+static uint32_t power_now(void) {
+    return (uint32_t)(esp_timer_get_time() / 1000);
+}
+
+#if CONFIG_NODE_POWER_ENABLE
+/* beacons slept through in max modem sleep, within latency target */
+static uint8_t power_listen_interval(void) {
+    uint32_t listen = CONFIG_NODE_POWER_LATENCY_MS / CONFIG_NODE_POWER_BEACON_MS;
+    if (CONFIG_NODE_POWER_LISTEN_MAX < listen) listen = CONFIG_NODE_POWER_LISTEN_MAX;
+    return (0 == listen) ? 1 : (uint8_t)listen;
+}
+#endif
+
+/**
+ * set radio as decided, in FSM task, lock held. listen interval is fixed
+ * at association, so max modem sleep only when policy sleeps through all
+ * of it, otherwise min modem sleep waking every DTIM as when awake
+*/
+static void power_apply(const osh_power_decision_t *decision) {
+    uint8_t listen = 1;
+    if (OSH_POWER_AWAKE != decision->mode && 1 < decision->listen &&
+        g_power.policy.conf.listen_max <= decision->listen) {
+        listen = g_power.policy.conf.listen_max;
+    }
+    if (listen != g_power.applied.listen) {
+        esp_wifi_set_ps((1 < listen) ? WIFI_PS_MAX_MODEM : WIFI_PS_MIN_MODEM);
+    }
+
+#if CONFIG_NODE_POWER_LIGHT_SLEEP
+    if ((OSH_POWER_LIGHT == decision->mode) != (OSH_POWER_LIGHT == g_power.applied.mode)) {
+        esp_pm_config_t pm = {
+            .max_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+            .min_freq_mhz = CONFIG_XTAL_FREQ,
+            .light_sleep_enable = (OSH_POWER_LIGHT == decision->mode),
+        };
+        esp_err_t res = esp_pm_configure(&pm);
+        if (ESP_OK != res) {
+            ESP_LOGW(POWER_TAG, "failed to configure light sleep: %s", esp_err_to_name(res));
+        }
+    }
+#endif
+
+    ESP_LOGI(POWER_TAG, "radio %s, listen %u",
+             (OSH_POWER_AWAKE == decision->mode) ? "awake" :
+             (OSH_POWER_MODEM == decision->mode) ? "modem sleep" : "light sleep",
+             listen);
+    memcpy(&g_power.applied, decision, sizeof(osh_power_decision_t));
+    g_power.applied.listen = listen;
+}
+
+/**
+ * evaluate policy, in FSM task, lock held. leaving and entering
+ * OSH_FSM_STATE_SAVING go through network FSM, an event is posted only in
+ * the state handling it, others stay queued till that state comes
+*/
+static void power_eval(void) {
+    osh_power_decision_t decision;
+    osh_power_policy_eval(&g_power.policy, power_now(), &decision);
+
+    uint8_t state = osh_node_fsm_get_state(g_power.node_bb->net_fsm);
+    if (OSH_FSM_STATE_IDLE == state && OSH_POWER_AWAKE != decision.mode) {
+        osh_node_fsm_invoke_event(g_power.node_bb->net_fsm, OSH_NODE_EVENT_T_SAVE);
+    } else if (OSH_FSM_STATE_SAVING == state && OSH_POWER_AWAKE == decision.mode) {
+        osh_node_fsm_invoke_event(g_power.node_bb->net_fsm, OSH_NODE_EVENT_T_WAKEUP);
+    } else if (OSH_FSM_STATE_SAVING == state && decision.mode != g_power.applied.mode) {
+        // deeper sleep in the same state
+        power_apply(&decision);
+    }
+
+    if (0 == decision.next_ms) {
+        osh_node_timer_cancel(&g_power.timer);
+    } else {
+        osh_node_timer_arm(&g_power.timer, decision.next_ms, 0);
+    }
+}
+
+/* evaluation due, in timer task, left to the FSM task */
+static void power_timeout_cb(void *arg) {
+    osh_node_fsm_invoke_event(g_power.node_bb->net_fsm, OSH_NODE_EVENT_T_IDLE);
+}
+
+/** -------------------------------
+ *         events
+ *  -------------------------------
+*/
+
+/**
+ * state: OSH_FSM_STATE_IDLE
+ * event: OSH_NODE_EVENT_T_SAVE
+ * next state: OSH_FSM_STATE_SAVING, radio sleeps between listen intervals
+*/
+esp_err_t osh_node_power_on_save(void *config, void *arg) {
+    xSemaphoreTake(g_power.lock, portMAX_DELAY);
+    osh_power_decision_t decision;
+    osh_power_policy_eval(&g_power.policy, power_now(), &decision);
+    if (!g_power.running || OSH_POWER_AWAKE == decision.mode) {
+        // traffic came after T_SAVE was posted
+        osh_node_fsm_invoke_event(g_power.node_bb->net_fsm, OSH_NODE_EVENT_T_WAKEUP);
+    } else {
+        power_apply(&decision);
+    }
+    xSemaphoreGive(g_power.lock);
+    osh_node_status_saving(true);
+    return ESP_OK;
+}
+
+/**
+ * state: OSH_FSM_STATE_IDLE, OSH_FSM_STATE_SAVING
+ * event: OSH_NODE_EVENT_T_IDLE
+ * next state: same, T_SAVE or T_WAKEUP posted as policy decides
+*/
+esp_err_t osh_node_power_on_eval(void *config, void *arg) {
+    xSemaphoreTake(g_power.lock, portMAX_DELAY);
+    if (g_power.running) power_eval();
+    xSemaphoreGive(g_power.lock);
+    return ESP_OK;
+}
+
+/**
+ * state: OSH_FSM_STATE_SAVING
+ * event: OSH_NODE_EVENT_T_WAKEUP
+ * next state: OSH_FSM_STATE_IDLE, radio always on
+*/
+esp_err_t osh_node_power_on_wakeup(void *config, void *arg) {
+    xSemaphoreTake(g_power.lock, portMAX_DELAY);
+    osh_power_decision_t awake = {.mode = OSH_POWER_AWAKE, .listen = 1};
+    power_apply(&awake);
+    xSemaphoreGive(g_power.lock);
+    osh_node_status_saving(false);
+    return ESP_OK;
+}
+
+/** -------------------------------
+ *            functions
+ *  -------------------------------
+*/
+
+/* init power save of node on network FSM */
+esp_err_t osh_node_power_init(osh_node_bb_t *node_bb) {
+    if (NULL == node_bb) return ESP_ERR_INVALID_ARG;
+    if (NULL != g_power.lock) return ESP_OK;
+
+    g_power.lock = xSemaphoreCreateMutex();
+    if (NULL == g_power.lock) {
+        ESP_LOGE(POWER_TAG, "failed to create lock");
+        return OSH_ERR_POWER_INNER;
+    }
+    g_power.node_bb = node_bb;
+    g_power.applied.mode = OSH_POWER_AWAKE;
+    g_power.applied.listen = 1;
+    osh_node_timer_setup(&g_power.timer, power_timeout_cb, NULL);
+    return ESP_OK;
+}
+
+/* set listen interval of station, negotiated at association so before connect */
+esp_err_t osh_node_power_set_listen(void) {
+#if CONFIG_NODE_POWER_ENABLE
+    wifi_config_t conf;
+    esp_err_t res = esp_wifi_get_config(WIFI_IF_STA, &conf);
+    if (ESP_OK != res || power_listen_interval() == conf.sta.listen_interval) return res;
+    conf.sta.listen_interval = power_listen_interval();
+    return esp_wifi_set_config(WIFI_IF_STA, &conf);
+#else
+    return ESP_OK;
+#endif
+}
+
+/* start policy when connected, awake, in FSM task */
+esp_err_t osh_node_power_start(void) {
+#if CONFIG_NODE_POWER_ENABLE
+    if (NULL == g_power.lock) return OSH_ERR_POWER_NOT_INIT;
+
+    osh_power_conf_t conf = {
+        .idle_ms = CONFIG_NODE_POWER_IDLE_MS,
+#if CONFIG_NODE_POWER_LIGHT_SLEEP
+        .light_ms = CONFIG_NODE_POWER_LIGHT_IDLE_MS,
+#else
+        .light_ms = 0,
+#endif
+        .latency_ms = CONFIG_NODE_POWER_LATENCY_MS,
+        .beacon_ms = CONFIG_NODE_POWER_BEACON_MS,
+        .early_ms = CONFIG_NODE_POWER_EARLY_MS,
+        .listen_max = power_listen_interval(),
+    };
+
+    xSemaphoreTake(g_power.lock, portMAX_DELAY);
+    osh_power_policy_init(&g_power.policy, &conf, power_now());
+    osh_power_decision_t awake = {.mode = OSH_POWER_AWAKE, .listen = 1};
+    power_apply(&awake);
+    g_power.running = true;
+    power_eval();
+    xSemaphoreGive(g_power.lock);
+
+    ESP_LOGI(POWER_TAG, "saving after %d ms without request", CONFIG_NODE_POWER_IDLE_MS);
+#endif
+    return ESP_OK;
+}
+
+/* stop policy and keep radio awake, in FSM task */
+esp_err_t osh_node_power_stop(void) {
+    if (NULL == g_power.lock) return OSH_ERR_POWER_NOT_INIT;
+
+    xSemaphoreTake(g_power.lock, portMAX_DELAY);
+    g_power.running = false;
+    osh_node_timer_cancel(&g_power.timer);
+    if (OSH_POWER_AWAKE != g_power.applied.mode) {
+        osh_power_decision_t awake = {.mode = OSH_POWER_AWAKE, .listen = 1};
+        power_apply(&awake);
+    }
+    xSemaphoreGive(g_power.lock);
+    // left saving by disconnect
+    osh_node_status_saving(false);
+    return ESP_OK;
+}
+
+/**
+ * a request arrived, wakes the node if saving. awake, the pending
+ * evaluation finds it and waits longer, nothing posted per request
+*/
+void osh_node_power_traffic(void) {
+    if (NULL == g_power.lock) return;
+
+    xSemaphoreTake(g_power.lock, portMAX_DELAY);
+    bool wake = false;
+    if (g_power.running) {
+        osh_power_policy_traffic(&g_power.policy, power_now());
+        wake = (OSH_POWER_AWAKE != g_power.applied.mode);
+    }
+    xSemaphoreGive(g_power.lock);
+    if (wake) osh_node_fsm_invoke_event(g_power.node_bb->net_fsm, OSH_NODE_EVENT_T_IDLE);
+}
+
+/* traffic expected from from_ms until until_ms later, awake ahead of it */
+void osh_node_power_expect(uint32_t from_ms, uint32_t until_ms) {
+    if (NULL == g_power.lock) return;
+
+    xSemaphoreTake(g_power.lock, portMAX_DELAY);
+    bool running = g_power.running;
+    if (running) {
+        uint32_t now = power_now();
+        osh_power_policy_expect(&g_power.policy, now, now + from_ms, now + until_ms);
+    }
+    xSemaphoreGive(g_power.lock);
+    // wake up time set by FSM task
+    if (running) osh_node_fsm_invoke_event(g_power.node_bb->net_fsm, OSH_NODE_EVENT_T_IDLE);
+}
+
+/* get statistics of power save */
+esp_err_t osh_node_power_get_stats(osh_node_power_stats_t *stats) {
+    if (NULL == stats) return ESP_ERR_INVALID_ARG;
+    if (NULL == g_power.lock) return OSH_ERR_POWER_NOT_INIT;
+
+    xSemaphoreTake(g_power.lock, portMAX_DELAY);
+    const osh_power_policy_t *policy = &g_power.policy;
+    stats->mode = g_power.applied.mode;
+    stats->listen = g_power.applied.listen;
+    stats->requests = policy->requests;
+    stats->changes = policy->changes;
+    stats->gap_ms = policy->gap_8 >> 3;
+    stats->awake_ms = policy->time_ms[OSH_POWER_AWAKE];
+    stats->modem_ms = policy->time_ms[OSH_POWER_MODEM];
+    stats->light_ms = policy->time_ms[OSH_POWER_LIGHT];
+    xSemaphoreGive(g_power.lock);
+    return ESP_OK;
+}
@@ -0,0 +1,142 @@
+/*
+ * @Author      : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @Date        : 2024-06-30 20:25:06
+ * @LastEditors : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @LastEditTime: 2024-06-30 21:52:37
+ * @FilePath    : /OpenSmartHome/components/osh_node/src/osh_node_power_policy.c
+ * @Description : power save policy, no ESP-IDF calls so it runs on host too
+ * Copyright (c) 2024 by Zheng, Yang, All Rights Reserved.
+ */
+
+#include <string.h>
+
+#include "osh_node_power_policy.inc"
+
+/* a at or after b on wrapping clock */
+static bool policy_reached(uint32_t a, uint32_t b) {
+    return 0 <= (int32_t)(a - b);
+}
+
+/* earlier of next evaluation and delay, 0 means none */
+static uint32_t policy_sooner(uint32_t next_ms, uint32_t delay_ms) {
+    if (0 == delay_ms) delay_ms = 1;
+    return (0 == next_ms || delay_ms < next_ms) ? delay_ms : next_ms;
+}
+
+/**
+ * beacons to sleep through: within latency target, and short against the
+ * quiet part of expected gap so a request sooner than usual waits little
+*/
+static uint8_t policy_listen(const osh_power_policy_t *policy) {
+    const osh_power_conf_t *conf = &policy->conf;
+    uint32_t listen = conf->latency_ms / conf->beacon_ms;
+
+    if (policy->seen && 0 != policy->gap_8) {
+        uint32_t gap = policy->gap_8 >> 3;
+        uint32_t dev = policy->dev_4 >> 2;
+        // deviation jumps when traffic changes pace, half gap at most
+        uint32_t quiet = gap - ((dev < gap / 2) ? dev : gap / 2);
+        uint32_t by_gap = quiet / (4 * conf->beacon_ms);
+        if (by_gap < listen) listen = by_gap;
+    }
+    if (listen > conf->listen_max) listen = conf->listen_max;
+    return (0 == listen) ? 1 : (uint8_t)listen;
+}
+
+/** -------------------------------
+ *            functions
+ *  -------------------------------
+*/
+
+/* start policy at now_ms, awake */
+void osh_power_policy_init(osh_power_policy_t *policy, const osh_power_conf_t *conf,
+                           uint32_t now_ms) {
+    memset(policy, 0, sizeof(osh_power_policy_t));
+    memcpy(&policy->conf, conf, sizeof(osh_power_conf_t));
+    if (0 == policy->conf.beacon_ms) policy->conf.beacon_ms = 100;
+    if (0 == policy->conf.listen_max) policy->conf.listen_max = 1;
+    if (0 != policy->conf.light_ms && policy->conf.light_ms < policy->conf.idle_ms) {
+        policy->conf.light_ms = policy->conf.idle_ms;
+    }
+    policy->mode = OSH_POWER_AWAKE;
+    policy->last_rx = now_ms;
+    policy->last_eval = now_ms;
+}
+
+/* a request arrived at now_ms */
+void osh_power_policy_traffic(osh_power_policy_t *policy, uint32_t now_ms) {
+    uint32_t gap = now_ms - policy->last_rx;
+    if (OSH_POWER_GAP_MAX_MS < gap) gap = OSH_POWER_GAP_MAX_MS;
+
+    if (!policy->seen) {
+        // time from init is no inter-arrival
+        policy->seen = true;
+    } else if (0 == policy->gap_8) {
+        policy->gap_8 = gap << 3;
+        policy->dev_4 = gap << 1;
+    } else {
+        int32_t err = (int32_t)gap - (int32_t)(policy->gap_8 >> 3);
+        policy->gap_8 += err;
+        if (0 > err) err = -err;
+        policy->dev_4 += err - (int32_t)(policy->dev_4 >> 2);
+    }
+    policy->last_rx = now_ms;
+    policy->requests++;
+}
+
+/* traffic expected between from_ms and until_ms, merged with a pending window */
+void osh_power_policy_expect(osh_power_policy_t *policy, uint32_t now_ms,
+                             uint32_t from_ms, uint32_t until_ms) {
+    if (!policy_reached(until_ms, from_ms)) until_ms = from_ms;
+    if (policy->expecting && !policy_reached(now_ms, policy->expect_until)) {
+        if (policy_reached(policy->expect_from, from_ms)) policy->expect_from = from_ms;
+        if (policy_reached(until_ms, policy->expect_until)) policy->expect_until = until_ms;
+        return;
+    }
+    policy->expecting = true;
+    policy->expect_from = from_ms;
+    policy->expect_until = until_ms;
+}
+
+/* decide radio mode at now_ms */
+void osh_power_policy_eval(osh_power_policy_t *policy, uint32_t now_ms,
+                           osh_power_decision_t *decision) {
+    const osh_power_conf_t *conf = &policy->conf;
+    uint32_t quiet = now_ms - policy->last_rx;
+    uint8_t listen = policy_listen(policy);
+    uint8_t mode;
+    uint32_t next_ms = 0;
+
+    if (quiet < conf->idle_ms) {
+        mode = OSH_POWER_AWAKE;
+        next_ms = conf->idle_ms - quiet;
+    } else if (0 != conf->light_ms && quiet < conf->light_ms) {
+        mode = OSH_POWER_MODEM;
+        next_ms = conf->light_ms - quiet;
+    } else {
+        mode = (0 != conf->light_ms) ? OSH_POWER_LIGHT : OSH_POWER_MODEM;
+    }
+
+    if (policy->expecting && policy_reached(now_ms, policy->expect_until)) {
+        policy->expecting = false;
+    }
+    if (policy->expecting) {
+        // up one listen interval ahead, so expected traffic is not parked at AP
+        uint32_t wake = policy->expect_from - conf->early_ms - listen * conf->beacon_ms;
+        if (policy_reached(now_ms, wake)) {
+            mode = OSH_POWER_AWAKE;
+            next_ms = policy_sooner(next_ms, policy->expect_until - now_ms);
+        } else {
+            next_ms = policy_sooner(next_ms, wake - now_ms);
+        }
+    }
+
+    policy->time_ms[policy->mode] += now_ms - policy->last_eval;
+    policy->last_eval = now_ms;
+    if (mode != policy->mode) policy->changes++;
+    policy->mode = mode;
+
+    decision->mode = mode;
+    decision->listen = (OSH_POWER_AWAKE == mode) ? 1 : listen;
+    decision->next_ms = next_ms;
+}
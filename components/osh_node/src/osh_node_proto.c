@@ -9,16 +9,34 @@
  */
 
 #include <string.h>
+#include <sys/param.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
 
 #include "esp_wifi.h"
+#include "esp_timer.h"
 
 #include "osh_node_proto.h"
 #include "osh_node_proto.inc"
 #include "osh_node_proto_dataframe.h"
+#include "osh_node_fsm.h"
+#include "osh_node_power.h"
+#include "osh_node_peer.inc"
+#include "osh_node_flight.inc"
+#if CONFIG_NODE_PROTO_WORKER_ENABLE
+#include "osh_node_worker.inc"
+#endif
+#if CONFIG_NODE_MDNS_ENABLE
+#include "osh_node_mdns.inc"
+#endif
+#if CONFIG_NODE_RES_ENABLE
+#include "osh_node_res.inc"
+#endif
+#if CONFIG_NODE_PROXY_ENABLE
+#include "osh_node_proxy.inc"
+#endif
 
 static const char *PROTO_TAG = "PROTO";
 
@@ -28,7 +46,7 @@ static osh_node_proto_t g_proto;
  *            proto
  *  -------------------------------
 */
-static esp_err_t proto_decode_pdu(osh_node_proto_session_t *session,
+esp_err_t osh_proto_decode_pdu(osh_node_proto_session_t *session,
                         osh_node_proto_pdu_t *pdu,
                         uint8_t *buff,
                         size_t  buff_len) {
@@ -121,7 +139,8 @@ static void proto_make_token(osh_node_proto_pdu_t *pdu) {
 
 static void proto_make_hash(osh_node_proto_pdu_t *pdu) {
     if (NULL == pdu) return;
-    pdu->hash = (uint32_t)pdu->mid;
+    // keep tag set by route
+    if (0 == pdu->hash) pdu->hash = osh_proto_content_hash(pdu->data, pdu->con_len);
 }
 
 static void proto_init_response(osh_node_proto_session_t *session,
@@ -138,7 +157,7 @@ static void proto_init_response(osh_node_proto_session_t *session,
     pdu->oct_rd = pdu->oct_wr = buff;
 }
 
-static esp_err_t proto_encode_pdu(osh_node_proto_session_t *session,
+esp_err_t osh_proto_encode_pdu(osh_node_proto_session_t *session,
                         osh_node_proto_pdu_t *pdu,
                         uint8_t *buff,
                         size_t  buff_len) {
@@ -147,11 +166,6 @@ static esp_err_t proto_encode_pdu(osh_node_proto_session_t *session,
         return OSH_ERR_PROTO_INNER;
     }
 
-    if (OSH_NODE_PROTO_PDU_HEADER_MIN_LEN > buff_len) {
-        ESP_LOGE(PROTO_TAG, "encode buff overflow [%d]", buff_len);
-        return OSH_ERR_PROTO_BUFF_LEN;
-    }
-
     // get mid
     pdu->mid = (uint16_t)(session->ref++);
     if (1 < (uint8_t)pdu->type && 0 != pdu->token_ind) {
@@ -162,50 +176,105 @@ static esp_err_t proto_encode_pdu(osh_node_proto_session_t *session,
         proto_make_hash(pdu);
     }
 
+    // content written in place by builder stays, header goes right before it
+    size_t head_len = OSH_NODE_PROTO_PDU_HEADER_MIN_LEN +
+                4 * ((pdu->token_ind & 0x01) + (pdu->hash_ind & 0x01) + (pdu->entry_ind & 0x01));
+    uint8_t *content = (uint8_t *)pdu->data;
+    bool in_place = (0 < pdu->con_len && pdu->octets == buff &&
+                content >= &buff[head_len] && content + pdu->con_len <= &buff[pdu->octets_size]);
+    if (head_len + pdu->con_len > buff_len) {
+        ESP_LOGE(PROTO_TAG, "buff overflow [%ld]>[%d]", head_len + pdu->con_len, buff_len);
+        return OSH_ERR_PROTO_BUFF_LEN;
+    }
+    uint8_t *head = in_place ? content - head_len : buff;
+
     // encode
     int offset = 0;
-    buff[0] = (uint8_t) (((pdu->version & 0x03) << 6) |
+    head[0] = (uint8_t) (((pdu->version & 0x03) << 6) |
                         ((pdu->type & 0x03) << 4) |
                         ((pdu->token_ind & 0x01) << 2) |
                         ((pdu->hash_ind & 0x01) << 1) |
                         (pdu->entry_ind & 0x01));
-    buff[1] = (((uint8_t)pdu->code_class & 0x03) << 5) |
+    head[1] = (((uint8_t)pdu->code_class & 0x07) << 5) |
                         (pdu->code_code & 0x1F);
-    buff[2] = (uint8_t)((pdu->mid & 0xFF00) >> 8);
-    buff[3] = (uint8_t)(pdu->mid & 0xFF);
-    buff[4] = (uint8_t)pdu->con_type;
-    buff[5] = (uint8_t)((pdu->con_len & 0xFF0000) >> 16);
-    buff[6] = (uint8_t)((pdu->con_len & 0xFF00) >> 8);
-    buff[7] = (uint8_t)(pdu->con_len & 0xFF);
+    head[2] = (uint8_t)((pdu->mid & 0xFF00) >> 8);
+    head[3] = (uint8_t)(pdu->mid & 0xFF);
+    head[4] = (uint8_t)pdu->con_type;
+    head[5] = (uint8_t)((pdu->con_len & 0xFF0000) >> 16);
+    head[6] = (uint8_t)((pdu->con_len & 0xFF00) >> 8);
+    head[7] = (uint8_t)(pdu->con_len & 0xFF);
     offset += 8;
     if (0 != pdu->token_ind) {
-        buff[offset] = (uint8_t)((pdu->token & 0xFF000000) >> 24);
-        buff[offset+1] = (uint8_t)((pdu->token & 0xFF0000) >> 16);
-        buff[offset+2] = (uint8_t)((pdu->token & 0xFF00) >> 8);
-        buff[offset+3] = (uint8_t)(pdu->token & 0xFF);
+        head[offset] = (uint8_t)((pdu->token & 0xFF000000) >> 24);
+        head[offset+1] = (uint8_t)((pdu->token & 0xFF0000) >> 16);
+        head[offset+2] = (uint8_t)((pdu->token & 0xFF00) >> 8);
+        head[offset+3] = (uint8_t)(pdu->token & 0xFF);
         offset += 4;
     }
     if (0 != pdu->hash_ind) {
-        buff[offset] = (uint8_t)((pdu->hash & 0xFF000000) >> 24);
-        buff[offset+1] = (uint8_t)((pdu->hash & 0xFF0000) >> 16);
-        buff[offset+2] = (uint8_t)((pdu->hash & 0xFF00) >> 8);
-        buff[offset+3] = (uint8_t)(pdu->hash & 0xFF);
+        head[offset] = (uint8_t)((pdu->hash & 0xFF000000) >> 24);
+        head[offset+1] = (uint8_t)((pdu->hash & 0xFF0000) >> 16);
+        head[offset+2] = (uint8_t)((pdu->hash & 0xFF00) >> 8);
+        head[offset+3] = (uint8_t)(pdu->hash & 0xFF);
         offset += 4;
     }
     if (0 != pdu->entry_ind) {
-        buff[offset] = (uint8_t)((pdu->entry & 0xFF000000) >> 24);
-        buff[offset+1] = (uint8_t)((pdu->entry & 0xFF0000) >> 16);
-        buff[offset+2] = (uint8_t)((pdu->entry & 0xFF00) >> 8);
-        buff[offset+3] = (uint8_t)(pdu->entry & 0xFF);
+        head[offset] = (uint8_t)((pdu->entry & 0xFF000000) >> 24);
+        head[offset+1] = (uint8_t)((pdu->entry & 0xFF0000) >> 16);
+        head[offset+2] = (uint8_t)((pdu->entry & 0xFF00) >> 8);
+        head[offset+3] = (uint8_t)(pdu->entry & 0xFF);
         offset += 4;
     }
-    if (offset + pdu->con_len > buff_len) {
-        ESP_LOGE(PROTO_TAG, "buff overflow [%ld]>[%d]", offset+pdu->con_len, buff_len);
-        return OSH_ERR_PROTO_BUFF_LEN;
+    if (!in_place && 0 < pdu->con_len) memmove(&head[offset], pdu->data, pdu->con_len);
+    pdu->oct_rd = head;
+    pdu->oct_wr = &head[offset + pdu->con_len];
+
+    return ESP_OK;
+}
+
+/* bump allocate from arena of session */
+void *osh_node_proto_session_alloc(osh_node_proto_session_t *session, size_t size) {
+    if (NULL == session || NULL == session->arena) return NULL;
+
+    osh_node_proto_arena_t *arena = session->arena;
+    size_t start = (arena->used + 7) & ~(size_t)7;
+    if (start > arena->size || size > arena->size - start) {
+        ESP_LOGW(PROTO_TAG, "scratch arena exhausted, %d of %d used", arena->used, arena->size);
+        return NULL;
     }
-    if (0 < pdu->con_len) memcpy(&buff[offset], pdu->data, pdu->con_len);
-    pdu->oct_wr += (offset + pdu->con_len);
+    arena->used = start + size;
+    return &arena->base[start];
+}
 
+/* reserve content in the send buffer of response */
+uint8_t *osh_node_proto_response_reserve(osh_node_proto_pdu_t *response, size_t len) {
+    if (NULL == response || NULL == response->octets) return NULL;
+
+    // room for the longest header is kept in front
+    uint8_t *content = &response->octets[OSH_NODE_PROTO_PDU_HEADER_MAX_LEN];
+    if (content != response->data) {
+        response->data = content;
+        response->con_len = 0;
+    }
+    size_t limit = response->octets_size;
+    if (NULL != response->session) limit = MIN(limit, response->session->csm.max_msg_size);
+    if (OSH_NODE_PROTO_PDU_HEADER_MAX_LEN + response->con_len + len > limit) {
+        ESP_LOGW(PROTO_TAG, "no room for %d bytes content", len);
+        return NULL;
+    }
+    return &content[response->con_len];
+}
+
+/* commit content written into reserved room */
+esp_err_t osh_node_proto_response_commit(osh_node_proto_pdu_t *response, size_t len) {
+    if (NULL == response || NULL == response->octets) return ESP_ERR_INVALID_ARG;
+    if (&response->octets[OSH_NODE_PROTO_PDU_HEADER_MAX_LEN] != response->data) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (OSH_NODE_PROTO_PDU_HEADER_MAX_LEN + response->con_len + len > response->octets_size) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    response->con_len += len;
     return ESP_OK;
 }
 
@@ -222,9 +291,221 @@ static esp_err_t proto_encode_pdu(osh_node_proto_session_t *session,
  *            task
  *  -------------------------------
 */
-static void hb_timeout_cb(TimerHandle_t timer) {
-    // TODO
+static size_t proto_put_name(uint8_t *buff, const char *name) {
+    size_t len = (NULL == name) ? 0 : strlen(name);
+    if (OSH_NODE_PROTO_HB_NAME_MAX_LEN < len) len = OSH_NODE_PROTO_HB_NAME_MAX_LEN;
+    buff[0] = (uint8_t)len;
+    if (0 < len) memcpy(&buff[1], name, len);
+    return 1 + len;
+}
+
+static esp_err_t proto_get_name(const uint8_t **buff, size_t *remain, char *name) {
+    if (1 > *remain || (size_t)(1 + (*buff)[0]) > *remain
+        || OSH_NODE_PROTO_HB_NAME_MAX_LEN < (*buff)[0]) return OSH_ERR_PROTO_PDU_LEN;
+    size_t len = (*buff)[0];
+    memcpy(name, &(*buff)[1], len);
+    name[len] = '\0';
+    *buff += 1 + len;
+    *remain -= 1 + len;
+    return ESP_OK;
+}
+
+/* broadcast heartbeat and age peers, in proto task */
+static void proto_send_heartbeat(void) {
+    uint8_t payload[OSH_NODE_PROTO_HB_MAX_LEN];
+    uint8_t buff[OSH_NODE_PROTO_PDU_HEADER_MAX_LEN + OSH_NODE_PROTO_HB_MAX_LEN];
+    size_t len = 0;
+
+    if (-1 == g_proto.report_sock) return;
+
+    // APP port and names
+    uint16_t port = htons(CONFIG_NODE_PROTO_PORT);
+    memcpy(&payload[len], &port, sizeof(port));
+    len += sizeof(port);
+    len += proto_put_name(&payload[len], g_proto.node_bb->dev_name);
+    len += proto_put_name(&payload[len], g_proto.node_bb->node_name);
+
+    osh_node_proto_pdu_t pdu;
+    memset(&pdu, 0, sizeof(osh_node_proto_pdu_t));
+    pdu.version = OSH_NODE_PROTO_VER;
+    pdu.type = OSH_REQUEST_NON_CONFIRM;
+    pdu.code_class = OSH_CC_SGINAL;
+    pdu.code_code = OSH_SIGNAL_HEARTBEAT;
+    pdu.con_type = OSH_CONTENT_OCTETS;
+    pdu.con_len = len;
+    pdu.data = payload;
+    pdu.session = &g_proto.report_session;
+    pdu.octets = pdu.oct_rd = pdu.oct_wr = buff;
+    pdu.octets_size = sizeof(buff);
+
     // broadcast heartbeat
+    if (ESP_OK == osh_proto_encode_pdu(&g_proto.report_session, &pdu, buff, sizeof(buff))
+        && 0 > osh_proto_sendto(g_proto.report_sock, pdu.oct_rd, pdu.oct_wr - pdu.oct_rd,
+                    &g_proto.report_addr, OSH_TC_BULK)) {
+        ESP_LOGE(PROTO_TAG, "failed to send heartbeat, errno %d", errno);
+    }
+
+    // drop peers not heard
+    osh_peer_age();
+}
+
+/* heartbeat due, in timer service task, sent by proto task within select timeout */
+static void hb_timeout_cb(void *arg) {
+    __atomic_store_n(&g_proto.hb_due, true, __ATOMIC_RELEASE);
+}
+
+/* heartbeat of peer, feed peer directory */
+static void proto_handle_heartbeat(const osh_node_proto_pdu_t *pdu,
+                        const struct sockaddr_in *from) {
+    char dev_name[OSH_NODE_PROTO_HB_NAME_MAX_LEN + 1];
+    char node_name[OSH_NODE_PROTO_HB_NAME_MAX_LEN + 1];
+    const uint8_t *buff = pdu->oct_rd;
+    size_t remain = pdu->con_len;
+    struct sockaddr_in addr = *from;
+
+    if (sizeof(addr.sin_port) > remain) return;
+    memcpy(&addr.sin_port, buff, sizeof(addr.sin_port));
+    buff += sizeof(addr.sin_port);
+    remain -= sizeof(addr.sin_port);
+    if (ESP_OK != proto_get_name(&buff, &remain, dev_name) ||
+        ESP_OK != proto_get_name(&buff, &remain, node_name)) {
+        ESP_LOGW(PROTO_TAG, "invalid heartbeat from %s", inet_ntoa(from->sin_addr));
+        return;
+    }
+
+    // ignore own heartbeat
+    if (NULL != g_proto.node_bb->dev_name &&
+        0 == strcmp(dev_name, g_proto.node_bb->dev_name)) return;
+    osh_peer_update(dev_name, node_name, &addr);
+}
+
+/* settings assumed before CSM */
+static void proto_csm_default(osh_node_proto_csm_t *csm) {
+    csm->max_msg_size = CONFIG_NODE_PROTO_BUFF_SIZE;
+    csm->block_size = CONFIG_NODE_PROTO_CSM_BLOCK_SIZE;
+    csm->features = 0;
+    csm->version = 0;
+}
+
+static osh_node_proto_csm_peer_t *proto_csm_find(const struct sockaddr_in *addr) {
+    for (int i = 0; i < CONFIG_NODE_PROTO_CSM_PEER_NUM; i++) {
+        osh_node_proto_csm_peer_t *peer = &g_proto.csm_peers[i];
+        if (0 != peer->remote_addr.sin_port &&
+            addr->sin_port == peer->remote_addr.sin_port &&
+            addr->sin_addr.s_addr == peer->remote_addr.sin_addr.s_addr) return peer;
+    }
+    return NULL;
+}
+
+/* load settings of remote into session */
+static void proto_csm_load(osh_node_proto_session_t *session) {
+    osh_node_proto_csm_peer_t *peer = proto_csm_find(&session->remote_addr);
+    if (NULL == peer) {
+        session->state = OSH_SESSION_STATE_NONE;
+        proto_csm_default(&session->csm);
+        return;
+    }
+    peer->last_used = xTaskGetTickCount();
+    session->state = OSH_SESSION_STATE_ESTABLISHED;
+    session->csm = peer->csm;
+}
+
+static size_t proto_csm_put(uint8_t *buff, uint8_t type, uint32_t value, uint8_t len) {
+    buff[0] = type;
+    buff[1] = len;
+    for (uint8_t i = 0; i < len; i++) {
+        buff[2 + i] = (uint8_t)(value >> (8 * (len - 1 - i)));
+    }
+    return 2 + len;
+}
+
+/* CSM of remote, keep the common settings and answer with own ones */
+static esp_err_t proto_handle_csm(const osh_node_proto_pdu_t *req,
+                        osh_node_proto_pdu_t *rsp) {
+    osh_node_proto_session_t *session = req->session;
+    osh_node_proto_csm_t remote;
+    proto_csm_default(&remote);
+
+    const uint8_t *buff = req->oct_rd;
+    size_t remain = req->con_len;
+    while (0 < remain) {
+        if (2 > remain || (size_t)(2 + buff[1]) > remain || 4 < buff[1]) {
+            ESP_LOGW(PROTO_TAG, "invalid CSM from %s. [0x%x]",
+                    inet_ntoa(session->remote_addr.sin_addr), req->mid);
+            proto_response_err_head(req, rsp, OSH_CC_CLIENT_ERR, OSH_CERR_BAD_OPTION);
+            return OSH_ERR_PROTO_PDU_FMT;
+        }
+        uint32_t value = 0;
+        for (uint8_t i = 0; i < buff[1]; i++) value = (value << 8) | buff[2 + i];
+        switch (buff[0]) {
+        case OSH_CSM_OPT_MAX_MSG_SIZE:  remote.max_msg_size = (uint16_t)value; break;
+        case OSH_CSM_OPT_BLOCK_SIZE:    remote.block_size = (uint16_t)value; break;
+        case OSH_CSM_OPT_FEATURES:      remote.features = (uint8_t)value; break;
+        case OSH_CSM_OPT_VERSION:       remote.version = (uint8_t)value; break;
+        default: break;
+        }
+        remain -= 2 + buff[1];
+        buff += 2 + buff[1];
+    }
+    if (OSH_NODE_PROTO_PDU_HEADER_MIN_LEN > remote.max_msg_size || 0 == remote.block_size) {
+        proto_response_err_head(req, rsp, OSH_CC_CLIENT_ERR, OSH_CERR_BAD_OPTION);
+        return OSH_ERR_PROTO_PDU_FMT;
+    }
+
+    // common settings
+    osh_node_proto_csm_t csm;
+    csm.max_msg_size = MIN(remote.max_msg_size, CONFIG_NODE_PROTO_BUFF_SIZE);
+    csm.block_size = MIN(remote.block_size, CONFIG_NODE_PROTO_CSM_BLOCK_SIZE);
+    csm.features = remote.features & OSH_NODE_PROTO_FEATURES;
+    csm.version = MIN(remote.version, OSH_NODE_PROTO_VER);
+
+    // keep it, replace the least recently used
+    TickType_t now = xTaskGetTickCount();
+    osh_node_proto_csm_peer_t *peer = proto_csm_find(&session->remote_addr);
+    for (int i = 0; NULL == peer && i < CONFIG_NODE_PROTO_CSM_PEER_NUM; i++) {
+        osh_node_proto_csm_peer_t *tmp = &g_proto.csm_peers[i];
+        if (0 == tmp->remote_addr.sin_port) peer = tmp;
+    }
+    if (NULL == peer) {
+        peer = &g_proto.csm_peers[0];
+        for (int i = 1; i < CONFIG_NODE_PROTO_CSM_PEER_NUM; i++) {
+            osh_node_proto_csm_peer_t *tmp = &g_proto.csm_peers[i];
+            if ((TickType_t)(now - tmp->last_used) >
+                (TickType_t)(now - peer->last_used)) peer = tmp;
+        }
+    }
+    peer->remote_addr = session->remote_addr;
+    peer->last_used = now;
+    peer->csm = csm;
+    session->csm = csm;
+    session->state = OSH_SESSION_STATE_ESTABLISHED;
+    ESP_LOGI(PROTO_TAG, "CSM with %s: msg %d block %d features 0x%x. [0x%x]",
+            inet_ntoa(session->remote_addr.sin_addr), csm.max_msg_size,
+            csm.block_size, csm.features, req->mid);
+
+    // own settings
+    size_t len = 0;
+    len += proto_csm_put(&g_proto.csm_octets[len], OSH_CSM_OPT_MAX_MSG_SIZE,
+                    CONFIG_NODE_PROTO_BUFF_SIZE, 2);
+    len += proto_csm_put(&g_proto.csm_octets[len], OSH_CSM_OPT_BLOCK_SIZE,
+                    CONFIG_NODE_PROTO_CSM_BLOCK_SIZE, 2);
+    len += proto_csm_put(&g_proto.csm_octets[len], OSH_CSM_OPT_FEATURES,
+                    OSH_NODE_PROTO_FEATURES, 1);
+    len += proto_csm_put(&g_proto.csm_octets[len], OSH_CSM_OPT_VERSION,
+                    OSH_NODE_PROTO_VER, 1);
+    proto_response_ack_head(req, rsp, OSH_CC_SGINAL, OSH_SIGNAL_CSM);
+    rsp->con_type = OSH_CONTENT_OCTETS;
+    rsp->con_len = len;
+    rsp->data = g_proto.csm_octets;
+    return ESP_OK;
+}
+
+/* remote released the session, forget its settings */
+static void proto_handle_release(osh_node_proto_session_t *session) {
+    osh_node_proto_csm_peer_t *peer = proto_csm_find(&session->remote_addr);
+    if (NULL != peer) memset(peer, 0, sizeof(osh_node_proto_csm_peer_t));
+    session->state = OSH_SESSION_STATE_NONE;
+    proto_csm_default(&session->csm);
 }
 
 static esp_err_t decode_pdu(void) {
@@ -233,9 +514,12 @@ static esp_err_t decode_pdu(void) {
                         g_proto.send_buff.base, g_proto.send_buff.size);
 
     // decode request
-    esp_err_t res = proto_decode_pdu(&g_proto.session, &g_proto.request,
+    esp_err_t res = osh_proto_decode_pdu(&g_proto.session, &g_proto.request,
                         g_proto.recv_buff.base, g_proto.recv_buff.len);
 
+    // settings negotiated with the remote
+    proto_csm_load(&g_proto.session);
+
     if (ESP_OK != res) {
         // bad request
         osh_node_proto_pdu_t *rsp = &g_proto.response;
@@ -247,9 +531,64 @@ static esp_err_t decode_pdu(void) {
     return ESP_OK;
 }
 
-static void response_remote(int sock, struct sockaddr_in *addr) {
-    esp_err_t err = proto_encode_pdu(&g_proto.session, &g_proto.response,
-                    g_proto.send_buff.base, g_proto.send_buff.size);
+/* control, read content or bulk by code and size */
+OSH_TRAFFIC_CLASS_ENUM osh_proto_traffic_class(const osh_node_proto_pdu_t *pdu) {
+    if (OSH_CC_SGINAL == pdu->code_class) {
+        return (OSH_SIGNAL_HEARTBEAT == pdu->code_code) ? OSH_TC_BULK : OSH_TC_CONTROL;
+    }
+    if (OSH_CC_SUCCESS == pdu->code_class) {
+        if (OSH_SUCCESS_CONTINUE == pdu->code_code ||
+            CONFIG_NODE_PROTO_CSM_BLOCK_SIZE < pdu->con_len) return OSH_TC_BULK;
+        if (OSH_SUCCESS_CONTENT == pdu->code_code && 0 < pdu->con_len) return OSH_TC_DEFAULT;
+    }
+    // requests, errors and acks of changes
+    return OSH_TC_CONTROL;
+}
+
+/* set TOS of class right before sending */
+int osh_proto_sendto(int sock,
+                        const void *data,
+                        size_t len,
+                        const struct sockaddr_in *addr,
+                        OSH_TRAFFIC_CLASS_ENUM tc) {
+#if CONFIG_NODE_PROTO_TOS_ENABLE
+    static const int tos_of_class[OSH_TC_BUTT] = {
+        CONFIG_NODE_PROTO_TOS_CONTROL,
+        CONFIG_NODE_PROTO_TOS_DEFAULT,
+        CONFIG_NODE_PROTO_TOS_BULK,
+    };
+    // sockets are shared by tasks, TOS of one must not leak to another
+    if (NULL != g_proto.tos_lock) xSemaphoreTake(g_proto.tos_lock, portMAX_DELAY);
+    int tos = tos_of_class[(OSH_TC_BUTT > tc) ? tc : OSH_TC_DEFAULT];
+    if (0 > setsockopt(sock, IPPROTO_IP, IP_TOS, &tos, sizeof(tos))) {
+        ESP_LOGD(PROTO_TAG, "failed to set TOS 0x%x, errno %d", tos, errno);
+    }
+#endif
+    int res = (NULL == addr) ? send(sock, data, len, 0) :
+                sendto(sock, data, len, 0, (const struct sockaddr *)addr,
+                        sizeof(struct sockaddr_in));
+#if CONFIG_NODE_PROTO_TOS_ENABLE
+    if (NULL != g_proto.tos_lock) xSemaphoreGive(g_proto.tos_lock);
+#endif
+    return res;
+}
+
+static void response_remote(void) {
+    osh_node_transport_t *tp = g_proto.session.transport;
+    struct sockaddr_in *addr = &g_proto.session.remote_addr;
+
+    // never more than the remote receives
+    size_t size = MIN(g_proto.send_buff.size, g_proto.session.csm.max_msg_size);
+    esp_err_t err = osh_proto_encode_pdu(&g_proto.session, &g_proto.response,
+                    g_proto.send_buff.base, size);
+    if (OSH_ERR_PROTO_BUFF_LEN == err) {
+        ESP_LOGW(PROTO_TAG, "response over %d bytes. [0x%x]", size, g_proto.request.mid);
+        g_proto.response.oct_wr = g_proto.response.oct_rd;
+        proto_response_err_head(&g_proto.request, &g_proto.response,
+                    OSH_CC_SERVER_ERR, OSH_SERR_INTERNAL_ERR);
+        err = osh_proto_encode_pdu(&g_proto.session, &g_proto.response,
+                    g_proto.send_buff.base, size);
+    }
     if (ESP_OK != err) {
         ESP_LOGE(PROTO_TAG, "failed to encode response. err:%d", err);
         return;
@@ -257,15 +596,570 @@ static void response_remote(int sock, struct sockaddr_in *addr) {
         // set length to be sent
         g_proto.send_buff.len = g_proto.response.oct_wr - g_proto.response.oct_rd;
     }
-    // send to remote
-    if (0 > sendto(sock, g_proto.send_buff.base, g_proto.send_buff.len,
-                    0, (struct sockaddr *)addr, sizeof(struct sockaddr_in))) {
+    // send to remote over its link
+    if (ESP_OK != osh_node_transport_send(tp, g_proto.response.oct_rd, g_proto.send_buff.len,
+                    addr, osh_proto_traffic_class(&g_proto.response))) {
         ESP_LOGE(PROTO_TAG, "failed to send response to %s", inet_ntoa(addr->sin_addr));
     } else {
         ESP_LOGI(PROTO_TAG, "reponse to %s", inet_ntoa(addr->sin_addr));
     }
 }
 
+/** -------------------------------
+ *            route
+ *  -------------------------------
+*/
+#define route_mask(len)     ((0 == (len)) ? 0UL : (0xFFFFFFFFUL << (32 - (len))))
+#define route_bit(e, n)     (((e) >> (31 - (n))) & 1)
+
+/* new trie node for prefix */
+static osh_node_proto_entry_t *route_trie_node(uint32_t e, uint8_t len) {
+    osh_node_proto_entry_t *node = malloc(sizeof(osh_node_proto_entry_t));
+    if (NULL == node) {
+        ESP_LOGE(PROTO_TAG, "failed to malloc mem for entry 0x%lx/%d", e, len);
+        return NULL;
+    }
+    memset(node, 0, sizeof(osh_node_proto_entry_t));
+    node->mask = route_mask(len);
+    node->entry = e & node->mask;
+    node->prefix_len = len;
+    vListInitialise(&node->route_list);
+    return node;
+}
+
+/* find or insert node of prefix, a branch node is added where paths fork */
+static osh_node_proto_entry_t *route_trie_insert(uint32_t e, uint8_t len) {
+    osh_node_proto_entry_t **link = &g_proto.entry_root;
+    e &= route_mask(len);
+
+    while (NULL != *link) {
+        osh_node_proto_entry_t *node = *link;
+        uint32_t diff = e ^ node->entry;
+        uint8_t common = (0 == diff) ? 32 : (uint8_t)__builtin_clz(diff);
+        if (common > len) common = len;
+        if (common > node->prefix_len) common = node->prefix_len;
+
+        if (common == node->prefix_len) {
+            // node is a prefix of e
+            if (len == node->prefix_len) return node;
+            link = &node->child[route_bit(e, node->prefix_len)];
+            continue;
+        }
+
+        // paths fork inside node's prefix
+        osh_node_proto_entry_t *fork = route_trie_node(e, common);
+        if (NULL == fork) return NULL;
+        fork->child[route_bit(node->entry, common)] = node;
+        if (common == len) {
+            *link = fork;
+            return fork;
+        }
+        osh_node_proto_entry_t *leaf = route_trie_node(e, len);
+        if (NULL == leaf) {
+            free(fork);
+            return NULL;
+        }
+        fork->child[route_bit(e, common)] = leaf;
+        *link = fork;
+        return leaf;
+    }
+
+    *link = route_trie_node(e, len);
+    return *link;
+}
+
+/* longest prefix having the method */
+static osh_node_proto_entry_t *route_trie_match(uint32_t e, uint8_t method) {
+    osh_node_proto_entry_t *best = NULL;
+    osh_node_proto_entry_t *node = g_proto.entry_root;
+
+    while (NULL != node && node->entry == (e & node->mask)) {
+        if (0 != (node->methods & (1UL << method))) best = node;
+        if (32 == node->prefix_len) break;
+        node = node->child[route_bit(e, node->prefix_len)];
+    }
+    return best;
+}
+
+/* free all routes */
+static void route_trie_free(osh_node_proto_entry_t *node) {
+    if (NULL == node) return;
+    route_trie_free(node->child[0]);
+    route_trie_free(node->child[1]);
+    while (!listLIST_IS_EMPTY(&node->route_list)) {
+        ListItem_t *item = listGET_HEAD_ENTRY(&node->route_list);
+        uxListRemove(item);
+        free(listGET_LIST_ITEM_OWNER(item));
+    }
+    free(node);
+}
+
+/* records under node in prefix order, count only when buff is NULL */
+static size_t route_dir_fill(const osh_node_proto_entry_t *node, uint8_t *buff) {
+    if (NULL == node) return 0;
+    size_t num = 0;
+    if (0 != node->methods) {
+        if (NULL != buff) {
+            buff[0] = (uint8_t)(node->entry >> 24);
+            buff[1] = (uint8_t)(node->entry >> 16);
+            buff[2] = (uint8_t)(node->entry >> 8);
+            buff[3] = (uint8_t)node->entry;
+            buff[4] = node->prefix_len;
+            buff[5] = (uint8_t)(node->methods >> 8);
+            buff[6] = (uint8_t)node->methods;
+        }
+        num++;
+    }
+    for (int i = 0; i < 2; i++) {
+        num += route_dir_fill(node->child[i],
+                (NULL == buff) ? NULL : &buff[num * OSH_NODE_PROTO_DIR_RECORD_LEN]);
+    }
+    return num;
+}
+
+/* rebuild directory after registration */
+static esp_err_t route_dir_rebuild(void) {
+    size_t num = route_dir_fill(g_proto.entry_root, NULL);
+    uint8_t *octets = realloc(g_proto.dir.octets, num * OSH_NODE_PROTO_DIR_RECORD_LEN);
+    if (NULL == octets && 0 < num) {
+        ESP_LOGE(PROTO_TAG, "failed to malloc mem for directory");
+        return ESP_ERR_NO_MEM;
+    }
+    route_dir_fill(g_proto.entry_root, octets);
+    g_proto.dir.octets = octets;
+    g_proto.dir.num = num;
+    if (0 == ++g_proto.dir.version) g_proto.dir.version = 1;
+#if CONFIG_NODE_MDNS_ENABLE
+    osh_mdns_refresh(g_proto.dir.version);
+#endif
+    return ESP_OK;
+}
+
+static uint32_t route_dir_version(uint32_t e, osh_node_bb_t *node_bb) {
+    return g_proto.dir.version;
+}
+
+/* OPTIONS on directory entry, a page of records from the requested one */
+static esp_err_t route_dir_handler(uint32_t e,
+            osh_node_bb_t *node_bb,
+            osh_node_proto_session_t *session,
+            const osh_node_proto_pdu_t *req,
+            osh_node_proto_pdu_t *rsp) {
+    size_t first = 0;
+    if (2 <= req->con_len) first = (size_t)((req->oct_rd[0] << 8) | req->oct_rd[1]);
+    if (first > g_proto.dir.num) {
+        proto_response_err_head(req, rsp, OSH_CC_CLIENT_ERR, OSH_CERR_BAD_OPTION);
+        return OSH_ERR_PROTO_PDU_FMT;
+    }
+
+    size_t size = MIN(CONFIG_NODE_PROTO_BUFF_SIZE, session->csm.max_msg_size);
+    if (OSH_NODE_PROTO_PDU_HEADER_MAX_LEN + OSH_NODE_PROTO_DIR_RECORD_LEN > size) {
+        // not a record fits in a message of remote
+        proto_response_err_head(req, rsp, OSH_CC_CLIENT_ERR, OSH_CERR_ENTITY_TOO_LARGE);
+        return OSH_ERR_PROTO_PDU_LEN;
+    }
+    size_t room = size - OSH_NODE_PROTO_PDU_HEADER_MAX_LEN;
+    size_t num = MIN(room / OSH_NODE_PROTO_DIR_RECORD_LEN, g_proto.dir.num - first);
+    proto_response_ack_head(req, rsp, OSH_CC_SUCCESS,
+            (first + num < g_proto.dir.num) ? OSH_SUCCESS_CONTINUE : OSH_SUCCESS_CONTENT);
+    rsp->con_type = OSH_CONTENT_OCTETS;
+    rsp->con_len = num * OSH_NODE_PROTO_DIR_RECORD_LEN;
+    rsp->data = &g_proto.dir.octets[first * OSH_NODE_PROTO_DIR_RECORD_LEN];
+    rsp->hash = g_proto.dir.version;
+    return ESP_OK;
+}
+
+#if CONFIG_NODE_FSM_TRACE_ENABLE
+/* dump FSM trace from sequence in request, 4 bytes, oldest if none */
+static esp_err_t route_trace_handler(uint32_t e,
+            osh_node_bb_t *node_bb,
+            osh_node_proto_session_t *session,
+            const osh_node_proto_pdu_t *req,
+            osh_node_proto_pdu_t *rsp) {
+    uint32_t from = 0;
+    if (4 <= req->con_len) {
+        from = ((uint32_t)req->oct_rd[0] << 24) | ((uint32_t)req->oct_rd[1] << 16) |
+               ((uint32_t)req->oct_rd[2] << 8) | req->oct_rd[3];
+    }
+
+    size_t size = MIN(CONFIG_NODE_PROTO_BUFF_SIZE, session->csm.max_msg_size);
+    if (OSH_NODE_PROTO_PDU_HEADER_MAX_LEN + OSH_NODE_FSM_TRACE_HEAD_LEN +
+        OSH_NODE_FSM_TRACE_RECORD_LEN > size) {
+        proto_response_err_head(req, rsp, OSH_CC_CLIENT_ERR, OSH_CERR_ENTITY_TOO_LARGE);
+        return OSH_ERR_PROTO_PDU_LEN;
+    }
+    size_t room = size - OSH_NODE_PROTO_PDU_HEADER_MAX_LEN;
+    uint8_t *buff = osh_node_proto_session_alloc(session, room);
+    if (NULL == buff) {
+        proto_response_err_head(req, rsp, OSH_CC_SERVER_ERR, OSH_SERR_INTERNAL_ERR);
+        return ESP_ERR_NO_MEM;
+    }
+    bool more = false;
+    size_t len = osh_node_fsm_trace_dump(from, buff, room, &more);
+    proto_response_ack_head(req, rsp, OSH_CC_SUCCESS,
+            more ? OSH_SUCCESS_CONTINUE : OSH_SUCCESS_CONTENT);
+    rsp->con_type = OSH_CONTENT_OCTETS;
+    rsp->con_len = len;
+    rsp->data = buff;
+    return ESP_OK;
+}
+#endif
+
+/* route serving entry with method */
+static osh_node_proto_route_t *route_find(uint32_t e, uint8_t method,
+                        osh_node_proto_entry_t **matched) {
+    osh_node_proto_entry_t *entry = route_trie_match(e, method);
+    if (NULL == entry) return NULL;
+
+    osh_node_proto_route_t *route = NULL;
+    listFOR_EACH_ENTRY(&entry->route_list, osh_node_proto_route_t, route) {
+        if (method == route->method) {
+            if (NULL != matched) *matched = entry;
+            return route;
+        }
+    }
+    return NULL;
+}
+
+/* fill response from cache, content copied into its room while locked as
+   a flight may refill the slot from another task, false if not cached,
+   expired, of another version than tag unless 0, or over the room */
+static bool route_cache_get(osh_node_proto_route_t *route,
+                        const osh_node_proto_pdu_t *req,
+                        uint32_t tag,
+                        osh_node_proto_pdu_t *rsp) {
+    bool hit = false;
+    TickType_t now = xTaskGetTickCount();
+
+    xSemaphoreTake(g_proto.cache_lock, portMAX_DELAY);
+    for (int i = 0; i < CONFIG_NODE_PROTO_CACHE_NUM; i++) {
+        osh_node_proto_cache_t *slot = &g_proto.cache[i];
+        if (route != slot->route || req->entry != slot->entry || !slot->valid) continue;
+        if ((0 != route->cache_ttl && (TickType_t)(now - slot->stamp) >= route->cache_ttl)
+            || (0 != tag && slot->hash != tag)) {
+            slot->valid = false;
+            break;
+        }
+        uint8_t *content = osh_node_proto_response_reserve(rsp, slot->con_len);
+        if (NULL == content) break;
+        if (0 < slot->con_len) memcpy(content, slot->data, slot->con_len);
+        osh_node_proto_response_commit(rsp, slot->con_len);
+        proto_response_ack_head(req, rsp, slot->code_class, slot->code_code);
+        rsp->con_type = slot->con_type;
+        rsp->hash = slot->hash;
+        hit = true;
+        break;
+    }
+    xSemaphoreGive(g_proto.cache_lock);
+    return hit;
+}
+
+/* keep a copy of successful response */
+static void route_cache_put(osh_node_proto_route_t *route,
+                        uint32_t e,
+                        const osh_node_proto_pdu_t *rsp) {
+    if (OSH_CC_SUCCESS != rsp->code_class) return;
+    if (0 < rsp->con_len && NULL == rsp->data) return;
+
+    TickType_t now = xTaskGetTickCount();
+    xSemaphoreTake(g_proto.cache_lock, portMAX_DELAY);
+
+    // same entry, else a free one, else the oldest
+    osh_node_proto_cache_t *slot = NULL;
+    for (int i = 0; i < CONFIG_NODE_PROTO_CACHE_NUM; i++) {
+        osh_node_proto_cache_t *tmp = &g_proto.cache[i];
+        if (route == tmp->route && e == tmp->entry) {
+            slot = tmp;
+            break;
+        }
+        if (NULL == slot || (slot->valid && !tmp->valid) ||
+            (slot->valid == tmp->valid &&
+             (TickType_t)(now - tmp->stamp) > (TickType_t)(now - slot->stamp))) {
+            slot = tmp;
+        }
+    }
+
+    slot->valid = false;
+    if (slot->size < rsp->con_len) {
+        uint8_t *data = realloc(slot->data, rsp->con_len);
+        if (NULL == data) {
+            ESP_LOGW(PROTO_TAG, "no mem to cache 0x%lx", e);
+            xSemaphoreGive(g_proto.cache_lock);
+            return;
+        }
+        slot->data = data;
+        slot->size = rsp->con_len;
+    }
+    if (0 < rsp->con_len) memcpy(slot->data, rsp->data, rsp->con_len);
+    slot->route = route;
+    slot->entry = e;
+    slot->code_class = rsp->code_class;
+    slot->code_code = rsp->code_code;
+    slot->con_type = rsp->con_type;
+    slot->con_len = rsp->con_len;
+    slot->hash = rsp->hash;
+    slot->stamp = now;
+    slot->valid = true;
+    xSemaphoreGive(g_proto.cache_lock);
+}
+
+/* tag content of safe method: version, else set by handler, else hash of
+   content, and keep a copy if route caches */
+static void route_tag_content(osh_node_proto_route_t *route,
+                        uint32_t e,
+                        uint32_t tag,
+                        osh_node_proto_pdu_t *rsp) {
+    if (0 != tag) {
+        rsp->hash = tag;
+    } else if (0 == rsp->hash) {
+        rsp->hash = osh_proto_content_hash(rsp->data, rsp->con_len);
+    }
+    rsp->hash_ind = 1;
+    if (OSH_METHOD_GET == route->method && route->cache_on) route_cache_put(route, e, rsp);
+}
+
+/* answer failed transaction with index of the update */
+static esp_err_t route_txn_fail(const osh_node_proto_pdu_t *req,
+                        osh_node_proto_pdu_t *rsp,
+                        OSH_CODE_CLASS_ENUM cls,
+                        uint8_t code,
+                        size_t index,
+                        esp_err_t res) {
+    proto_response_err_head(req, rsp, cls, code);
+    uint8_t *content = osh_node_proto_response_reserve(rsp, 1);
+    if (NULL != content) {
+        content[0] = (uint8_t)index;
+        osh_node_proto_response_commit(rsp, 1);
+    }
+    return res;
+}
+
+/* undo applied updates in reverse order */
+static void route_txn_abort(const osh_node_proto_txn_update_t *updates, size_t num) {
+    while (0 < num--) {
+        const osh_node_proto_txn_update_t *up = &updates[num];
+        if (NULL != up->route->txn->abort) {
+            up->route->txn->abort(up->entry, up->sub_index, g_proto.node_bb);
+        }
+    }
+}
+
+/* POST on transaction entry, validate all, apply all, commit once */
+static esp_err_t route_txn_handler(uint32_t e,
+            osh_node_bb_t *node_bb,
+            osh_node_proto_session_t *session,
+            const osh_node_proto_pdu_t *req,
+            osh_node_proto_pdu_t *rsp) {
+    osh_node_proto_txn_update_t updates[CONFIG_NODE_PROTO_TXN_MAX];
+    size_t num = 0;
+
+    // parse and validate, nothing changed yet
+    const uint8_t *rd = req->oct_rd;
+    size_t remain = req->con_len;
+    while (0 < remain) {
+        if (CONFIG_NODE_PROTO_TXN_MAX <= num) {
+            ESP_LOGE(PROTO_TAG, "transaction over %d updates. [0x%x]",
+                    CONFIG_NODE_PROTO_TXN_MAX, req->mid);
+            return route_txn_fail(req, rsp, OSH_CC_CLIENT_ERR,
+                        OSH_CERR_ENTITY_TOO_LARGE, num, OSH_ERR_PROTO_PDU_FMT);
+        }
+        size_t len = 0;
+        if (OSH_NODE_PROTO_TXN_RECORD_HEAD_LEN <= remain) {
+            len = (size_t)((rd[4] << 8) | rd[5]);
+        }
+        if (OSH_NODE_PROTO_TXN_RECORD_HEAD_LEN > remain ||
+            len > remain - OSH_NODE_PROTO_TXN_RECORD_HEAD_LEN) {
+            return route_txn_fail(req, rsp, OSH_CC_CLIENT_ERR,
+                        OSH_CERR_BAD_REQUEST, num, OSH_ERR_PROTO_PDU_FMT);
+        }
+
+        osh_node_proto_txn_update_t *up = &updates[num];
+        up->entry = (uint32_t)((rd[0] << 24) | (rd[1] << 16) | (rd[2] << 8) | rd[3]);
+        up->data = &rd[OSH_NODE_PROTO_TXN_RECORD_HEAD_LEN];
+        up->len = len;
+        osh_node_proto_entry_t *entry = NULL;
+        up->route = route_find(up->entry, OSH_METHOD_PUT, &entry);
+        if (NULL == up->route) {
+            return route_txn_fail(req, rsp, OSH_CC_CLIENT_ERR,
+                        OSH_CERR_NOT_FOUND, num, OSH_ERR_PROTO_NOT_FOUND);
+        }
+        if (NULL == up->route->txn || NULL == up->route->txn->apply) {
+            return route_txn_fail(req, rsp, OSH_CC_CLIENT_ERR,
+                        OSH_CERR_METHOD_NOT_ALLOWED, num, OSH_ERR_PROTO_NOT_FOUND);
+        }
+        up->sub_index = up->entry & ~entry->mask;
+        if (NULL != up->route->txn->validate &&
+            ESP_OK != up->route->txn->validate(up->entry, up->sub_index, node_bb,
+                        up->data, up->len)) {
+            ESP_LOGW(PROTO_TAG, "transaction update %d on 0x%lx invalid. [0x%x]",
+                    num, up->entry, req->mid);
+            up->route->stats.errors++;
+            return route_txn_fail(req, rsp, OSH_CC_CLIENT_ERR,
+                        OSH_CERR_BAD_REQUEST, num, OSH_ERR_PROTO_PDU_FMT);
+        }
+
+        rd += OSH_NODE_PROTO_TXN_RECORD_HEAD_LEN + len;
+        remain -= OSH_NODE_PROTO_TXN_RECORD_HEAD_LEN + len;
+        num++;
+    }
+
+    // apply in order, roll back on failure
+    for (size_t i = 0; i < num; i++) {
+        osh_node_proto_txn_update_t *up = &updates[i];
+        up->route->stats.calls++;
+        if (ESP_OK != up->route->txn->apply(up->entry, up->sub_index, node_bb,
+                        up->data, up->len)) {
+            ESP_LOGE(PROTO_TAG, "transaction update %d on 0x%lx failed. [0x%x]",
+                    i, up->entry, req->mid);
+            up->route->stats.errors++;
+            route_txn_abort(updates, i);
+            return route_txn_fail(req, rsp, OSH_CC_SERVER_ERR,
+                        OSH_SERR_INTERNAL_ERR, i, OSH_ERR_PROTO_INNER);
+        }
+    }
+
+    // persist once
+    if (0 < num && NULL != g_proto.txn_commit &&
+        ESP_OK != g_proto.txn_commit(node_bb, g_proto.txn_commit_arg)) {
+        ESP_LOGE(PROTO_TAG, "transaction commit failed. [0x%x]", req->mid);
+        route_txn_abort(updates, num);
+        return route_txn_fail(req, rsp, OSH_CC_SERVER_ERR,
+                    OSH_SERR_INTERNAL_ERR, num, OSH_ERR_PROTO_INNER);
+    }
+
+    for (size_t i = 0; i < num; i++) osh_node_route_cache_invalidate(updates[i].entry);
+    ESP_LOGI(PROTO_TAG, "transaction of %d updates committed. [0x%x]", num, req->mid);
+    proto_response_ack_head(req, rsp, OSH_CC_SUCCESS, OSH_SUCCESS_CHANGED);
+    rsp->con_type = OSH_CONTENT_OCTETS;
+    rsp->con_len = 0;
+    return ESP_OK;
+}
+
+/* handler ran over budget, demote repeat offender if allowed */
+static void route_overrun(osh_node_proto_route_t *route,
+                        const osh_node_proto_entry_t *entry,
+                        uint32_t cost) {
+    route->stats.overruns++;
+    route->stats.slow = true;
+    ESP_LOGW(PROTO_TAG, "method %d@0x%lx/%d took %lu us over budget %lu us",
+            (int)route->method, entry->entry, entry->prefix_len, cost, route->budget_us);
+#if CONFIG_NODE_PROTO_WORKER_ENABLE
+    if (route->demote && !route->stats.demoted &&
+        CONFIG_NODE_PROTO_WORKER_DEMOTE <= route->stats.overruns) {
+        route->stats.demoted = true;
+        ESP_LOGW(PROTO_TAG, "method %d@0x%lx/%d demoted to worker",
+                (int)route->method, entry->entry, entry->prefix_len);
+    }
+#endif
+}
+
+/* call route of the longest matched prefix */
+static esp_err_t proto_call_route(const char *space,
+                        osh_node_proto_pdu_t *req,
+                        osh_node_proto_pdu_t *rsp) {
+    if (1 != req->entry_ind) {
+        ESP_LOGE(PROTO_TAG, "%s method without entry. [0x%x]", space, req->mid);
+        proto_response_err_head(req, rsp,
+                OSH_CC_CLIENT_ERR, OSH_CERR_ENTITY_INCOMPLETE);
+        return OSH_ERR_PROTO_INVALID_ENTRY;
+    }
+
+    osh_node_proto_entry_t *entry = NULL;
+    osh_node_proto_route_t *route = route_find(req->entry, req->code_code, &entry);
+    if (NULL == route) {
+        ESP_LOGW(PROTO_TAG, "%s not matched route.method %d@0x%lx. [0x%x]",
+                space, req->code_code, req->entry, req->mid);
+        proto_response_err_head(req, rsp, OSH_CC_CLIENT_ERR, OSH_CERR_NOT_FOUND);
+        return OSH_ERR_PROTO_NOT_FOUND;
+    }
+
+    req->sub_index = req->entry & ~entry->mask;
+    ESP_LOGD(PROTO_TAG, "%s matched route. method %d@0x%lx/%d. [0x%x]",
+            space, req->code_code, entry->entry, entry->prefix_len, req->mid);
+
+    // safe methods carry a content tag
+    bool is_get = (OSH_METHOD_GET == route->method);
+    bool is_safe = is_get || OSH_METHOD_OPTIONS == route->method;
+    uint32_t tag = 0;
+    if (is_safe && NULL != route->version_cb) {
+        // cheap version, no need to build the content
+        tag = route->version_cb(req->entry, g_proto.node_bb);
+        if (0 != tag && 1 == req->hash_ind && tag == req->hash) {
+            proto_response_ack_head(req, rsp, OSH_CC_SUCCESS, OSH_SUCCESS_VALID);
+            rsp->con_type = OSH_CONTENT_OCTETS;
+            rsp->con_len = 0;
+            rsp->hash_ind = 1;
+            rsp->hash = tag;
+            route->stats.not_modified++;
+            return ESP_OK;
+        }
+    }
+
+    bool cached = is_get && route->cache_on;
+    bool hit = false;
+    esp_err_t res = ESP_OK;
+    if (cached) {
+        hit = route_cache_get(route, req, tag, rsp);
+        if (hit) {
+            route->stats.cache_hits++;
+        } else {
+            route->stats.cache_misses++;
+        }
+    }
+    if (!hit) {
+        // identical read in progress, answered with its result
+        if ((is_get || OSH_METHOD_FETCH == route->method) && osh_flight_join(req)) {
+            route->stats.coalesced++;
+            return OSH_ERR_PROTO_DEFERRED;
+        }
+#if CONFIG_NODE_PROTO_WORKER_ENABLE
+        // slow route, run by worker unless it is busy
+        if (route->stats.demoted && ESP_OK == osh_worker_submit(route->route_cb, req)) {
+            route->stats.worker++;
+            return OSH_ERR_PROTO_DEFERRED;
+        }
+#endif
+        route->stats.calls++;
+        // wall time, task may move to the other core while handler blocks
+        int64_t begin = esp_timer_get_time();
+        res = route->route_cb(req->entry, g_proto.node_bb,
+                            &g_proto.session, req, rsp);
+        uint32_t cost = (uint32_t)(esp_timer_get_time() - begin);
+        if (cost > route->stats.max_us) route->stats.max_us = cost;
+        if (g_proto.arena.used > route->stats.arena_peak) {
+            route->stats.arena_peak = g_proto.arena.used;
+        }
+        if (OSH_ERR_PROTO_DEFERRED == res) return res;
+        if (0 != route->budget_us && cost > route->budget_us) {
+            route_overrun(route, entry, cost);
+            // client gave up or will soon, tell it the result is unknown
+            proto_response_err_head(req, rsp, OSH_CC_SERVER_ERR, OSH_SERR_TIMEOUT);
+            rsp->data = NULL;
+            return OSH_ERR_PROTO_OVERRUN;
+        }
+        if (ESP_OK != res) {
+            route->stats.errors++;
+            return res;
+        }
+    }
+    if (!is_safe || OSH_CC_SUCCESS != rsp->code_class) return res;
+
+    if (hit) {
+        rsp->hash_ind = 1;
+    } else {
+        route_tag_content(route, req->entry, tag, rsp);
+    }
+
+    if (1 == req->hash_ind && rsp->hash == req->hash) {
+        // requester has the content
+        rsp->code_code = OSH_SUCCESS_VALID;
+        rsp->con_len = 0;
+        rsp->data = NULL;
+        route->stats.not_modified++;
+    }
+    return res;
+}
+
 static esp_err_t handle_mdm_pdu(void) {
     osh_node_proto_pdu_t *req = &g_proto.request;
     osh_node_proto_pdu_t *rsp = &g_proto.response;
@@ -303,36 +1197,7 @@ static esp_err_t handle_mdm_pdu(void) {
         }
     } else if (OSH_CC_METHOD == req->code_class) {
         // method
-        if (1 != req->entry_ind) {
-            ESP_LOGE(PROTO_TAG, "MDM method without entry. [0x%x]", req->mid);
-            proto_response_err_head(req, rsp,
-                    OSH_CC_CLIENT_ERR, OSH_CERR_ENTITY_INCOMPLETE);
-            return OSH_ERR_PROTO_INVALID_ENTRY;
-        }
-
-        // search and call entry callback
-        osh_node_proto_entry_t *entry = NULL;
-        listFOR_EACH_ENTRY(&g_proto.entry_list, osh_node_proto_entry_t, entry) {
-            if (req->entry == entry->entry) {
-                osh_node_proto_route_t *route = NULL;
-                listFOR_EACH_ENTRY(&entry->route_list, osh_node_proto_route_t, route) {
-                    if (req->code_code == route->method) {
-                        ESP_LOGI(PROTO_TAG, "MDM matched route. method %d@0x%lx. [0x%x]",
-                                req->code_code, req->entry, req->mid);
-                        if (NULL != route->route_cb) {
-                            return route->route_cb(req->entry, g_proto.node_bb,
-                                        &g_proto.session, req, rsp);
-                        }
-                    }
-                }
-            }
-        }
-
-        // not match
-        ESP_LOGW(PROTO_TAG, "MDM not matched route.method %d@0x%lx. [0x%x]",
-                req->code_code, req->entry, req->mid);
-        proto_response_err_head(req, rsp, OSH_CC_CLIENT_ERR, OSH_CERR_NOT_FOUND);
-        return OSH_ERR_PROTO_NOT_FOUND;
+        return proto_call_route("MDM", req, rsp);
     }
 
     // can't handle
@@ -378,39 +1243,29 @@ static esp_err_t handle_app_pdu(void) {
             ESP_LOGI(PROTO_TAG, "APP update. [0x%x]", req->mid);
             // todo update node
             return ESP_OK;
+        } else if (OSH_SIGNAL_CSM == req->code_code) {
+            return proto_handle_csm(req, rsp);
+        } else if (OSH_SIGNAL_RELEASE == req->code_code) {
+            ESP_LOGI(PROTO_TAG, "APP release. [0x%x]", req->mid);
+            proto_handle_release(req->session);
+            proto_response_ack_head(req, rsp, OSH_CC_SGINAL, OSH_SIGNAL_RELEASE);
+            rsp->con_type = OSH_CONTENT_OCTETS;
+            rsp->con_len = 0;
+            return ESP_OK;
+        } else if (OSH_SIGNAL_HEARTBEAT == req->code_code) {
+            // report group shares the APP port, never answer
+            proto_handle_heartbeat(req, &req->session->remote_addr);
+            return OSH_ERR_PROTO_DEFERRED;
         }
     } else if (OSH_CC_METHOD == req->code_class) {
-        // method
-        if (1 != req->entry_ind) {
-            ESP_LOGE(PROTO_TAG, "APP method without entry. [0x%x]", req->mid);
-            proto_response_err_head(req, rsp,
-                    OSH_CC_CLIENT_ERR, OSH_CERR_ENTITY_INCOMPLETE);
-            return OSH_ERR_PROTO_INVALID_ENTRY;
+#if CONFIG_NODE_PROXY_ENABLE
+        if (OSH_METHOD_CONNECT == req->code_code) {
+            // forward to the target node
+            return osh_proxy_connect(g_proto.app_sock, req, rsp);
         }
-
-        // search and call entry callback
-        osh_node_proto_entry_t *entry = NULL;
-        listFOR_EACH_ENTRY(&g_proto.entry_list, osh_node_proto_entry_t, entry) {
-            if (req->entry == entry->entry) {
-                osh_node_proto_route_t *route = NULL;
-                listFOR_EACH_ENTRY(&entry->route_list, osh_node_proto_route_t, route) {
-                    if (req->code_code == route->method) {
-                        ESP_LOGI(PROTO_TAG, "APP matched route. method %d@0x%lx. [0x%x]",
-                                req->code_code, req->entry, req->mid);
-                        if (NULL != route->route_cb) {
-                            return route->route_cb(req->entry, g_proto.node_bb,
-                                        &g_proto.session, req, rsp);
-                        }
-                    }
-                }
-            }
-        }
-
-        // not match
-        ESP_LOGW(PROTO_TAG, "APP not matched route.method %d@0x%lx. [0x%x]",
-                req->code_code, req->entry, req->mid);
-        proto_response_err_head(req, rsp, OSH_CC_CLIENT_ERR, OSH_CERR_NOT_FOUND);
-        return OSH_ERR_PROTO_NOT_FOUND;
+#endif
+        // method
+        return proto_call_route("APP", req, rsp);
     }
 
     // can't handle
@@ -418,15 +1273,64 @@ static esp_err_t handle_app_pdu(void) {
     return OSH_ERR_PROTO_NOT_FOUND;
 }
 
+/* one link carries both spaces, told apart by entry */
+static esp_err_t handle_link_pdu(void) {
+    osh_node_proto_pdu_t *req = &g_proto.request;
+    if (1 == req->entry_ind && OSH_NODE_ENTRY_IS_MDM(req->entry)) return handle_mdm_pdu();
+    return handle_app_pdu();
+}
+
+/* handle request in recv buff and answer over link of session, serve lock held */
+static void proto_serve_request(esp_err_t (*handle)(void)) {
+    // requests keep node awake, and wake it when saving
+    osh_node_power_traffic();
+    if (ESP_OK == decode_pdu()) {
+        esp_err_t res = handle();
+        if (OSH_ERR_PROTO_DEFERRED != res &&
+            (ESP_OK != res || OSH_REQUEST_CONFIRM == g_proto.request.type)) {
+            // response when need confirm
+            response_remote();
+        }
+    } else {
+        // response bad request
+        response_remote();
+    }
+    // scratch of handler is dropped with the request
+    g_proto.arena.used = 0;
+}
+
+/* wake proto task from select, it parks before reading any socket */
+static void proto_wake(void) {
+    struct sockaddr_in self = {
+        .sin_family = AF_INET,
+        .sin_port = htons(CONFIG_NODE_PROTO_PORT),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    // parked within select timeout anyway when loopback is not there
+    if (0 > sendto(g_proto.app_sock, NULL, 0, 0, (struct sockaddr *)&self, sizeof(self))) {
+        ESP_LOGD(PROTO_TAG, "failed to wake proto task, errno %d", errno);
+    }
+}
+
 static void proto_server(void * arg) {
     while (1) {
         fd_set read_fds;
         FD_ZERO(&read_fds);
         FD_SET(g_proto.mdm_sock, &read_fds);
         FD_SET(g_proto.app_sock, &read_fds);
+        FD_SET(g_proto.report_sock, &read_fds);
 
         int max_sd = g_proto.mdm_sock > g_proto.app_sock ? g_proto.mdm_sock : g_proto.app_sock;
+        max_sd = max_sd > g_proto.report_sock ? max_sd : g_proto.report_sock;
         struct timeval timeout = {10, 0}; // 10 seconds timeout
+        if (0 < osh_flight_expire()) {
+            // deferred requests to time out
+            timeout.tv_sec = 0;
+            timeout.tv_usec = 200 * 1000;
+        }
+#if CONFIG_NODE_PROXY_ENABLE
+        osh_proxy_fill_fds(&read_fds, &max_sd, &timeout);
+#endif
 
         int activity = select(max_sd + 1, &read_fds, NULL, NULL, &timeout);
 
@@ -434,6 +1338,14 @@ static void proto_server(void * arg) {
             ESP_LOGE(PROTO_TAG, "select error: errno %d", errno);
         }
 
+        if (__atomic_load_n(&g_proto.stop_req, __ATOMIC_ACQUIRE)) {
+            // stopped, parked here until resumed by start
+            vTaskSuspend(NULL);
+            continue;
+        }
+
+        // other tasks may serve requests of their links, recv_buff is shared
+        xSemaphoreTake(g_proto.serve_lock, portMAX_DELAY);
         if (FD_ISSET(g_proto.mdm_sock, &read_fds)) {
             socklen_t socklen = sizeof(struct sockaddr_in);
             int len = recvfrom(g_proto.mdm_sock, g_proto.recv_buff.base,
@@ -447,15 +1359,9 @@ static void proto_server(void * arg) {
                 ESP_LOGI(PROTO_TAG, "MDM Received %d bytes from %s:",
                          len, inet_ntoa(g_proto.session.remote_addr.sin_addr));
                 g_proto.recv_buff.len = len;
-                if (ESP_OK == decode_pdu()) {
-                    if (ESP_OK != handle_mdm_pdu() ||
-                        OSH_REQUEST_CONFIRM == g_proto.request.type) {
-                        // response when need confirm
-                        response_remote(g_proto.mdm_sock, &g_proto.session.remote_addr);
-                    }
-                } else {
-                    response_remote(g_proto.mdm_sock, &g_proto.session.remote_addr);
-                }
+                g_proto.session.sock = g_proto.mdm_sock;
+                g_proto.session.transport = &g_proto.mdm_tp;
+                proto_serve_request(handle_mdm_pdu);
             }
         }
 
@@ -472,18 +1378,38 @@ static void proto_server(void * arg) {
                 ESP_LOGI(PROTO_TAG, "APP Received %d bytes from %s:",
                         len, inet_ntoa(g_proto.session.remote_addr.sin_addr));
                 g_proto.recv_buff.len = len;
-                if (ESP_OK == decode_pdu()) {
-                    if (ESP_OK != handle_app_pdu() ||
-                        OSH_REQUEST_CONFIRM == g_proto.request.type) {
-                        // response when need confirm
-                        response_remote(g_proto.app_sock, &g_proto.session.remote_addr);
-                    }
-                } else {
-                    // response bad request
-                    response_remote(g_proto.app_sock, &g_proto.session.remote_addr);
-                }
+                g_proto.session.sock = g_proto.app_sock;
+                g_proto.session.transport = &g_proto.app_tp;
+                proto_serve_request(handle_app_pdu);
             }
         }
+
+        if (FD_ISSET(g_proto.report_sock, &read_fds)) {
+            struct sockaddr_in from;
+            socklen_t socklen = sizeof(struct sockaddr_in);
+            int len = recvfrom(g_proto.report_sock, g_proto.recv_buff.base,
+                        g_proto.recv_buff.size, 0, (struct sockaddr *)&from, &socklen);
+
+            osh_node_proto_pdu_t pdu;
+            if (len < 0) {
+                ESP_LOGE(PROTO_TAG, "recvfrom (report) failed: errno %d", errno);
+            } else if (ESP_OK == osh_proto_decode_pdu(&g_proto.report_session, &pdu,
+                                        g_proto.recv_buff.base, len)
+                        && OSH_CC_SGINAL == pdu.code_class
+                        && OSH_SIGNAL_HEARTBEAT == pdu.code_code) {
+                proto_handle_heartbeat(&pdu, &from);
+            }
+        }
+        xSemaphoreGive(g_proto.serve_lock);
+
+        if (__atomic_exchange_n(&g_proto.hb_due, false, __ATOMIC_ACQ_REL)) {
+            proto_send_heartbeat();
+        }
+
+#if CONFIG_NODE_PROXY_ENABLE
+        // upstream responses and timeouts
+        osh_proxy_poll(&read_fds, g_proto.app_sock);
+#endif
     }
 
     vTaskDelete(NULL);
@@ -519,15 +1445,116 @@ esp_err_t osh_node_proto_init(osh_node_bb_t *node_bb, void * conf_arg) {
         return ESP_ERR_NO_MEM;
     }
     memset(g_proto.send_buff.base, 0, CONFIG_NODE_PROTO_BUFF_SIZE);
-
-    // init entry list
-    vListInitialise(&g_proto.entry_list);
+    g_proto.arena.size = CONFIG_NODE_PROTO_ARENA_SIZE;
+    g_proto.arena.base = malloc(CONFIG_NODE_PROTO_ARENA_SIZE);
+    if (NULL == g_proto.arena.base) {
+        ESP_LOGE(PROTO_TAG, "failed to malloc mem for scratch arena");
+        return ESP_ERR_NO_MEM;
+    }
+    g_proto.session.arena = &g_proto.arena;
+
+    // heartbeat, armed while started
+    osh_node_timer_setup(&g_proto.hb_timer, hb_timeout_cb, NULL);
+
+    // no remote negotiated yet
+    memset(g_proto.csm_peers, 0, sizeof(g_proto.csm_peers));
+
+    // routes are registered after init
+    route_trie_free(g_proto.entry_root);
+    g_proto.entry_root = NULL;
+    if (NULL == g_proto.cache_lock) {
+        g_proto.cache_lock = xSemaphoreCreateMutex();
+        if (NULL == g_proto.cache_lock) {
+            ESP_LOGE(PROTO_TAG, "failed to create cache lock");
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    if (NULL == g_proto.serve_lock) {
+        g_proto.serve_lock = xSemaphoreCreateMutex();
+        if (NULL == g_proto.serve_lock) {
+            ESP_LOGE(PROTO_TAG, "failed to create serve lock");
+            return ESP_ERR_NO_MEM;
+        }
+    }
+#if CONFIG_NODE_PROTO_TOS_ENABLE
+    if (NULL == g_proto.tos_lock) {
+        g_proto.tos_lock = xSemaphoreCreateMutex();
+        if (NULL == g_proto.tos_lock) {
+            ESP_LOGE(PROTO_TAG, "failed to create TOS lock");
+            return ESP_ERR_NO_MEM;
+        }
+    }
+#endif
+
+    // directory of entries
+    esp_err_t res = osh_node_route_register(OSH_NODE_ENTRY_DIRECTORY,
+                        OSH_METHOD_OPTIONS, route_dir_handler);
+    if (ESP_OK != res) return res;
+    route_find(OSH_NODE_ENTRY_DIRECTORY, OSH_METHOD_OPTIONS, NULL)->version_cb =
+                        route_dir_version;
+
+    // transaction of updates, commit may write flash so never over budget
+    res = osh_node_route_register(OSH_NODE_ENTRY_TRANSACTION,
+                        OSH_METHOD_POST, route_txn_handler);
+    if (ESP_OK != res) return res;
+    route_find(OSH_NODE_ENTRY_TRANSACTION, OSH_METHOD_POST, NULL)->budget_us = 0;
+    g_proto.txn_commit = NULL;
+    g_proto.txn_commit_arg = NULL;
+
+#if CONFIG_NODE_FSM_TRACE_ENABLE
+    // timeline of FSMs for field debugging
+    res = osh_node_route_register(OSH_NODE_ENTRY_FSM_TRACE, OSH_METHOD_GET, route_trace_handler);
+    if (ESP_OK != res) return res;
+#endif
+
+#if CONFIG_NODE_RES_ENABLE
+    // static resources in flash, no handler code, routed at start
+    res = osh_res_init();
+    if (ESP_OK != res) return res;
+#endif
+
+    // peers heard from heartbeats
+    res = osh_peer_init();
+    if (ESP_OK != res) return res;
+
+    // deferred requests
+    res = osh_flight_init();
+    if (ESP_OK != res) return res;
+
+#if CONFIG_NODE_PROTO_WORKER_ENABLE
+    res = osh_worker_init(node_bb);
+    if (ESP_OK != res) return res;
+#endif
+
+#if CONFIG_NODE_PROXY_ENABLE
+    res = osh_proxy_init();
+    if (ESP_OK != res) return res;
+#endif
     ESP_LOGI(PROTO_TAG, "coap proto init");
     return ESP_OK;
 }
 
 /* fini proto */
 esp_err_t osh_node_proto_fini(void) {
+#if CONFIG_NODE_PROXY_ENABLE
+    osh_proxy_fini();
+#endif
+#if CONFIG_NODE_PROTO_WORKER_ENABLE
+    osh_worker_fini();
+#endif
+    osh_flight_fini();
+#if CONFIG_NODE_RES_ENABLE
+    osh_res_fini();
+#endif
+    route_trie_free(g_proto.entry_root);
+    g_proto.entry_root = NULL;
+    free(g_proto.dir.octets);
+    g_proto.dir.octets = NULL;
+    g_proto.dir.num = 0;
+    for (int i = 0; i < CONFIG_NODE_PROTO_CACHE_NUM; i++) {
+        free(g_proto.cache[i].data);
+        memset(&g_proto.cache[i], 0, sizeof(osh_node_proto_cache_t));
+    }
     if (NULL != g_proto.recv_buff.base) {
         free(g_proto.recv_buff.base);
         g_proto.recv_buff.size = 0;
@@ -538,6 +1565,14 @@ esp_err_t osh_node_proto_fini(void) {
         g_proto.send_buff.size = 0;
         g_proto.send_buff.base = NULL;
     }
+    if (NULL != g_proto.arena.base) {
+        free(g_proto.arena.base);
+        g_proto.arena.size = 0;
+        g_proto.arena.base = NULL;
+    }
+    g_proto.session.arena = NULL;
+    free(g_proto.serve_buff);
+    g_proto.serve_buff = NULL;
     return ESP_OK;
 }
 
@@ -560,13 +1595,29 @@ esp_err_t osh_node_proto_start(void *run_arg) {
     struct sockaddr_in addr;
     struct ip_mreq mreq;
     int err;
+    int reuse = 1;
 
-    // report - multicast client
+    // report - multicast client, also hears heartbeats of peers
     g_proto.report_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
     if (0 > g_proto.report_sock) {
         ESP_LOGE(PROTO_TAG, "faield to create Report socket, errno:%d", errno);
         goto failed;
     }
+    // report port may be the same as APP port
+    setsockopt(g_proto.report_sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    err = bind(g_proto.report_sock, (struct sockaddr *)&g_proto.report_addr,
+                sizeof(g_proto.report_addr));
+    if (err < 0) {
+        ESP_LOGE(PROTO_TAG, "Report socket unable to bind: errno %d", errno);
+        goto failed;
+    }
+    mreq.imr_multiaddr.s_addr = g_proto.report_addr.sin_addr.s_addr;
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    err = setsockopt(g_proto.report_sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq));
+    if (err < 0) {
+        ESP_LOGE(PROTO_TAG, "Report failed to add multicast membership: errno %d", errno);
+        goto failed;
+    }
 
     // mdm - multicast server
     g_proto.mdm_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
@@ -596,6 +1647,7 @@ esp_err_t osh_node_proto_start(void *run_arg) {
         ESP_LOGE(PROTO_TAG, "faield to create APP socket, errno:%d", errno);
         goto failed;
     }
+    setsockopt(g_proto.app_sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
     addr.sin_family = AF_INET;
     addr.sin_port = htons(CONFIG_NODE_PROTO_PORT);
     addr.sin_addr.s_addr = htonl(INADDR_ANY);
@@ -605,30 +1657,41 @@ esp_err_t osh_node_proto_start(void *run_arg) {
         goto failed;
     }
 
+    // links of the sockets
+    if (ESP_OK != osh_node_transport_udp(&g_proto.mdm_tp, g_proto.mdm_sock) ||
+        ESP_OK != osh_node_transport_udp(&g_proto.app_tp, g_proto.app_sock)) {
+        ESP_LOGE(PROTO_TAG, "failed to set up UDP transports");
+        goto failed;
+    }
+
+#if CONFIG_NODE_RES_ENABLE
+    // routes of app are registered by now
+    osh_res_register();
+#endif
+
     // task
     if (NULL == g_proto.proto_task) {
         // create proto task if not existed
         xTaskCreate(proto_server, "proto", 8*1024, &g_proto, 5, &g_proto.proto_task);
     } else {
-        // suspend proto task if existed
+        // resume proto task parked by stop
+        __atomic_store_n(&g_proto.stop_req, false, __ATOMIC_RELEASE);
         vTaskResume(g_proto.proto_task);
     }
 
-    if (NULL == g_proto.hb_timer) {
-        // create timer if not existed
-        g_proto.hb_timer = xTimerCreate("hb_timer",
-                                    pdMS_TO_TICKS(CONFIG_NODE_PROTO_HB_PERIOD),
-                                    pdTRUE, NULL,
-                                    hb_timeout_cb);
-        if (NULL == g_proto.hb_timer) {
-            ESP_LOGE(PROTO_TAG, "Failed to create heartbeat timer");
-            return OSH_ERR_PROTO_INNER;
-        }
-    } else {
-        // start timer
-        xTimerStart(g_proto.hb_timer, 0);
+    // heartbeat on timer wheel
+    if (ESP_OK != osh_node_timer_arm(&g_proto.hb_timer, CONFIG_NODE_PROTO_HB_PERIOD * 1000,
+                                    CONFIG_NODE_PROTO_HB_PERIOD * 1000)) {
+        ESP_LOGE(PROTO_TAG, "Failed to start heartbeat timer");
+        return OSH_ERR_PROTO_INNER;
     }
 
+#if CONFIG_NODE_MDNS_ENABLE
+    // heartbeat stays for peers, controllers find node with one query
+    if (ESP_OK != osh_mdns_start(g_proto.node_bb, g_proto.dir.version)) {
+        ESP_LOGW(PROTO_TAG, "node not advertised by DNS-SD");
+    }
+#endif
     return ESP_OK;
 
 failed:
@@ -650,19 +1713,37 @@ failed:
 
 /* stop proto */
 esp_err_t osh_node_proto_stop(void) {
+    // proto task parks itself between requests, a suspend from here could
+    // leave it holding serve, TOS or flight lock
+    if (NULL != g_proto.proto_task) {
+        __atomic_store_n(&g_proto.stop_req, true, __ATOMIC_RELEASE);
+        proto_wake();
+        while (eSuspended != eTaskGetState(g_proto.proto_task)) {
+            vTaskDelay(pdMS_TO_TICKS(10));
+        }
+    }
+
     // clear up buffer
     memset(g_proto.recv_buff.base, 0, g_proto.recv_buff.size);
     g_proto.recv_buff.len = 0;
     memset(g_proto.send_buff.base, 0, g_proto.send_buff.size);
     g_proto.send_buff.len = 0;
 
-    // suspend proto task
-    vTaskSuspend(g_proto.proto_task);
-
     // stop timer
-    xTimerStop(g_proto.hb_timer, 0);
+    osh_node_timer_cancel(&g_proto.hb_timer);
+    __atomic_store_n(&g_proto.hb_due, false, __ATOMIC_RELEASE);
+
+#if CONFIG_NODE_MDNS_ENABLE
+    osh_mdns_stop();
+#endif
+
+#if CONFIG_NODE_PROXY_ENABLE
+    osh_proxy_stop();
+#endif
 
     // close sockets
+    osh_node_transport_fini(&g_proto.mdm_tp);
+    osh_node_transport_fini(&g_proto.app_tp);
     if (-1 != g_proto.report_sock) {
         close(g_proto.report_sock);
         g_proto.report_sock = -1;
@@ -679,69 +1760,217 @@ esp_err_t osh_node_proto_stop(void) {
 }
 
 
+/* tag and cache a read resolved later, as proto_call_route does */
+void osh_proto_tag_result(uint32_t e, uint8_t method, osh_node_proto_pdu_t *rsp) {
+    if (OSH_CC_SUCCESS != rsp->code_class) return;
+    if (OSH_METHOD_GET != method && OSH_METHOD_OPTIONS != method) return;
+    osh_node_proto_route_t *route = route_find(e, method, NULL);
+    if (NULL == route) return;
+
+    uint32_t tag = (NULL == route->version_cb) ? 0 : route->version_cb(e, g_proto.node_bb);
+    route_tag_content(route, e, tag, rsp);
+}
+
+/* announce node state which changed */
+void osh_node_proto_advertise(void) {
+#if CONFIG_NODE_MDNS_ENABLE
+    osh_mdns_refresh(g_proto.dir.version);
+#endif
+}
+
+/* serve one request received on link */
+esp_err_t osh_node_proto_serve(osh_node_transport_t *tp, uint32_t timeout_ms) {
+    if (NULL == tp || NULL == tp->ops) return ESP_ERR_INVALID_ARG;
+    if (NULL == g_proto.serve_lock || NULL == g_proto.recv_buff.base) return ESP_ERR_INVALID_STATE;
+    if (NULL == g_proto.serve_buff) {
+        g_proto.serve_buff = malloc(CONFIG_NODE_PROTO_BUFF_SIZE);
+        if (NULL == g_proto.serve_buff) return ESP_ERR_NO_MEM;
+    }
+
+    // received without the lock, the proto task goes on meanwhile
+    struct sockaddr_in from;
+    int len = osh_node_transport_recv(tp, g_proto.serve_buff, CONFIG_NODE_PROTO_BUFF_SIZE,
+                        &from, timeout_ms);
+    if (0 == len) return ESP_ERR_TIMEOUT;
+    if (0 > len) return OSH_ERR_PROTO_SOCKET;
+
+    xSemaphoreTake(g_proto.serve_lock, portMAX_DELAY);
+    memcpy(g_proto.recv_buff.base, g_proto.serve_buff, len);
+    g_proto.recv_buff.len = len;
+    g_proto.session.remote_addr = from;
+    g_proto.session.sock = -1;
+    g_proto.session.transport = tp;
+    proto_serve_request(handle_link_pdu);
+    xSemaphoreGive(g_proto.serve_lock);
+    return ESP_OK;
+}
+
 /* register handler */
 esp_err_t osh_node_route_register(uint32_t e,
                                   OSH_CODE_METHOD_ENUM method,
                                   osh_node_proto_handler_t handler) {
-    esp_err_t res = ESP_FAIL;
-
-    osh_node_proto_entry_t *entry = NULL;
-    osh_node_proto_route_t *route = NULL;
+    return osh_node_route_register_range(e, 0xFFFFFFFFUL, method, handler);
+}
 
-    // find the entry
-    if (!listLIST_IS_EMPTY(&g_proto.entry_list)) {
-        osh_node_proto_entry_t *tmp_entry = NULL;
-        listFOR_EACH_ENTRY(&g_proto.entry_list, osh_node_proto_entry_t, tmp_entry) {
-            if (e == tmp_entry->entry) {
-                // matched
-                entry = tmp_entry;
-                break;
-            }
-        }
+/* add route into trie, directory not rebuilt */
+static esp_err_t route_add(uint32_t e,
+                        uint32_t mask,
+                        OSH_CODE_METHOD_ENUM method,
+                        osh_node_proto_handler_t handler) {
+    if (NULL == handler || OSH_METHOD_BUTT <= method) {
+        ESP_LOGE(PROTO_TAG, "invalid route method %d@0x%lx", (int)method, e);
+        return ESP_ERR_INVALID_ARG;
+    }
+    // only high bits can be masked, so ranges nest as prefixes
+    uint32_t host = ~mask;
+    if (0 != (host & (host + 1))) {
+        ESP_LOGE(PROTO_TAG, "mask 0x%lx not contiguous", mask);
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (0 != (e & host)) {
+        ESP_LOGW(PROTO_TAG, "entry 0x%lx has bits out of mask 0x%lx", e, mask);
     }
 
-    if (NULL == entry) {
-        // not matched, create a new entry
-        entry = (osh_node_proto_entry_t *)malloc(sizeof(osh_node_proto_entry_t));
-        if (NULL == entry) {
-            ESP_LOGE(PROTO_TAG, "failed to malloc mem for entry 0x%lx", e);
-            res = ESP_ERR_NO_MEM;
-            goto clearup;
-        }
-        entry->entry = e;
-        // init entry list
-        vListInitialise(&entry->route_list);
-        // init entry item
-        vListInitialiseItem(&entry->entry_item);
-
-        // add entry to list
-        listSET_LIST_ITEM_OWNER(&entry->entry_item, entry);
-        vListInsert(&g_proto.entry_list, &entry->entry_item);
+    osh_node_proto_entry_t *entry = route_trie_insert(e, (uint8_t)__builtin_popcount(mask));
+    if (NULL == entry) return ESP_ERR_NO_MEM;
+    if (0 != (entry->methods & (1UL << method))) {
+        ESP_LOGE(PROTO_TAG, "route exist. method %d@0x%lx/0x%lx", (int)method, e, mask);
+        return OSH_ERR_PROTO_ROUTE_EXIST;
     }
 
     // register route into entry
-    route = malloc(sizeof(osh_node_proto_route_t));
+    osh_node_proto_route_t *route = malloc(sizeof(osh_node_proto_route_t));
     if (NULL == route) {
         ESP_LOGE(PROTO_TAG, "failed to malloc for method %d@0x%lx",
                 (int)method, e);
-        res = ESP_ERR_NO_MEM;
-        goto clearup;
+        return ESP_ERR_NO_MEM;
     }
     memset(route, 0, sizeof(osh_node_proto_route_t));
 
     route->method = method;
+    route->route_cb = handler;
+    route->budget_us = CONFIG_NODE_PROTO_ROUTE_BUDGET;
     vListInitialiseItem(&route->route_item);
     listSET_LIST_ITEM_OWNER(&route->route_item, route);
 
     // insert to route list
     route->route_item.xItemValue = (int)method;  // using bits as value
     vListInsert(&entry->route_list, &route->route_item);
+    entry->methods |= (1UL << method);
 
-    ESP_LOGI(PROTO_TAG, "create method method %d@0x%lx", (int)method, e);
+    ESP_LOGI(PROTO_TAG, "create method method %d@0x%lx/0x%lx", (int)method, e, mask);
     return ESP_OK;
+}
 
-clearup:
-    if (NULL != entry)  free(entry);
-    if (NULL != route) free(route);
-    return res;
+/* register handler for a masked entry range */
+esp_err_t osh_node_route_register_range(uint32_t e,
+                                  uint32_t mask,
+                                  OSH_CODE_METHOD_ENUM method,
+                                  osh_node_proto_handler_t handler) {
+    esp_err_t res = route_add(e, mask, method, handler);
+    if (ESP_OK != res) return res;
+    return route_dir_rebuild();
+}
+
+/* register routes of table, directory rebuilt once */
+esp_err_t osh_node_route_register_table(const osh_node_route_def_t *table,
+                                  size_t num) {
+    if (NULL == table && 0 < num) return ESP_ERR_INVALID_ARG;
+
+    for (size_t i = 0; i < num; i++) {
+        esp_err_t res = route_add(table[i].entry, table[i].mask,
+                            table[i].method, table[i].handler);
+        if (ESP_OK != res) {
+            route_dir_rebuild();
+            return res;
+        }
+    }
+    return route_dir_rebuild();
+}
+
+/* enable response cache of GET route */
+esp_err_t osh_node_route_cache_enable(uint32_t e, uint32_t ttl_ms) {
+    osh_node_proto_route_t *route = route_find(e, OSH_METHOD_GET, NULL);
+    if (NULL == route) {
+        ESP_LOGE(PROTO_TAG, "no GET route for 0x%lx to cache", e);
+        return ESP_ERR_NOT_FOUND;
+    }
+    // a ttl below one tick still expires, 0 is kept for never
+    TickType_t ttl = pdMS_TO_TICKS(ttl_ms);
+    if (0 != ttl_ms && 0 == ttl) ttl = 1;
+    route->cache_ttl = ttl;
+    route->cache_on = true;
+    return ESP_OK;
+}
+
+/* set content version callback of GET route */
+esp_err_t osh_node_route_set_version(uint32_t e,
+                                     osh_node_proto_version_t version_cb) {
+    osh_node_proto_route_t *route = route_find(e, OSH_METHOD_GET, NULL);
+    if (NULL == route) {
+        ESP_LOGE(PROTO_TAG, "no GET route for 0x%lx to version", e);
+        return ESP_ERR_NOT_FOUND;
+    }
+    route->version_cb = version_cb;
+    return ESP_OK;
+}
+
+/* drop cached response, the slot is reused by the proto task */
+esp_err_t osh_node_route_cache_invalidate(uint32_t e) {
+    if (NULL == g_proto.cache_lock) return ESP_ERR_INVALID_STATE;
+
+    xSemaphoreTake(g_proto.cache_lock, portMAX_DELAY);
+    for (int i = 0; i < CONFIG_NODE_PROTO_CACHE_NUM; i++) {
+        if (e == g_proto.cache[i].entry) g_proto.cache[i].valid = false;
+    }
+    xSemaphoreGive(g_proto.cache_lock);
+    return ESP_OK;
+}
+
+/* set transaction operations of PUT route */
+esp_err_t osh_node_route_set_txn(uint32_t e, const osh_node_route_txn_t *ops) {
+    if (NULL != ops && NULL == ops->apply) return ESP_ERR_INVALID_ARG;
+
+    osh_node_proto_route_t *route = route_find(e, OSH_METHOD_PUT, NULL);
+    if (NULL == route) {
+        ESP_LOGE(PROTO_TAG, "no PUT route for 0x%lx to join transactions", e);
+        return ESP_ERR_NOT_FOUND;
+    }
+    route->txn = ops;
+    return ESP_OK;
+}
+
+/* set commit hook of transactions */
+esp_err_t osh_node_proto_set_commit(osh_node_proto_commit_t commit, void *arg) {
+    g_proto.txn_commit = commit;
+    g_proto.txn_commit_arg = arg;
+    return ESP_OK;
+}
+
+/* set latency budget of route */
+esp_err_t osh_node_route_set_budget(uint32_t e,
+                                    OSH_CODE_METHOD_ENUM method,
+                                    uint32_t budget_us,
+                                    bool demote) {
+    osh_node_proto_route_t *route = route_find(e, method, NULL);
+    if (NULL == route) {
+        ESP_LOGE(PROTO_TAG, "no route method %d@0x%lx to budget", (int)method, e);
+        return ESP_ERR_NOT_FOUND;
+    }
+    route->budget_us = budget_us;
+    route->demote = demote;
+    if (!demote) route->stats.demoted = false;
+    return ESP_OK;
+}
+
+/* copy route statistics */
+esp_err_t osh_node_route_get_stats(uint32_t e,
+                                   OSH_CODE_METHOD_ENUM method,
+                                   osh_node_route_stats_t *stats) {
+    if (NULL == stats) return ESP_ERR_INVALID_ARG;
+
+    osh_node_proto_route_t *route = route_find(e, method, NULL);
+    if (NULL == route) return ESP_ERR_NOT_FOUND;
+    *stats = route->stats;
+    return ESP_OK;
 }
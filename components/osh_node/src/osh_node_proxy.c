@@ -0,0 +1,481 @@
+/*
+ * @Author      : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @Date        : 2024-06-10 21:14:25
+ * @LastEditors : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @LastEditTime: 2024-06-10 23:41:08
+ * @FilePath    : /OpenSmartHome/components/osh_node/src/osh_node_proxy.c
+ * @Description : forwarding proxy for CONNECT method
+ * Copyright (c) 2024 by Zheng, Yang, All Rights Reserved.
+ */
+
+#include <string.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "osh_node_proxy.h"
+#include "osh_node_proxy.inc"
+#include "osh_node_power.h"
+
+static const char *PROXY_TAG = "PROXY";
+
+static osh_node_proxy_t g_proxy;
+
+#define PROXY_TICK_MS               100
+
+#define proxy_elapsed(now, tick, ms) \
+    ((TickType_t)((now) - (tick)) >= pdMS_TO_TICKS(ms))
+
+/** -------------------------------
+ *            helpers
+ *  -------------------------------
+*/
+static bool proxy_key_equal(const osh_node_proxy_key_t *a,
+                        const osh_node_proxy_key_t *b) {
+    return a->s_addr == b->s_addr && a->port == b->port &&
+            a->code_code == b->code_code && a->entry_ind == b->entry_ind &&
+            a->entry == b->entry && a->con_hash == b->con_hash;
+}
+
+static osh_node_proxy_cache_t *proxy_find_cache(const osh_node_proxy_key_t *key) {
+    for (int i = 0; i < CONFIG_NODE_PROXY_CACHE_NUM; i++) {
+        osh_node_proxy_cache_t *cache = &g_proxy.caches[i];
+        if (cache->valid && proxy_key_equal(&cache->key, key)) return cache;
+    }
+    return NULL;
+}
+
+static void proxy_store_cache(const osh_node_proxy_key_t *key,
+                        const uint8_t *octets, size_t len) {
+    if (len > CONFIG_NODE_PROTO_BUFF_SIZE) return;
+
+    // same key, or free one, or the oldest one
+    osh_node_proxy_cache_t *cache = proxy_find_cache(key);
+    TickType_t now = xTaskGetTickCount();
+    for (int i = 0; NULL == cache && i < CONFIG_NODE_PROXY_CACHE_NUM; i++) {
+        if (!g_proxy.caches[i].valid) cache = &g_proxy.caches[i];
+    }
+    if (NULL == cache) {
+        cache = &g_proxy.caches[0];
+        for (int i = 1; i < CONFIG_NODE_PROXY_CACHE_NUM; i++) {
+            if ((TickType_t)(now - g_proxy.caches[i].rcv_tick) >
+                (TickType_t)(now - cache->rcv_tick)) cache = &g_proxy.caches[i];
+        }
+    }
+
+    memcpy(cache->octets.base, octets, len);
+    cache->octets.len = len;
+    cache->key = *key;
+    cache->rcv_tick = now;
+    cache->valid = true;
+}
+
+static osh_node_proxy_pending_t *proxy_find_pending(const osh_node_proxy_key_t *key) {
+    for (int i = 0; i < CONFIG_NODE_PROXY_PENDING_NUM; i++) {
+        osh_node_proxy_pending_t *pending = &g_proxy.pendings[i];
+        if (pending->in_use && proxy_key_equal(&pending->key, key)) return pending;
+    }
+    return NULL;
+}
+
+static osh_node_proxy_pending_t *proxy_alloc_pending(void) {
+    for (int i = 0; i < CONFIG_NODE_PROXY_PENDING_NUM; i++) {
+        osh_node_proxy_pending_t *pending = &g_proxy.pendings[i];
+        if (!pending->in_use) {
+            memset(pending, 0, sizeof(osh_node_proxy_pending_t));
+            pending->in_use = true;
+            return pending;
+        }
+    }
+    return NULL;
+}
+
+static bool proxy_upstream_busy(int idx) {
+    for (int i = 0; i < CONFIG_NODE_PROXY_PENDING_NUM; i++) {
+        if (g_proxy.pendings[i].in_use && idx == g_proxy.pendings[i].upstream) return true;
+    }
+    return false;
+}
+
+static void proxy_close_upstream(osh_node_proxy_upstream_t *up) {
+    if (-1 != up->session.sock) {
+        close(up->session.sock);
+        up->session.sock = -1;
+    }
+    up->session.state = OSH_SESSION_STATE_NONE;
+}
+
+/* reuse session to target, or open one on a free or idle slot */
+static int proxy_fetch_upstream(uint32_t s_addr, uint16_t port) {
+    int idx = -1;
+    for (int i = 0; i < CONFIG_NODE_PROXY_UPSTREAM_NUM; i++) {
+        osh_node_proxy_upstream_t *up = &g_proxy.upstreams[i];
+        if (-1 != up->session.sock &&
+            s_addr == up->session.remote_addr.sin_addr.s_addr &&
+            port == up->session.remote_addr.sin_port) {
+            up->last_used = xTaskGetTickCount();
+            return i;
+        }
+        if (-1 == up->session.sock && -1 == idx) idx = i;
+    }
+
+    // evict least recently used session without request in flight
+    TickType_t now = xTaskGetTickCount();
+    for (int i = 0, free_idx = idx; -1 == free_idx && i < CONFIG_NODE_PROXY_UPSTREAM_NUM; i++) {
+        if (proxy_upstream_busy(i)) continue;
+        if (-1 == idx || (TickType_t)(now - g_proxy.upstreams[i].last_used) >
+                        (TickType_t)(now - g_proxy.upstreams[idx].last_used)) idx = i;
+    }
+    if (-1 == idx) return -1;
+
+    osh_node_proxy_upstream_t *up = &g_proxy.upstreams[idx];
+    proxy_close_upstream(up);
+    memset(&up->session, 0, sizeof(osh_node_proto_session_t));
+    up->session.remote_addr.sin_family = AF_INET;
+    up->session.remote_addr.sin_addr.s_addr = s_addr;
+    up->session.remote_addr.sin_port = port;
+    up->session.sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+    if (0 > up->session.sock) {
+        ESP_LOGE(PROXY_TAG, "failed to create upstream socket, errno:%d", errno);
+        up->session.sock = -1;
+        return -1;
+    }
+    // connected socket only receives from the target
+    if (0 > connect(up->session.sock, (struct sockaddr *)&up->session.remote_addr,
+                    sizeof(struct sockaddr_in))) {
+        ESP_LOGE(PROXY_TAG, "failed to connect upstream %s, errno:%d",
+                inet_ntoa(up->session.remote_addr.sin_addr), errno);
+        proxy_close_upstream(up);
+        return -1;
+    }
+    up->session.state = OSH_SESSION_STATE_ESTABLISHED;
+    up->last_used = now;
+    ESP_LOGI(PROXY_TAG, "upstream %d to %s", idx, inet_ntoa(up->session.remote_addr.sin_addr));
+    return idx;
+}
+
+/* reply to a parked requester, inner is the raw upstream response. the
+   whole reply fits what requester takes, else it gets 5.02 */
+static void proxy_reply(int sock, const osh_node_proxy_waiter_t *waiter,
+                        OSH_CODE_CLASS_ENUM cls, uint8_t code,
+                        const uint8_t *inner, size_t len) {
+    osh_node_proto_pdu_t rsp;
+    memset(&rsp, 0, sizeof(osh_node_proto_pdu_t));
+    rsp.version = OSH_NODE_PROTO_VER;
+    rsp.type = (OSH_CC_SUCCESS == cls) ? OSH_RESPONSE_ACK : OSH_RESPONSE_RESET;
+    rsp.code_class = cls;
+    rsp.code_code = code;
+    rsp.token_ind = waiter->token_ind;
+    rsp.con_type = OSH_CONTENT_OCTETS;
+    rsp.con_len = len;
+    rsp.data = (void *)inner;
+    size_t size = MIN(g_proxy.send_buff.size, waiter->max_msg_size);
+    rsp.session = &g_proxy.session;
+    rsp.octets = g_proxy.send_buff.base;
+    rsp.octets_size = size;
+    rsp.oct_rd = rsp.oct_wr = g_proxy.send_buff.base;
+
+    // token of the CONNECT request being answered
+    g_proxy.session.last_token = waiter->token;
+    if (ESP_OK != osh_proto_encode_pdu(&g_proxy.session, &rsp, g_proxy.send_buff.base, size)) {
+        if (0 == len) {
+            ESP_LOGE(PROXY_TAG, "failed to encode reply");
+            return;
+        }
+        ESP_LOGW(PROXY_TAG, "upstream response of %u bytes over %u for %s",
+                 (unsigned)len, (unsigned)size, inet_ntoa(waiter->remote_addr.sin_addr));
+        g_proxy.stats.oversized++;
+        proxy_reply(sock, waiter, OSH_CC_SERVER_ERR, OSH_SERR_BAD_GATEWAY, NULL, 0);
+        return;
+    }
+    g_proxy.send_buff.len = rsp.oct_wr - rsp.oct_rd;
+
+    // restore token of the inner request in the copy being sent
+    uint8_t *copy = rsp.oct_wr - len;
+    if (0 < len && waiter->inner_token_ind && (copy[0] & 0x04)
+        && OSH_NODE_PROTO_PDU_HEADER_MIN_LEN + 4 <= len) {
+        copy[8] = (uint8_t)((waiter->inner_token & 0xFF000000) >> 24);
+        copy[9] = (uint8_t)((waiter->inner_token & 0xFF0000) >> 16);
+        copy[10] = (uint8_t)((waiter->inner_token & 0xFF00) >> 8);
+        copy[11] = (uint8_t)(waiter->inner_token & 0xFF);
+    }
+
+    if (0 > osh_proto_sendto(sock, rsp.oct_rd, g_proxy.send_buff.len,
+                    &waiter->remote_addr, osh_proto_traffic_class(&rsp))) {
+        ESP_LOGE(PROXY_TAG, "failed to reply to %s", inet_ntoa(waiter->remote_addr.sin_addr));
+    }
+}
+
+static void proxy_reply_all(int sock, osh_node_proxy_pending_t *pending,
+                        OSH_CODE_CLASS_ENUM cls, uint8_t code,
+                        const uint8_t *inner, size_t len) {
+    for (size_t i = 0; i < pending->waiter_num; i++) {
+        proxy_reply(sock, &pending->waiters[i], cls, code, inner, len);
+    }
+    pending->in_use = false;
+}
+
+/** -------------------------------
+ *            functions
+ *  -------------------------------
+*/
+
+/* init proxy */
+esp_err_t osh_proxy_init(void) {
+    memset(&g_proxy, 0, sizeof(osh_node_proxy_t));
+    for (int i = 0; i < CONFIG_NODE_PROXY_UPSTREAM_NUM; i++) {
+        g_proxy.upstreams[i].session.sock = -1;
+    }
+
+    g_proxy.recv_buff.size = CONFIG_NODE_PROTO_BUFF_SIZE;
+    g_proxy.recv_buff.base = malloc(CONFIG_NODE_PROTO_BUFF_SIZE);
+    // reply carries a whole inner PDU, within what a requester receives
+    g_proxy.send_buff.size = CONFIG_NODE_PROTO_BUFF_SIZE;
+    g_proxy.send_buff.base = malloc(g_proxy.send_buff.size);
+    if (NULL == g_proxy.recv_buff.base || NULL == g_proxy.send_buff.base) {
+        ESP_LOGE(PROXY_TAG, "failed to malloc mem for proxy buff");
+        osh_proxy_fini();
+        return ESP_ERR_NO_MEM;
+    }
+
+    for (int i = 0; i < CONFIG_NODE_PROXY_CACHE_NUM; i++) {
+        osh_node_proxy_cache_t *cache = &g_proxy.caches[i];
+        cache->octets.size = CONFIG_NODE_PROTO_BUFF_SIZE;
+        cache->octets.base = malloc(CONFIG_NODE_PROTO_BUFF_SIZE);
+        if (NULL == cache->octets.base) {
+            ESP_LOGE(PROXY_TAG, "failed to malloc mem for proxy cache");
+            osh_proxy_fini();
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    ESP_LOGI(PROXY_TAG, "proxy init");
+    return ESP_OK;
+}
+
+/* fini proxy */
+esp_err_t osh_proxy_fini(void) {
+    osh_proxy_stop();
+    if (NULL != g_proxy.recv_buff.base) free(g_proxy.recv_buff.base);
+    if (NULL != g_proxy.send_buff.base) free(g_proxy.send_buff.base);
+    for (int i = 0; i < CONFIG_NODE_PROXY_CACHE_NUM; i++) {
+        if (NULL != g_proxy.caches[i].octets.base) free(g_proxy.caches[i].octets.base);
+    }
+    memset(&g_proxy, 0, sizeof(osh_node_proxy_t));
+    for (int i = 0; i < CONFIG_NODE_PROXY_UPSTREAM_NUM; i++) {
+        g_proxy.upstreams[i].session.sock = -1;
+    }
+    return ESP_OK;
+}
+
+/* close upstream sessions and drop requests in flight */
+esp_err_t osh_proxy_stop(void) {
+    for (int i = 0; i < CONFIG_NODE_PROXY_UPSTREAM_NUM; i++) {
+        proxy_close_upstream(&g_proxy.upstreams[i]);
+    }
+    for (int i = 0; i < CONFIG_NODE_PROXY_PENDING_NUM; i++) {
+        g_proxy.pendings[i].in_use = false;
+    }
+    // keep cache, sleeping nodes are still answered after reconnect
+    return ESP_OK;
+}
+
+/* handle CONNECT request received from sock */
+esp_err_t osh_proxy_connect(int sock, const osh_node_proto_pdu_t *req,
+                        osh_node_proto_pdu_t *rsp) {
+    osh_node_proto_pdu_t inner;
+
+    if (OSH_NODE_PROTO_CONNECT_TARGET_LEN + OSH_NODE_PROTO_PDU_HEADER_MIN_LEN > req->con_len) {
+        ESP_LOGE(PROXY_TAG, "CONNECT without target. [0x%x]", req->mid);
+        proto_response_err_head(req, rsp, OSH_CC_CLIENT_ERR, OSH_CERR_BAD_REQUEST);
+        return OSH_ERR_PROTO_PDU_FMT;
+    }
+
+    // target
+    const uint8_t *target = req->oct_rd;
+    osh_node_proxy_key_t key;
+    memset(&key, 0, sizeof(osh_node_proxy_key_t));
+    memcpy(&key.s_addr, &target[0], sizeof(key.s_addr));
+    memcpy(&key.port, &target[4], sizeof(key.port));
+
+    // inner request
+    if (ESP_OK != osh_proto_decode_pdu(&g_proxy.session, &inner,
+                        req->oct_rd + OSH_NODE_PROTO_CONNECT_TARGET_LEN,
+                        req->con_len - OSH_NODE_PROTO_CONNECT_TARGET_LEN)
+        || 1 < inner.type || OSH_CC_METHOD != inner.code_class) {
+        ESP_LOGE(PROXY_TAG, "CONNECT with invalid inner request. [0x%x]", req->mid);
+        proto_response_err_head(req, rsp, OSH_CC_CLIENT_ERR, OSH_CERR_BAD_REQUEST);
+        return OSH_ERR_PROTO_PDU_FMT;
+    }
+    key.code_code = inner.code_code;
+    key.entry_ind = inner.entry_ind;
+    key.entry = inner.entry;
+    key.con_hash = osh_node_fnv1a(OSH_FNV1A_SEED, inner.oct_rd, inner.con_len);
+
+    osh_node_proxy_waiter_t waiter = {
+        .remote_addr = req->session->remote_addr,
+        .token = req->token,
+        .inner_token = inner.token,
+        .token_ind = req->token_ind,
+        .inner_token_ind = inner.token_ind,
+        .max_msg_size = req->session->csm.max_msg_size,
+    };
+    bool reply = (OSH_REQUEST_CONFIRM == req->type);
+    bool safe = (OSH_METHOD_GET == inner.code_code || OSH_METHOD_FETCH == inner.code_code);
+
+    // fresh cached response
+    TickType_t now = xTaskGetTickCount();
+    osh_node_proxy_cache_t *cache = NULL;
+    if (OSH_METHOD_GET == inner.code_code && NULL != (cache = proxy_find_cache(&key))
+        && !proxy_elapsed(now, cache->rcv_tick, CONFIG_NODE_PROXY_CACHE_TTL * 1000)) {
+        ESP_LOGD(PROXY_TAG, "cache hit %s. [0x%x]", inet_ntoa(waiter.remote_addr.sin_addr), req->mid);
+        g_proxy.stats.cache_hits++;
+        if (reply) {
+            proxy_reply(sock, &waiter, OSH_CC_SUCCESS, OSH_SUCCESS_CONTENT,
+                        cache->octets.base, cache->octets.len);
+        }
+        return OSH_ERR_PROTO_DEFERRED;
+    }
+
+    // identical request in flight
+    osh_node_proxy_pending_t *pending = NULL;
+    if (safe && NULL != (pending = proxy_find_pending(&key))) {
+        if (!reply) return OSH_ERR_PROTO_DEFERRED;
+        if (CONFIG_NODE_PROXY_WAITER_NUM <= pending->waiter_num) {
+            g_proxy.stats.rejected++;
+            proto_response_err_head(req, rsp, OSH_CC_SERVER_ERR, OSH_SERR_UNAVAILABLE);
+            return OSH_ERR_PROTO_INNER;
+        }
+        pending->waiters[pending->waiter_num++] = waiter;
+        g_proxy.stats.coalesced++;
+        return OSH_ERR_PROTO_DEFERRED;
+    }
+
+    // forward to upstream
+    int idx = -1;
+    if (NULL == (pending = proxy_alloc_pending()) ||
+        -1 == (idx = proxy_fetch_upstream(key.s_addr, key.port))) {
+        if (NULL != pending) pending->in_use = false;
+        ESP_LOGW(PROXY_TAG, "no room to forward. [0x%x]", req->mid);
+        g_proxy.stats.rejected++;
+        proto_response_err_head(req, rsp, OSH_CC_SERVER_ERR, OSH_SERR_UNAVAILABLE);
+        return OSH_ERR_PROTO_INNER;
+    }
+    osh_node_proxy_upstream_t *up = &g_proxy.upstreams[idx];
+
+    // re-encode with a token of proxy to match the upstream response
+    osh_node_proto_pdu_t out = inner;
+    if (reply) out.type = OSH_REQUEST_CONFIRM;
+    out.token_ind = 1;
+    out.token = g_proxy.next_token++;
+    out.data = inner.oct_rd;
+    out.session = &up->session;
+    out.octets = out.oct_rd = out.oct_wr = g_proxy.send_buff.base;
+    out.octets_size = g_proxy.send_buff.size;
+    if (ESP_OK != osh_proto_encode_pdu(&up->session, &out,
+                        g_proxy.send_buff.base, g_proxy.send_buff.size)
+        || 0 > osh_proto_sendto(up->session.sock, out.oct_rd, out.oct_wr - out.oct_rd,
+                        NULL, OSH_TC_CONTROL)) {
+        ESP_LOGE(PROXY_TAG, "failed to forward to %s. [0x%x]",
+                inet_ntoa(up->session.remote_addr.sin_addr), req->mid);
+        pending->in_use = false;
+        proto_response_err_head(req, rsp, OSH_CC_SERVER_ERR, OSH_SERR_BAD_GATEWAY);
+        return OSH_ERR_PROTO_SOCKET;
+    }
+    g_proxy.stats.forwarded++;
+
+    pending->key = key;
+    pending->upstream = idx;
+    pending->token = out.token;
+    pending->sent_tick = now;
+    if (reply) {
+        pending->waiters[pending->waiter_num++] = waiter;
+        // answer due within timeout, not to be parked at AP
+        osh_node_power_expect(0, CONFIG_NODE_PROXY_TIMEOUT);
+    } else {
+        // nobody waits for the answer
+        pending->in_use = false;
+    }
+    return OSH_ERR_PROTO_DEFERRED;
+}
+
+/* add upstream sockets to select set and shorten timeout if waiting */
+void osh_proxy_fill_fds(fd_set *fds, int *max_sd, struct timeval *timeout) {
+    bool waiting = false;
+    for (int i = 0; i < CONFIG_NODE_PROXY_UPSTREAM_NUM; i++) {
+        int sock = g_proxy.upstreams[i].session.sock;
+        if (-1 == sock) continue;
+        FD_SET(sock, fds);
+        if (sock > *max_sd) *max_sd = sock;
+    }
+    for (int i = 0; i < CONFIG_NODE_PROXY_PENDING_NUM; i++) {
+        waiting |= g_proxy.pendings[i].in_use;
+    }
+    if (waiting) {
+        timeout->tv_sec = 0;
+        timeout->tv_usec = PROXY_TICK_MS * 1000;
+    }
+}
+
+/* handle upstream responses and timeouts, replies are sent on sock */
+void osh_proxy_poll(fd_set *fds, int sock) {
+    osh_node_proto_pdu_t inner;
+
+    for (int i = 0; i < CONFIG_NODE_PROXY_UPSTREAM_NUM; i++) {
+        osh_node_proxy_upstream_t *up = &g_proxy.upstreams[i];
+        if (-1 == up->session.sock || !FD_ISSET(up->session.sock, fds)) continue;
+
+        int len = recv(up->session.sock, g_proxy.recv_buff.base, g_proxy.recv_buff.size, 0);
+        if (0 > len) {
+            ESP_LOGE(PROXY_TAG, "recv upstream %d failed: errno %d", i, errno);
+            continue;
+        }
+        g_proxy.recv_buff.len = len;
+        if (ESP_OK != osh_proto_decode_pdu(&up->session, &inner,
+                            g_proxy.recv_buff.base, g_proxy.recv_buff.len)
+            || 2 > inner.type || 0 == inner.token_ind) {
+            ESP_LOGW(PROXY_TAG, "drop invalid upstream response");
+            continue;
+        }
+
+        for (int j = 0; j < CONFIG_NODE_PROXY_PENDING_NUM; j++) {
+            osh_node_proxy_pending_t *pending = &g_proxy.pendings[j];
+            if (!pending->in_use || i != pending->upstream || inner.token != pending->token) continue;
+
+            if (OSH_METHOD_GET == pending->key.code_code && OSH_CC_SUCCESS == inner.code_class) {
+                proxy_store_cache(&pending->key, g_proxy.recv_buff.base, g_proxy.recv_buff.len);
+            }
+            up->last_used = xTaskGetTickCount();
+            proxy_reply_all(sock, pending, OSH_CC_SUCCESS, OSH_SUCCESS_CONTENT,
+                        g_proxy.recv_buff.base, g_proxy.recv_buff.len);
+            break;
+        }
+    }
+
+    // upstream not answered, fall back to stale cache
+    TickType_t now = xTaskGetTickCount();
+    for (int i = 0; i < CONFIG_NODE_PROXY_PENDING_NUM; i++) {
+        osh_node_proxy_pending_t *pending = &g_proxy.pendings[i];
+        if (!pending->in_use || !proxy_elapsed(now, pending->sent_tick, CONFIG_NODE_PROXY_TIMEOUT)) continue;
+
+        osh_node_proxy_cache_t *cache = proxy_find_cache(&pending->key);
+        if (NULL != cache && !proxy_elapsed(now, cache->rcv_tick, CONFIG_NODE_PROXY_CACHE_STALE * 1000)) {
+            g_proxy.stats.stale_served++;
+            proxy_reply_all(sock, pending, OSH_CC_SUCCESS, OSH_SUCCESS_CONTENT,
+                        cache->octets.base, cache->octets.len);
+        } else {
+            ESP_LOGW(PROXY_TAG, "upstream %s timeout",
+                    inet_ntoa(g_proxy.upstreams[pending->upstream].session.remote_addr.sin_addr));
+            g_proxy.stats.timeouts++;
+            proxy_reply_all(sock, pending, OSH_CC_SERVER_ERR, OSH_SERR_TIMEOUT, NULL, 0);
+        }
+    }
+}
+
+/* get statistics of proxy */
+esp_err_t osh_node_proxy_get_stats(osh_node_proxy_stats_t *stats) {
+    if (NULL == stats) return ESP_ERR_INVALID_ARG;
+    *stats = g_proxy.stats;
+    return ESP_OK;
+}
@@ -0,0 +1,195 @@
+/*
+ * @Author      : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @Date        : 2024-06-22 10:24:51
+ * @LastEditors : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @LastEditTime: 2024-06-22 16:02:37
+ * @FilePath    : /OpenSmartHome/components/osh_node/src/osh_node_res.c
+ * @Description : static resources served from flash partition
+ * Copyright (c) 2024 by Zheng, Yang, All Rights Reserved.
+ */
+
+#include <string.h>
+#include <sys/param.h>
+
+#include "osh_node_proto.h"
+#include "osh_node_res.inc"
+
+static const char *RES_TAG = "RES";
+
+static osh_node_res_t g_res;
+
+/* binary search of index sorted by entry */
+static const osh_node_res_record_t *res_lookup(uint32_t entry) {
+    if (NULL == g_res.base) return NULL;
+
+    size_t lo = 0, hi = g_res.header->num;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const osh_node_res_record_t *rec = &g_res.index[mid];
+        if (entry == rec->entry) return rec;
+        if (entry < rec->entry) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return NULL;
+}
+
+/* content tag packed into the image */
+static uint32_t res_version(uint32_t entry, osh_node_bb_t *node_bb) {
+    const osh_node_res_record_t *rec = res_lookup(entry);
+    return (NULL == rec) ? 0 : rec->hash;
+}
+
+/* GET of resource, content sent straight from mapped flash */
+static esp_err_t res_get_handler(uint32_t entry,
+            osh_node_bb_t *node_bb,
+            osh_node_proto_session_t *session,
+            const osh_node_proto_pdu_t *req,
+            osh_node_proto_pdu_t *rsp) {
+    const osh_node_res_record_t *rec = res_lookup(entry);
+    if (NULL == rec) {
+        proto_response_err_head(req, rsp, OSH_CC_CLIENT_ERR, OSH_CERR_NOT_FOUND);
+        return OSH_ERR_PROTO_NOT_FOUND;
+    }
+
+    // request content may give the block number (2)
+    size_t block = 0;
+    if (2 <= req->con_len) block = (size_t)((req->oct_rd[0] << 8) | req->oct_rd[1]);
+    size_t room = MIN(CONFIG_NODE_PROTO_BUFF_SIZE, session->csm.max_msg_size)
+                    - OSH_NODE_PROTO_PDU_HEADER_MAX_LEN;
+    size_t block_size = MIN(session->csm.block_size, room);
+    size_t start = block * block_size;
+    if (start > rec->len || (0 < block && start == rec->len)) {
+        proto_response_err_head(req, rsp, OSH_CC_CLIENT_ERR, OSH_CERR_BAD_OPTION);
+        return OSH_ERR_PROTO_PDU_FMT;
+    }
+
+    size_t len = MIN(block_size, rec->len - start);
+    proto_response_ack_head(req, rsp, OSH_CC_SUCCESS,
+            (start + len < rec->len) ? OSH_SUCCESS_CONTINUE : OSH_SUCCESS_CONTENT);
+    rsp->con_type = (OSH_CONTENT_TYPE_ENUM)rec->con_type;
+    rsp->con_len = len;
+    rsp->data = (void *)&g_res.base[rec->offset + start];
+    rsp->hash = rec->hash;
+    return ESP_OK;
+}
+
+/* check mapped image before trusting the index */
+static bool res_image_valid(const uint8_t *base, size_t size) {
+    const osh_node_res_header_t *header = (const osh_node_res_header_t *)base;
+    const osh_node_res_record_t *index = (const osh_node_res_record_t *)&header[1];
+    if (sizeof(osh_node_res_header_t) + header->num * sizeof(osh_node_res_record_t) > size) {
+        ESP_LOGE(RES_TAG, "index of %d records out of image", header->num);
+        return false;
+    }
+    for (size_t i = 0; i < header->num; i++) {
+        const osh_node_res_record_t *rec = &index[i];
+        if (rec->offset > size || rec->len > size - rec->offset ||
+            OSH_CONTENT_BUTT <= rec->con_type ||
+            (0 < i && index[i - 1].entry >= rec->entry)) {
+            ESP_LOGE(RES_TAG, "invalid record %d of 0x%lx", i, rec->entry);
+            return false;
+        }
+    }
+    return true;
+}
+
+/** -------------------------------
+ *            functions
+ *  -------------------------------
+*/
+
+/* map image, resources registered at proto start */
+esp_err_t osh_res_init(void) {
+    osh_res_fini();
+
+    const esp_partition_t *part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                        OSH_NODE_RES_PARTITION_SUBTYPE, NULL);
+    if (NULL == part) {
+        ESP_LOGI(RES_TAG, "no resource partition");
+        return ESP_OK;
+    }
+
+    osh_node_res_header_t header;
+    esp_err_t res = esp_partition_read(part, 0, &header, sizeof(header));
+    if (ESP_OK != res) {
+        ESP_LOGE(RES_TAG, "failed to read resource image, err:%d", res);
+        return ESP_OK;
+    }
+    if (OSH_NODE_RES_MAGIC != header.magic || OSH_NODE_RES_VERSION != header.version ||
+        sizeof(header) > header.size || header.size > part->size) {
+        ESP_LOGI(RES_TAG, "no resource image in %s", part->label);
+        return ESP_OK;
+    }
+
+    // map only the image, not the whole partition
+    const void *base = NULL;
+    res = esp_partition_mmap(part, 0, header.size, ESP_PARTITION_MMAP_DATA,
+                        &base, &g_res.handle);
+    if (ESP_OK != res) {
+        ESP_LOGE(RES_TAG, "failed to map resource image, err:%d", res);
+        return ESP_OK;
+    }
+    if (!res_image_valid(base, header.size)) {
+        esp_partition_munmap(g_res.handle);
+        return ESP_OK;
+    }
+    g_res.base = base;
+    g_res.header = base;
+    g_res.index = (const osh_node_res_record_t *)&g_res.header[1];
+
+    ESP_LOGI(RES_TAG, "%d resources of %ld bytes mapped", g_res.header->num, g_res.header->size);
+    return ESP_OK;
+}
+
+/**
+ * register GET of resources once, at proto start so routes of app are in.
+ * an entry the app serves by code, also within a range, is left to it
+*/
+void osh_res_register(void) {
+    if (NULL == g_res.base || g_res.registered) return;
+    g_res.registered = true;
+
+    osh_node_route_stats_t stats;
+    for (size_t i = 0; i < g_res.header->num; i++) {
+        uint32_t entry = g_res.index[i].entry;
+        if (ESP_OK == osh_node_route_get_stats(entry, OSH_METHOD_GET, &stats)) {
+            ESP_LOGI(RES_TAG, "resource 0x%lx served by handler code", entry);
+            continue;
+        }
+        esp_err_t res = osh_node_route_register(entry, OSH_METHOD_GET, res_get_handler);
+        if (ESP_OK == res) res = osh_node_route_set_version(entry, res_version);
+        if (ESP_OK != res) {
+            ESP_LOGW(RES_TAG, "resource 0x%lx not served, err:%d", entry, res);
+        }
+    }
+}
+
+/* unmap image */
+void osh_res_fini(void) {
+    if (NULL == g_res.base) return;
+    esp_partition_munmap(g_res.handle);
+    memset(&g_res, 0, sizeof(osh_node_res_t));
+}
+
+/* number of resources */
+size_t osh_node_res_count(void) {
+    return (NULL == g_res.base) ? 0 : g_res.header->num;
+}
+
+/* find content of resource */
+esp_err_t osh_node_res_find(uint32_t entry,
+                            const void **data,
+                            size_t *len,
+                            OSH_CONTENT_TYPE_ENUM *con_type) {
+    if (NULL == data || NULL == len) return ESP_ERR_INVALID_ARG;
+
+    const osh_node_res_record_t *rec = res_lookup(entry);
+    if (NULL == rec) return ESP_ERR_NOT_FOUND;
+    *data = &g_res.base[rec->offset];
+    *len = rec->len;
+    if (NULL != con_type) *con_type = (OSH_CONTENT_TYPE_ENUM)rec->con_type;
+    return ESP_OK;
+}
@@ -14,6 +14,7 @@
 #include "osh_node_status.h"
 #include "osh_node_fsm.h"
 #include "osh_node_wifi.h"
+#include "osh_node_timer.h"
 
 static const uint32_t status_rgb[OSH_FSM_STATE_BUTT + 1] = {
     // OSH_FSM_STATE_INIT, yellow
@@ -30,12 +31,46 @@ static const uint32_t status_rgb[OSH_FSM_STATE_BUTT + 1] = {
     (1UL << 16)
 };
 
+/* blink period, LED toggled on each expiry */
+#define STATUS_BLINK_MS         2000
+
 // on/off flag
 static BaseType_t led_flag = pdFALSE;
-// last time
-static TickType_t last_time;
 // last state
 static OSH_FSM_STATES_ENUM last_state = OSH_FSM_STATE_BUTT;
+// blackboard, network FSM shown
+static osh_node_bb_t *g_status_bb = NULL;
+// blink on timer wheel, stopped while saving
+static osh_node_timer_t g_status_timer;
+static bool g_status_started = false;
+static bool g_status_saving = false;
+static portMUX_TYPE g_status_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/* set RGB, 0 turns off */
+static void status_set_rgb(uint32_t rgb) {
+    gpio_set_level(CONFIG_STATUS_R_LED_GPIO_NUM, (rgb & 0xFF0000) >> 16);
+    gpio_set_level(CONFIG_STATUS_G_LED_GPIO_NUM, (rgb & 0x00FF00) >> 8);
+    gpio_set_level(CONFIG_STATUS_B_LED_GPIO_NUM, (rgb & 0xFF));
+}
+
+/* blink state of network FSM, in timer task */
+static void status_blink_cb(void *arg) {
+    OSH_FSM_STATES_ENUM state = osh_node_fsm_get_state(g_status_bb->net_fsm);
+    state = (OSH_FSM_STATE_BUTT < state) ? OSH_FSM_STATE_BUTT : state;
+
+    portENTER_CRITICAL(&g_status_lock);
+    if (!g_status_saving) {
+        if (last_state != state) {
+            // new state shown at once
+            last_state = state;
+            led_flag = pdTRUE;
+        } else {
+            led_flag = !led_flag;
+        }
+        status_set_rgb(led_flag ? status_rgb[state] : 0);
+    }
+    portEXIT_CRITICAL(&g_status_lock);
+}
 
 /* init RGB LED for status indicator */
 esp_err_t osh_node_status_init(osh_node_bb_t *node_bb, void *conf_arg) {
@@ -49,53 +84,32 @@ esp_err_t osh_node_status_init(osh_node_bb_t *node_bb, void *conf_arg) {
         .pull_up_en     = 0
     };
     gpio_config(&io_config);
-    last_time = xTaskGetTickCount();
+    g_status_bb = node_bb;
+    osh_node_timer_setup(&g_status_timer, status_blink_cb, NULL);
     return ESP_OK;
 }
 
-static void status_task(void * arg) {
-    while(1) {
-        // get state
-        OSH_FSM_STATES_ENUM state = osh_node_fsm_get_state();
-        state = (OSH_FSM_STATE_BUTT < state) ? OSH_FSM_STATE_BUTT : state;
-
-        TickType_t this_time = xTaskGetTickCount();
-
-        if (last_state != state) {
-            // update
-            last_time = this_time;
-            last_state = state;
-            led_flag = pdTRUE;
+/* start blinking, no task of its own */
+esp_err_t osh_node_status_start(void *run_arg) {
+    if (NULL == g_status_bb) return ESP_ERR_INVALID_STATE;
+    g_status_started = true;
+    return osh_node_timer_arm(&g_status_timer, 0, STATUS_BLINK_MS);
+}
 
-        }else if (((this_time - last_time) / (float)configTICK_RATE_HZ) > 2.0f) {
-            // reverse and update last time
-            led_flag =  !led_flag;
-            last_time = this_time;
-        }
+/* LED off and blink stopped while saving, so it wakes no CPU */
+void osh_node_status_saving(bool saving) {
+    if (!g_status_started) return;
 
-        if (led_flag) {
-            // set RGB
-            gpio_set_level(CONFIG_STATUS_R_LED_GPIO_NUM,
-                        (status_rgb[state] & 0xFF0000) >> 16);
-            gpio_set_level(CONFIG_STATUS_G_LED_GPIO_NUM,
-                        (status_rgb[state] & 0x00FF00) >> 8);
-            gpio_set_level(CONFIG_STATUS_B_LED_GPIO_NUM,
-                        (status_rgb[state] & 0xFF));
-        } else {
-            // turn off
-            gpio_set_level(CONFIG_STATUS_R_LED_GPIO_NUM, 0);
-            gpio_set_level(CONFIG_STATUS_G_LED_GPIO_NUM, 0);
-            gpio_set_level(CONFIG_STATUS_B_LED_GPIO_NUM, 0);
-        }
-         vTaskDelay(1000 / portTICK_PERIOD_MS);
+    portENTER_CRITICAL(&g_status_lock);
+    g_status_saving = saving;
+    last_state = OSH_FSM_STATE_BUTT;
+    if (saving) status_set_rgb(0);
+    portEXIT_CRITICAL(&g_status_lock);
+    if (saving) {
+        osh_node_timer_cancel(&g_status_timer);
+    } else {
+        osh_node_timer_arm(&g_status_timer, 0, STATUS_BLINK_MS);
     }
-    vTaskDelete(NULL);
-}
-
-/* start status  task*/
-esp_err_t osh_node_status_start(void *run_arg) {
-    xTaskCreate(status_task, "status", 512, NULL, 2, NULL);
-    return ESP_OK;
 }
 
 // callback for reset
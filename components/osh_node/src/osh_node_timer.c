@@ -0,0 +1,262 @@
+/*
+ * @Author      : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @Date        : 2024-06-27 20:14:26
+ * @LastEditors : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @LastEditTime: 2024-06-27 22:03:51
+ * @FilePath    : /OpenSmartHome/components/osh_node/src/osh_node_timer.c
+ * @Description : hierarchical timer wheel, all timeouts on one FreeRTOS timer
+ * Copyright (c) 2024 by Zheng, Yang, All Rights Reserved.
+ */
+
+#include "osh_node_timer.inc"
+
+static const char *TIMER_TAG = "TIMER";
+
+static osh_node_timer_wheel_t g_wheel = {0};
+
+/* link into head of list */
+static void timer_push(osh_node_timer_t **head, osh_node_timer_t *timer) {
+    timer->next = *head;
+    if (NULL != timer->next) timer->next->pprev = &timer->next;
+    *head = timer;
+    timer->pprev = head;
+}
+
+/* unlink from its list */
+static void timer_unlink(osh_node_timer_t *timer) {
+    *timer->pprev = timer->next;
+    if (NULL != timer->next) timer->next->pprev = timer->pprev;
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+/* put into lowest level covering its delay, expires not before now */
+static void timer_link(osh_node_timer_t *timer) {
+    uint32_t delta = timer->expires - g_wheel.now;
+    for (int lv = 0; lv < OSH_TIMER_LEVEL_NUM; lv++) {
+        uint32_t shift = OSH_TIMER_LEVEL_BITS * lv;
+        if (OSH_TIMER_LEVEL_NUM - 1 == lv || delta < (1UL << (shift + OSH_TIMER_LEVEL_BITS))) {
+            timer_push(&g_wheel.slots[lv][(timer->expires >> shift) & OSH_TIMER_LEVEL_MASK],
+                        timer);
+            return;
+        }
+    }
+}
+
+/* move timeouts of a slot down, entering its block */
+static void timer_cascade(int lv, uint32_t idx) {
+    osh_node_timer_t *timer = g_wheel.slots[lv][idx];
+    g_wheel.slots[lv][idx] = NULL;
+    while (NULL != timer) {
+        osh_node_timer_t *next = timer->next;
+        timer_link(timer);
+        g_wheel.stats.cascaded++;
+        timer = next;
+    }
+}
+
+/* delay in wheel ticks, at least one */
+static uint32_t timer_ticks(uint32_t ms) {
+    uint32_t ticks = ms / CONFIG_NODE_TIMER_TICK_MS + ((0 != ms % CONFIG_NODE_TIMER_TICK_MS) ? 1 : 0);
+    if (0 == ticks) return 1;
+    return (OSH_TIMER_MAX_TICKS < ticks) ? OSH_TIMER_MAX_TICKS : ticks;
+}
+
+/* FreeRTOS ticks of a wheel tick */
+static TickType_t timer_period(void) {
+    TickType_t period = pdMS_TO_TICKS(CONFIG_NODE_TIMER_TICK_MS);
+    return (0 == period) ? 1 : period;
+}
+
+/* wheel ticks passed since now, lock held */
+static uint32_t timer_elapsed(void) {
+    return (uint32_t)((xTaskGetTickCount() - g_wheel.base) / timer_period());
+}
+
+/**
+ * ticks from now to the first one having work, 0 if nothing pending. level 0
+ * gives the expiry, an upper level the tick its block is entered, woken
+ * there it cascades and the next wake is found in the level below
+*/
+static uint32_t timer_next(void) {
+    uint32_t next = 0;
+    for (uint32_t k = 1; k <= OSH_TIMER_LEVEL_SIZE; k++) {
+        if (NULL != g_wheel.slots[0][(g_wheel.now + k) & OSH_TIMER_LEVEL_MASK]) {
+            next = k;
+            break;
+        }
+    }
+    for (int lv = 1; lv < OSH_TIMER_LEVEL_NUM; lv++) {
+        uint32_t shift = OSH_TIMER_LEVEL_BITS * lv;
+        uint32_t block = g_wheel.now >> shift;
+        for (uint32_t k = 1; k <= OSH_TIMER_LEVEL_SIZE; k++) {
+            if (NULL == g_wheel.slots[lv][(block + k) & OSH_TIMER_LEVEL_MASK]) continue;
+            uint32_t ticks = ((block + k) << shift) - g_wheel.now;
+            if (0 == next || ticks < next) next = ticks;
+            break;
+        }
+    }
+    return next;
+}
+
+/* program FreeRTOS timer for the next tick having work, lock held */
+static void timer_program(void) {
+    uint32_t next = timer_next();
+    g_wheel.running = (0 != next);
+    if (!g_wheel.running) return;
+
+    // time spent since now was reached is taken off
+    TickType_t spent = xTaskGetTickCount() - g_wheel.base;
+    TickType_t delay = (TickType_t)next * timer_period();
+    delay = (delay > spent) ? delay - spent : 1;
+    g_wheel.wake = g_wheel.now + next;
+    if (pdPASS != xTimerChangePeriod(g_wheel.tick, delay, 0)) {
+        ESP_LOGE(TIMER_TAG, "failed to program tick");
+        g_wheel.running = false;
+    }
+}
+
+/* one tick of wheel, callbacks run without lock so they may arm or cancel */
+static void timer_step(void) {
+    g_wheel.now++;
+    g_wheel.base += timer_period();
+    uint32_t idx = g_wheel.now & OSH_TIMER_LEVEL_MASK;
+    if (0 == idx) {
+        // entering block of upper levels
+        for (int lv = 1; lv < OSH_TIMER_LEVEL_NUM; lv++) {
+            uint32_t i = (g_wheel.now >> (OSH_TIMER_LEVEL_BITS * lv)) & OSH_TIMER_LEVEL_MASK;
+            timer_cascade(lv, i);
+            if (0 != i) break;
+        }
+    }
+
+    // expired list lets a callback cancel another one of the same tick
+    g_wheel.expired = g_wheel.slots[0][idx];
+    if (NULL != g_wheel.expired) g_wheel.expired->pprev = &g_wheel.expired;
+    g_wheel.slots[0][idx] = NULL;
+    while (NULL != g_wheel.expired) {
+        osh_node_timer_t *timer = g_wheel.expired;
+        timer_unlink(timer);
+        if (0 != timer->period) {
+            timer->expires = g_wheel.now + timer->period;
+            timer_link(timer);
+        } else {
+            g_wheel.stats.pending--;
+        }
+        g_wheel.stats.fired++;
+        osh_node_timer_cb_t callback = timer->callback;
+        void *arg = timer->arg;
+
+        xSemaphoreGive(g_wheel.lock);
+        callback(arg);
+        xSemaphoreTake(g_wheel.lock, portMAX_DELAY);
+    }
+}
+
+/* woken for a tick having work, idle ticks before it are stepped over */
+static void timer_tick_cb(TimerHandle_t xtimer) {
+    xSemaphoreTake(g_wheel.lock, portMAX_DELAY);
+    g_wheel.stats.wakeups++;
+    // woken early by a later arm is fine, nothing to step
+    for (uint32_t ticks = timer_elapsed(); 0 < ticks; ticks--) timer_step();
+
+    // nothing pending leaves it stopped, next arm programs it again
+    timer_program();
+    xSemaphoreGive(g_wheel.lock);
+}
+
+/** -------------------------------
+ *            functions
+ *  -------------------------------
+*/
+
+/* create the FreeRTOS timer driving the wheel */
+esp_err_t osh_node_timer_init(void) {
+    if (NULL != g_wheel.lock) return ESP_OK;
+
+    g_wheel.lock = xSemaphoreCreateMutex();
+    if (NULL == g_wheel.lock) {
+        ESP_LOGE(TIMER_TAG, "failed to create lock");
+        return OSH_ERR_TIMER_INNER;
+    }
+    // one shot, programmed again by each wake while timeouts pending
+    g_wheel.tick = xTimerCreate("wheel", timer_period(), pdFALSE, NULL, timer_tick_cb);
+    if (NULL == g_wheel.tick) {
+        ESP_LOGE(TIMER_TAG, "failed to create tick timer");
+        vSemaphoreDelete(g_wheel.lock);
+        g_wheel.lock = NULL;
+        return OSH_ERR_TIMER_INNER;
+    }
+    ESP_LOGI(TIMER_TAG, "wheel of %d ms tick, up to %lu ms", CONFIG_NODE_TIMER_TICK_MS,
+                        OSH_TIMER_MAX_TICKS * CONFIG_NODE_TIMER_TICK_MS);
+    return ESP_OK;
+}
+
+/* set callback of timeout */
+void osh_node_timer_setup(osh_node_timer_t *timer, osh_node_timer_cb_t callback, void *arg) {
+    if (NULL == timer) return;
+    memset(timer, 0, sizeof(osh_node_timer_t));
+    timer->callback = callback;
+    timer->arg = arg;
+}
+
+/* arm timeout, O(1) */
+esp_err_t osh_node_timer_arm(osh_node_timer_t *timer, uint32_t delay_ms, uint32_t period_ms) {
+    if (NULL == timer || NULL == timer->callback) return ESP_ERR_INVALID_ARG;
+    if (NULL == g_wheel.lock) return OSH_ERR_TIMER_NOT_INIT;
+
+    xSemaphoreTake(g_wheel.lock, portMAX_DELAY);
+    if (NULL != timer->pprev) {
+        timer_unlink(timer);
+    } else {
+        g_wheel.stats.pending++;
+        if (g_wheel.stats.peak < g_wheel.stats.pending) {
+            g_wheel.stats.peak = g_wheel.stats.pending;
+        }
+    }
+    timer->period = (0 == period_ms) ? 0 : timer_ticks(period_ms);
+    if (!g_wheel.running) {
+        // stopped wheel catches up with the clock, nothing is linked to skip
+        g_wheel.base = xTaskGetTickCount();
+    }
+    // from the tick of the clock, the wheel may be behind it while asleep
+    timer->expires = g_wheel.now + timer_elapsed() + timer_ticks(delay_ms);
+    timer_link(timer);
+
+    // programmed wake is kept unless this one is due sooner
+    esp_err_t res = ESP_OK;
+    if (!g_wheel.running || 0 > (int32_t)(timer->expires - g_wheel.wake)) {
+        timer_program();
+        if (!g_wheel.running) res = OSH_ERR_TIMER_INNER;
+    }
+    xSemaphoreGive(g_wheel.lock);
+    return res;
+}
+
+/* cancel timeout, O(1) */
+void osh_node_timer_cancel(osh_node_timer_t *timer) {
+    if (NULL == timer || NULL == g_wheel.lock) return;
+    xSemaphoreTake(g_wheel.lock, portMAX_DELAY);
+    if (NULL != timer->pprev) {
+        timer_unlink(timer);
+        g_wheel.stats.pending--;
+    }
+    xSemaphoreGive(g_wheel.lock);
+}
+
+/* pending or not */
+bool osh_node_timer_pending(const osh_node_timer_t *timer) {
+    return (NULL != timer && NULL != timer->pprev);
+}
+
+/* get statistics */
+void osh_node_timer_get_stats(osh_node_timer_stats_t *stats) {
+    if (NULL == stats) return;
+    if (NULL == g_wheel.lock) {
+        memset(stats, 0, sizeof(osh_node_timer_stats_t));
+        return;
+    }
+    xSemaphoreTake(g_wheel.lock, portMAX_DELAY);
+    memcpy(stats, &g_wheel.stats, sizeof(osh_node_timer_stats_t));
+    xSemaphoreGive(g_wheel.lock);
+}
@@ -0,0 +1,368 @@
+/*
+ * @Author      : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @Date        : 2024-06-23 09:50:27
+ * @LastEditors : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @LastEditTime: 2024-06-23 17:26:09
+ * @FilePath    : /OpenSmartHome/components/osh_node/src/osh_node_transport.c
+ * @Description : links carrying proto PDUs, UDP and in-process loopback
+ * Copyright (c) 2024 by Zheng, Yang, All Rights Reserved.
+ */
+
+#include <string.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "osh_node_transport.h"
+#include "osh_node_proto.inc"
+
+static const char *TP_TAG = "TRANSPORT";
+
+/* in-process endpoint, frames sent by peer are queued in ring */
+typedef struct osh_node_loop_stru {
+    struct osh_node_loop_stru     *peer;
+    void                         *block;    // pair allocated as one
+    bool                         closed;
+    uint8_t                        ends;    // open ends, kept in first of pair
+    uint16_t                         id;    // port of endpoint
+    size_t                          mtu;
+    SemaphoreHandle_t              lock;    // ring, several tasks send
+    SemaphoreHandle_t             ready;    // given by peer on each frame
+    size_t                         head;    // written by peer
+    size_t                         tail;    // read by owner
+    uint8_t                        ring[CONFIG_NODE_TRANSPORT_LOOP_RING];
+} osh_node_loop_t;
+
+static uint16_t g_loop_id = 0;
+
+/* fragment from the sender being reassembled */
+static bool tp_same_from(const struct sockaddr_in *a, const struct sockaddr_in *b) {
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+/** -------------------------------
+ *            UDP
+ *  -------------------------------
+*/
+
+static int udp_send(osh_node_transport_t *tp, const uint8_t *frame, size_t len,
+                const struct sockaddr_in *to, OSH_TRAFFIC_CLASS_ENUM tc) {
+    return osh_proto_sendto((int)(intptr_t)tp->ctx, frame, len, to, tc);
+}
+
+static int udp_recv(osh_node_transport_t *tp, uint8_t *frame, size_t size,
+                struct sockaddr_in *from, uint32_t timeout_ms) {
+    int sock = (int)(intptr_t)tp->ctx;
+    fd_set read_fds;
+    FD_ZERO(&read_fds);
+    FD_SET(sock, &read_fds);
+    struct timeval timeout = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+    int activity = select(sock + 1, &read_fds, NULL, NULL, &timeout);
+    if (0 >= activity) return activity;
+
+    socklen_t socklen = sizeof(struct sockaddr_in);
+    return recvfrom(sock, frame, size, 0, (struct sockaddr *)from, &socklen);
+}
+
+static size_t udp_mtu(osh_node_transport_t *tp) {
+    return CONFIG_NODE_TRANSPORT_UDP_MTU;
+}
+
+static const osh_node_transport_ops_t g_udp_ops = {
+    .name = "udp",
+    .addr_type = OSH_ADDR_IPV4,
+    .send = udp_send,
+    .recv = udp_recv,
+    .mtu = udp_mtu,
+    .close = NULL,
+};
+
+/** -------------------------------
+ *            loopback
+ *  -------------------------------
+*/
+
+#define loop_used(lp)   ((lp)->head - (lp)->tail)
+
+static void loop_copy_in(osh_node_loop_t *lp, size_t pos, const uint8_t *data, size_t len) {
+    for (size_t i = 0; i < len; i++) lp->ring[(pos + i) % sizeof(lp->ring)] = data[i];
+}
+
+static void loop_copy_out(const osh_node_loop_t *lp, size_t pos, uint8_t *data, size_t len) {
+    for (size_t i = 0; i < len; i++) data[i] = lp->ring[(pos + i) % sizeof(lp->ring)];
+}
+
+/* queue frame with its length(2) into ring of peer */
+static int loop_send(osh_node_transport_t *tp, const uint8_t *frame, size_t len,
+                const struct sockaddr_in *to, OSH_TRAFFIC_CLASS_ENUM tc) {
+    osh_node_loop_t *peer = ((osh_node_loop_t *)tp->ctx)->peer;
+    if (len > peer->mtu) return -1;
+
+    int sent = -1;
+    xSemaphoreTake(peer->lock, portMAX_DELAY);
+    // full, dropped like a datagram
+    if (!peer->closed && sizeof(peer->ring) - loop_used(peer) >= 2 + len) {
+        uint8_t head[2] = {(uint8_t)(len >> 8), (uint8_t)len};
+        loop_copy_in(peer, peer->head, head, 2);
+        loop_copy_in(peer, peer->head + 2, frame, len);
+        peer->head += 2 + len;
+        sent = (int)len;
+    }
+    xSemaphoreGive(peer->lock);
+    if (0 < sent) xSemaphoreGive(peer->ready);
+    return sent;
+}
+
+static int loop_recv(osh_node_transport_t *tp, uint8_t *frame, size_t size,
+                struct sockaddr_in *from, uint32_t timeout_ms) {
+    osh_node_loop_t *lp = (osh_node_loop_t *)tp->ctx;
+    TickType_t start = xTaskGetTickCount();
+    TickType_t wait = pdMS_TO_TICKS(timeout_ms);
+
+    xSemaphoreTake(lp->lock, portMAX_DELAY);
+    while (0 == loop_used(lp)) {
+        xSemaphoreGive(lp->lock);
+        // woken by send of peer, a stale give only rechecks the ring
+        TickType_t spent = xTaskGetTickCount() - start;
+        if (spent >= wait || pdTRUE != xSemaphoreTake(lp->ready, wait - spent)) return 0;
+        xSemaphoreTake(lp->lock, portMAX_DELAY);
+    }
+
+    uint8_t head[2];
+    loop_copy_out(lp, lp->tail, head, 2);
+    size_t len = (size_t)((head[0] << 8) | head[1]);
+    if (len <= size) loop_copy_out(lp, lp->tail + 2, frame, len);
+    lp->tail += 2 + len;
+    xSemaphoreGive(lp->lock);
+    if (len > size) return -1;
+
+    memset(from, 0, sizeof(struct sockaddr_in));
+    from->sin_family = AF_INET;
+    from->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    from->sin_port = htons(lp->peer->id);
+    return (int)len;
+}
+
+static size_t loop_mtu(osh_node_transport_t *tp) {
+    return ((osh_node_loop_t *)tp->ctx)->mtu;
+}
+
+/* release pair allocated as one */
+static void loop_free(osh_node_loop_t *pair) {
+    for (int i = 0; i < 2; i++) {
+        if (NULL != pair[i].lock) vSemaphoreDelete(pair[i].lock);
+        if (NULL != pair[i].ready) vSemaphoreDelete(pair[i].ready);
+    }
+    free(pair);
+}
+
+static void loop_close(osh_node_transport_t *tp) {
+    osh_node_loop_t *lp = (osh_node_loop_t *)tp->ctx;
+    xSemaphoreTake(lp->lock, portMAX_DELAY);
+    lp->closed = true;
+    xSemaphoreGive(lp->lock);
+    // the last end closed frees the pair, even when both close at once
+    osh_node_loop_t *pair = (osh_node_loop_t *)lp->block;
+    if (0 == __atomic_sub_fetch(&pair[0].ends, 1, __ATOMIC_ACQ_REL)) loop_free(pair);
+    tp->ctx = NULL;
+}
+
+static const osh_node_transport_ops_t g_loop_ops = {
+    .name = "loop",
+    .addr_type = OSH_ADDR_LOOPBACK,
+    .send = loop_send,
+    .recv = loop_recv,
+    .mtu = loop_mtu,
+    .close = loop_close,
+};
+
+/** -------------------------------
+ *            functions
+ *  -------------------------------
+*/
+
+/* set up transport */
+esp_err_t osh_node_transport_init(osh_node_transport_t *tp,
+                                  const osh_node_transport_ops_t *ops,
+                                  void *ctx) {
+    if (NULL == tp || NULL == ops || NULL == ops->send || NULL == ops->recv ||
+        NULL == ops->mtu) return ESP_ERR_INVALID_ARG;
+
+    memset(tp, 0, sizeof(osh_node_transport_t));
+    tp->ops = ops;
+    tp->ctx = ctx;
+    tp->mtu = ops->mtu(tp);
+    if (OSH_NODE_FRAG_HEAD_LEN + 1 > tp->mtu) {
+        ESP_LOGE(TP_TAG, "MTU %u of %s too small", (unsigned)tp->mtu, ops->name);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (CONFIG_NODE_PROTO_BUFF_SIZE <= tp->mtu) return ESP_OK;
+
+    // PDU may be over MTU
+    tp->tx_frame = malloc(tp->mtu);
+    tp->rx_frame = malloc(tp->mtu);
+    tp->tx_lock = xSemaphoreCreateMutex();
+    if (NULL == tp->tx_frame || NULL == tp->rx_frame || NULL == tp->tx_lock) {
+        ESP_LOGE(TP_TAG, "failed to malloc mem for fragments of %s", ops->name);
+        osh_node_transport_fini(tp);
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+/* release transport */
+void osh_node_transport_fini(osh_node_transport_t *tp) {
+    if (NULL == tp) return;
+    if (NULL != tp->ops && NULL != tp->ops->close && NULL != tp->ctx) tp->ops->close(tp);
+    free(tp->tx_frame);
+    free(tp->rx_frame);
+    if (NULL != tp->tx_lock) vSemaphoreDelete(tp->tx_lock);
+    memset(tp, 0, sizeof(osh_node_transport_t));
+}
+
+/* send PDU in fragments if needed */
+esp_err_t osh_node_transport_send(osh_node_transport_t *tp,
+                                  const uint8_t *pdu,
+                                  size_t len,
+                                  const struct sockaddr_in *to,
+                                  OSH_TRAFFIC_CLASS_ENUM tc) {
+    if (NULL == tp || NULL == tp->ops || NULL == pdu) return ESP_ERR_INVALID_ARG;
+
+    if (len <= tp->mtu) {
+        return (0 > tp->ops->send(tp, pdu, len, to, tc)) ? OSH_ERR_PROTO_SOCKET : ESP_OK;
+    }
+    if (NULL == tp->tx_frame || 0xFFFF < len) return ESP_ERR_INVALID_SIZE;
+
+    esp_err_t res = ESP_OK;
+    size_t room = tp->mtu - OSH_NODE_FRAG_HEAD_LEN;
+    xSemaphoreTake(tp->tx_lock, portMAX_DELAY);
+    uint8_t id = tp->tx_id++;
+    for (size_t offset = 0; offset < len; offset += room) {
+        size_t chunk = MIN(room, len - offset);
+        tp->tx_frame[0] = OSH_NODE_FRAG_MARK | ((offset + chunk < len) ? OSH_NODE_FRAG_MORE : 0);
+        tp->tx_frame[1] = id;
+        tp->tx_frame[2] = (uint8_t)(offset >> 8);
+        tp->tx_frame[3] = (uint8_t)offset;
+        memcpy(&tp->tx_frame[OSH_NODE_FRAG_HEAD_LEN], &pdu[offset], chunk);
+        if (0 > tp->ops->send(tp, tp->tx_frame, OSH_NODE_FRAG_HEAD_LEN + chunk, to, tc)) {
+            res = OSH_ERR_PROTO_SOCKET;
+            break;
+        }
+    }
+    xSemaphoreGive(tp->tx_lock);
+    return res;
+}
+
+/* receive PDU, reassembled in order from one sender at a time */
+int osh_node_transport_recv(osh_node_transport_t *tp,
+                            uint8_t *buff,
+                            size_t size,
+                            struct sockaddr_in *from,
+                            uint32_t timeout_ms) {
+    if (NULL == tp || NULL == tp->ops || NULL == buff || NULL == from) return -1;
+
+    TickType_t start = xTaskGetTickCount();
+    while (1) {
+        TickType_t spent = xTaskGetTickCount() - start;
+        uint32_t wait = (spent >= pdMS_TO_TICKS(timeout_ms)) ? 0 :
+                        timeout_ms - spent * portTICK_PERIOD_MS;
+
+        // whole PDU straight into buff unless reassembling
+        uint8_t *frame = tp->rx_active ? tp->rx_frame : buff;
+        size_t frame_size = tp->rx_active ? tp->mtu : size;
+        struct sockaddr_in src;
+        int len = tp->ops->recv(tp, frame, frame_size, &src, wait);
+        if (0 >= len) return len;
+
+        if (OSH_NODE_FRAG_MARK != (frame[0] & 0xC0)) {
+            if (tp->rx_active) {
+                ESP_LOGW(TP_TAG, "fragments from %s dropped", inet_ntoa(tp->rx_from.sin_addr));
+                tp->rx_active = false;
+                if ((size_t)len > size) return -1;
+                memcpy(buff, frame, len);
+            }
+            *from = src;
+            return len;
+        }
+
+        // fragment
+        if (OSH_NODE_FRAG_HEAD_LEN > len || NULL == tp->rx_frame) continue;
+        size_t offset = (size_t)((frame[2] << 8) | frame[3]);
+        size_t chunk = len - OSH_NODE_FRAG_HEAD_LEN;
+        if (0 == offset) {
+            // first one, later fragments come into rx frame
+            tp->rx_active = true;
+            tp->rx_id = frame[1];
+            tp->rx_from = src;
+            tp->rx_len = 0;
+        } else if (!tp->rx_active || tp->rx_id != frame[1] ||
+                    !tp_same_from(&tp->rx_from, &src) || tp->rx_len != offset) {
+            // lost or out of order, wait for a new PDU
+            tp->rx_active = false;
+            continue;
+        }
+        if (offset + chunk > size) {
+            ESP_LOGW(TP_TAG, "PDU from %s over %u bytes", inet_ntoa(src.sin_addr), (unsigned)size);
+            tp->rx_active = false;
+            continue;
+        }
+        // first fragment is moved over its own head in buff
+        bool more = (0 != (frame[0] & OSH_NODE_FRAG_MORE));
+        memmove(&buff[offset], &frame[OSH_NODE_FRAG_HEAD_LEN], chunk);
+        tp->rx_len = offset + chunk;
+        if (!more) {
+            tp->rx_active = false;
+            *from = src;
+            return (int)tp->rx_len;
+        }
+    }
+}
+
+/* UDP transport */
+esp_err_t osh_node_transport_udp(osh_node_transport_t *tp, int sock) {
+    if (0 > sock) return ESP_ERR_INVALID_ARG;
+    return osh_node_transport_init(tp, &g_udp_ops, (void *)(intptr_t)sock);
+}
+
+/* loopback pair */
+esp_err_t osh_node_transport_loop_pair(osh_node_transport_t *a,
+                                       osh_node_transport_t *b,
+                                       size_t mtu) {
+    if (NULL == a || NULL == b) return ESP_ERR_INVALID_ARG;
+    if (0 == mtu) mtu = CONFIG_NODE_PROTO_BUFF_SIZE;
+
+    osh_node_loop_t *pair = calloc(2, sizeof(osh_node_loop_t));
+    if (NULL == pair) return ESP_ERR_NO_MEM;
+    osh_node_loop_t *la = &pair[0], *lb = &pair[1];
+    la->peer = lb;
+    lb->peer = la;
+    la->block = lb->block = pair;
+    la->mtu = lb->mtu = mtu;
+    la->ends = 2;
+    la->id = ++g_loop_id;
+    lb->id = ++g_loop_id;
+    for (int i = 0; i < 2; i++) {
+        pair[i].lock = xSemaphoreCreateMutex();
+        pair[i].ready = xSemaphoreCreateBinary();
+        if (NULL == pair[i].lock || NULL == pair[i].ready) {
+            ESP_LOGE(TP_TAG, "failed to create locks of loop pair");
+            loop_free(pair);
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    esp_err_t res = osh_node_transport_init(a, &g_loop_ops, la);
+    if (ESP_OK != res) {
+        loop_free(pair);
+        return res;
+    }
+    res = osh_node_transport_init(b, &g_loop_ops, lb);
+    if (ESP_OK != res) {
+        // a frees the pair, b never opened
+        lb->closed = true;
+        la->ends = 1;
+        osh_node_transport_fini(a);
+    }
+    return res;
+}
@@ -30,19 +30,25 @@
 #include "osh_node_wifi.h"
 #include "osh_node_events.h"
 #include "osh_node_fsm.h"
+#include "osh_node_fsm_table.inc"
 #include "osh_node_proto.h"
+#include "osh_node_power.h"
+#include "osh_node_timer.h"
 
 const char *WIFI_TAG = "WiFi";
 
 #define NODE_NAME_LEN                      12
 #define MAX_PING_TIMEOUT                    5
 
+_Static_assert(sizeof(esp_netif_ip_info_t) <= CONFIG_NODE_FSM_PAYLOAD_SIZE,
+               "NODE_FSM_PAYLOAD_SIZE too small for IP of OSH_NODE_EVENT_CONNECT");
+
 /* network */
 typedef struct
 {
     osh_node_bb_t              *node_bb;
     uint8_t               timeout_count;
-    TimerHandle_t            ping_timer;
+    osh_node_timer_t         ping_timer;
     esp_ping_handle_t              ping;
     ip_addr_t                gateway_ip;
     void                      *conf_arg;
@@ -158,11 +164,14 @@ static void event_handler(void* arg, esp_event_base_t event_base,
     } else if (event_base == WIFI_EVENT) {
         switch (event_id) {
             case WIFI_EVENT_STA_START:
+                osh_node_power_set_listen();
                 esp_wifi_connect();
                 break;
             case WIFI_EVENT_STA_DISCONNECTED:
                 ESP_LOGI(WIFI_TAG, "Disconnected. Connecting to the AP again...");
-                osh_node_fsm_invoke_event(OSH_NODE_EVENT_DISCONNECT);
+                osh_node_fsm_invoke_event(g_node_wifi.node_bb->net_fsm, OSH_NODE_EVENT_DISCONNECT);
+                // credentials of provisioning came without listen interval
+                osh_node_power_set_listen();
                 esp_wifi_connect();
                 break;
             case WIFI_EVENT_AP_STACONNECTED:
@@ -179,7 +188,11 @@ static void event_handler(void* arg, esp_event_base_t event_base,
         ESP_LOGI(WIFI_TAG, "Connected with IP Address:" IPSTR, IP2STR(&event->ip_info.ip));
 
         // change state and invoke OSH_NODE_EVENT_CONNECT
-        osh_node_fsm_invoke_event(OSH_NODE_EVENT_CONNECT);
+        esp_err_t res = osh_node_fsm_post_event(g_node_wifi.node_bb->net_fsm,
+                        OSH_NODE_EVENT_CONNECT, &event->ip_info, sizeof(event->ip_info));
+        if (ESP_OK != res) {
+            ESP_LOGE(WIFI_TAG, "failed to post CONNECT, err:%s", esp_err_to_name(res));
+        }
 
         // Get the DNS server IP dynamically
         esp_netif_dns_info_t dns;
@@ -241,12 +254,12 @@ static void ping_on_timeout(esp_ping_handle_t hdl, void *args) {
     if (MAX_PING_TIMEOUT > ++g_node_wifi.timeout_count) {
         // invoke event
         g_node_wifi.timeout_count = 0; // reset
-        osh_node_fsm_invoke_event(OSH_NODE_EVENT_DISCONNECT);
+        osh_node_fsm_invoke_event(g_node_wifi.node_bb->net_fsm, OSH_NODE_EVENT_DISCONNECT);
         esp_wifi_connect();
     }
 }
 
-static void ping_timeout_cb(TimerHandle_t timer) {
+static void ping_timeout_cb(void *arg) {
     // start ping
     esp_ping_start(g_node_wifi.ping);
 
@@ -262,7 +275,7 @@ static void ping_timeout_cb(TimerHandle_t timer) {
  * event: OSH_NODE_EVENT_POWERON
  * next state: OSH_FSM_STATE_INIT, wait for network provision and connect
 */
-static esp_err_t osh_node_wifi_init_poweron(void *config, void *arg) {
+esp_err_t osh_node_wifi_init_poweron(void *config, void *arg) {
 
     /* Register our event handler for Wi-Fi, IP and Provisioning related events */
     ESP_ERROR_CHECK(esp_event_handler_register(
@@ -382,12 +395,19 @@ static esp_err_t osh_node_wifi_init_poweron(void *config, void *arg) {
  * event: OSH_NODE_EVENT_CONNECT
  * next state: OSH_FSM_STATE_IDLE, wait for request
 */
-static esp_err_t osh_node_wifi_init_connect(void *config, void *arg) {
+esp_err_t osh_node_wifi_init_connect(void *config, void *arg) {
+    // address carried by the event
+    size_t len = 0;
+    const esp_netif_ip_info_t *ip_info = osh_node_fsm_event_payload(&len);
+    if (sizeof(esp_netif_ip_info_t) == len) {
+        ESP_LOGI(WIFI_TAG, "node up at " IPSTR, IP2STR(&ip_info->ip));
+    }
+
     // start coap proto
     osh_node_proto_start(arg);
 
-    // change state to OSH_FSM_STATE_IDLE
-    osh_node_fsm_set_state(OSH_FSM_STATE_IDLE);
+    // start power save policy, awake until quiet
+    osh_node_power_start();
 
     // session for ping
     esp_ping_config_t ping_config = ESP_PING_DEFAULT_CONFIG();
@@ -403,25 +423,26 @@ static esp_err_t osh_node_wifi_init_connect(void *config, void *arg) {
     esp_ping_new_session(&ping_config, &cbs, &g_node_wifi.ping);
 
     // start ping timer
-    xTimerStart(g_node_wifi.ping_timer, 0);
+    osh_node_timer_arm(&g_node_wifi.ping_timer, CONFIG_NODE_WIFI_CHECK_PERIOD * 1000,
+                        CONFIG_NODE_WIFI_CHECK_PERIOD * 1000);
 
     return ESP_OK;
 }
 
 /**
- * state: OSH_FSM_STATE_IDLE
+ * state: OSH_FSM_STATE_IDLE, OSH_FSM_STATE_SAVING
  * event: OSH_NODE_EVENT_DISCONNECT
  * next state: OSH_FSM_STATE_INIT, wait for connect
 */
-static esp_err_t osh_node_wifi_on_disconnect(void *config, void *arg) {
+esp_err_t osh_node_wifi_on_disconnect(void *config, void *arg) {
+    // stop power save, radio awake to reconnect
+    osh_node_power_stop();
+
     // stop coap proto
     osh_node_proto_stop();
 
-    // change state to OSH_FSM_STATE_INIT
-    osh_node_fsm_set_state(OSH_FSM_STATE_INIT);
-
     // stop ping timer
-    xTimerStop(g_node_wifi.ping_timer, 0);
+    osh_node_timer_cancel(&g_node_wifi.ping_timer);
 
     // delete ping session
     esp_ping_delete_session(g_node_wifi.ping);
@@ -429,25 +450,6 @@ static esp_err_t osh_node_wifi_on_disconnect(void *config, void *arg) {
     return ESP_OK;
 }
 
-/** -------------------------------
- *            task
- *  -------------------------------
-*/
-static void wifi_task(void * arg) {
-    ESP_LOGI(WIFI_TAG, "WiFi starting...");
-    osh_node_fsm_set_state(OSH_FSM_STATE_INIT);
-    osh_node_fsm_invoke_event(OSH_NODE_EVENT_POWERON);
-    while(1) {
-        // move on the FSM
-        if (ESP_OK != osh_node_fsm_loop_step(arg)) break;
-    }
-    // fsm failed, restart
-    // esp_restart();
-
-    vTaskDelete(NULL);
-}
-
-
 /** -------------------------------
  *            functions
  *  -------------------------------
@@ -458,23 +460,16 @@ esp_err_t osh_node_wifi_init(osh_node_bb_t *node_bb, void *conf_arg) {
     memset(&g_node_wifi, 0, sizeof(osh_node_network));
     g_node_wifi.node_bb = node_bb;
 
-    /* Init FSM */
-    ESP_ERROR_CHECK(osh_node_fsm_init(node_bb, conf_arg));
-
-    /* register event callback to FSM */
-    ESP_ERROR_CHECK(osh_node_fsm_register_event(
-                        OSH_FSM_STATE_INIT, OSH_NODE_EVENT_POWERON,
-                        osh_node_wifi_init_poweron, NULL));
-    ESP_ERROR_CHECK(osh_node_fsm_register_event(
-                        OSH_FSM_STATE_INIT, OSH_NODE_EVENT_CONNECT,
-                        osh_node_wifi_init_connect, NULL));
-    ESP_ERROR_CHECK(osh_node_fsm_register_event(
-                        OSH_FSM_STATE_IDLE, OSH_NODE_EVENT_DISCONNECT,
-                        osh_node_wifi_on_disconnect, NULL));
+    /* Init FSM from table of tools/node_state.py, run by the FSM task */
+    ESP_ERROR_CHECK(osh_node_fsm_create_from_table("net", &g_osh_node_fsm_table, 0,
+                        &node_bb->net_fsm));
 
     /* Init Proto */
     ESP_ERROR_CHECK(osh_node_proto_init(node_bb, conf_arg));
 
+    /* Init power save, T_IDLE, T_SAVE and T_WAKEUP of the FSM */
+    ESP_ERROR_CHECK(osh_node_power_init(node_bb));
+
     /* Initialize TCP/IP */
     ESP_ERROR_CHECK(esp_netif_init());
 
@@ -495,15 +490,8 @@ esp_err_t osh_node_wifi_init(osh_node_bb_t *node_bb, void *conf_arg) {
 
     g_node_wifi.conf_arg = conf_arg;
 
-    // ping timer
-    g_node_wifi.ping_timer = xTimerCreate("ping_timer",
-                                    pdMS_TO_TICKS(CONFIG_NODE_WIFI_CHECK_PERIOD * 1000),
-                                    pdTRUE, NULL,
-                                    ping_timeout_cb);
-    if (g_node_wifi.ping_timer == NULL) {
-        ESP_LOGE(WIFI_TAG, "Failed to create ping timer");
-        return OSH_ERR_NET_INNER;
-    }
+    // ping timer, on timer wheel
+    osh_node_timer_setup(&g_node_wifi.ping_timer, ping_timeout_cb, NULL);
 
     ESP_LOGI(WIFI_TAG, "WiFi init");
     return ESP_OK;
@@ -511,8 +499,9 @@ esp_err_t osh_node_wifi_init(osh_node_bb_t *node_bb, void *conf_arg) {
 
 /* start WiFi */
 esp_err_t osh_node_wifi_start(void *run_arg) {
-    xTaskCreate(wifi_task, "wifi", 4096, run_arg, 2, NULL);
-    return ESP_OK;
+    ESP_LOGI(WIFI_TAG, "WiFi starting...");
+    osh_node_fsm_invoke_event(g_node_wifi.node_bb->net_fsm, OSH_NODE_EVENT_POWERON);
+    return osh_node_fsm_start(g_node_wifi.node_bb->net_fsm, OSH_FSM_STATE_INIT, run_arg);
 }
 
 /* reset WiFi */
@@ -0,0 +1,133 @@
+/*
+ * @Author      : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @Date        : 2024-06-20 20:43:02
+ * @LastEditors : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+ * @LastEditTime: 2024-06-20 22:36:47
+ * @FilePath    : /OpenSmartHome/components/osh_node/src/osh_node_worker.c
+ * @Description : low-priority worker running routes demoted for slowness
+ * Copyright (c) 2024 by Zheng, Yang, All Rights Reserved.
+ */
+
+#include <string.h>
+
+#include "osh_node_proto.h"
+#include "osh_node_proto.inc"
+#include "osh_node_worker.inc"
+
+static const char *WORKER_TAG = "WORKER";
+
+static osh_node_worker_t g_worker;
+
+/* run one job and resolve its flight */
+static void worker_run(osh_node_worker_job_t *job) {
+    osh_node_proto_pdu_t *req = &job->request;
+    osh_node_proto_pdu_t *rsp = &g_worker.response;
+
+    // pointers of the copy refer to the job itself
+    req->session = &job->session;
+    req->octets = req->oct_rd = job->content;
+    req->octets_size = sizeof(job->content);
+    req->oct_wr = &job->content[req->con_len];
+    job->session.arena = &g_worker.arena;
+    g_worker.arena.used = 0;
+
+    memset(rsp, 0, sizeof(osh_node_proto_pdu_t));
+    rsp->type = OSH_PDU_BUTT;
+    rsp->session = &job->session;
+    rsp->octets = rsp->oct_rd = rsp->oct_wr = g_worker.buff;
+    rsp->octets_size = CONFIG_NODE_PROTO_BUFF_SIZE;
+
+    esp_err_t res = job->handler(req->entry, g_worker.node_bb, &job->session, req, rsp);
+    if (OSH_ERR_PROTO_DEFERRED == res) return;  // handler resolves it
+    if (ESP_OK != res && OSH_CC_CLIENT_ERR != rsp->code_class &&
+        OSH_CC_SERVER_ERR != rsp->code_class) {
+        // failed without telling why
+        rsp->code_class = OSH_CC_SERVER_ERR;
+        rsp->code_code = OSH_SERR_INTERNAL_ERR;
+        rsp->con_type = OSH_CONTENT_OCTETS;
+        rsp->con_len = 0;
+        rsp->data = NULL;
+    }
+    if (ESP_OK != osh_node_proto_resolve(job->flight, rsp->code_class, rsp->code_code,
+                        rsp->con_type, rsp->data, rsp->con_len)) {
+        ESP_LOGW(WORKER_TAG, "flight 0x%lx of 0x%lx already answered", job->flight, req->entry);
+    }
+}
+
+static void worker_task(void *arg) {
+    while (1) {
+        if (pdTRUE != xQueueReceive(g_worker.queue, &g_worker.job, portMAX_DELAY)) continue;
+        worker_run(&g_worker.job);
+    }
+    vTaskDelete(NULL);
+}
+
+/** -------------------------------
+ *            functions
+ *  -------------------------------
+*/
+
+/* start worker */
+esp_err_t osh_worker_init(osh_node_bb_t *node_bb) {
+    if (NULL != g_worker.task) return ESP_OK;
+
+    g_worker.node_bb = node_bb;
+    g_worker.buff = malloc(CONFIG_NODE_PROTO_BUFF_SIZE);
+    g_worker.arena.size = CONFIG_NODE_PROTO_ARENA_SIZE;
+    g_worker.arena.base = malloc(CONFIG_NODE_PROTO_ARENA_SIZE);
+    g_worker.queue = xQueueCreate(CONFIG_NODE_PROTO_WORKER_QUEUE_LEN,
+                        sizeof(osh_node_worker_job_t));
+    if (NULL == g_worker.buff || NULL == g_worker.arena.base || NULL == g_worker.queue) {
+        ESP_LOGE(WORKER_TAG, "failed to malloc mem for worker");
+        osh_worker_fini();
+        return ESP_ERR_NO_MEM;
+    }
+    if (pdPASS != xTaskCreate(worker_task, "proto_worker", CONFIG_NODE_PROTO_WORKER_STACK,
+                        NULL, CONFIG_NODE_PROTO_WORKER_PRIORITY, &g_worker.task)) {
+        ESP_LOGE(WORKER_TAG, "failed to create worker task");
+        g_worker.task = NULL;
+        osh_worker_fini();
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+/* stop worker */
+void osh_worker_fini(void) {
+    if (NULL != g_worker.task) {
+        vTaskDelete(g_worker.task);
+        g_worker.task = NULL;
+    }
+    if (NULL != g_worker.queue) {
+        vQueueDelete(g_worker.queue);
+        g_worker.queue = NULL;
+    }
+    free(g_worker.buff);
+    g_worker.buff = NULL;
+    free(g_worker.arena.base);
+    g_worker.arena.base = NULL;
+    g_worker.arena.size = 0;
+}
+
+/* queue request to worker, called by the proto task only */
+esp_err_t osh_worker_submit(osh_node_proto_handler_t handler,
+                        const osh_node_proto_pdu_t *request) {
+    if (NULL == handler || NULL == request || NULL == request->session) return ESP_ERR_INVALID_ARG;
+    if (NULL == g_worker.queue) return ESP_ERR_INVALID_STATE;
+    if (request->con_len > sizeof(g_worker.submit.content)) return ESP_ERR_INVALID_SIZE;
+    // the only sender, room now means room after defer
+    if (0 == uxQueueSpacesAvailable(g_worker.queue)) return ESP_ERR_NO_MEM;
+
+    osh_node_proto_flight_t flight = osh_node_proto_defer(request);
+    if (0 == flight) return ESP_ERR_NO_MEM;
+
+    osh_node_worker_job_t *job = &g_worker.submit;
+    job->handler = handler;
+    job->flight = flight;
+    job->request = *request;
+    job->session = *request->session;
+    memcpy(job->content, request->oct_rd, request->con_len);
+    xQueueSend(g_worker.queue, job, 0);
+    ESP_LOGD(WORKER_TAG, "0x%lx queued to worker. [0x%x]", request->entry, request->mid);
+    return ESP_OK;
+}
@@ -5,6 +5,7 @@
 #include "osh_node_status.h"
 #include "osh_node_wifi.h"
 #include "osh_node_proto.h"
+#include "app_entries.h"
 
 static osh_node_module_t modules[] = {
     //  name    init_cb      conf_arg      start_cb       run_arg
@@ -37,6 +38,71 @@ static esp_err_t test_entry(uint32_t entry,
     return ESP_OK;
 }
 
+/* relay board, typed handlers of entries.json */
+#define RELAY_CHANNELS  64
+
+static app_entries_relay_state_t relays[RELAY_CHANNELS];
+
+esp_err_t app_entries_info_get(uint32_t entry, uint32_t sub_index,
+            osh_node_bb_t *node_bb, app_entries_info_t *response) {
+    strlcpy(response->model, "relay-64", sizeof(response->model));
+    response->channels = RELAY_CHANNELS;
+    response->uptime = (uint32_t)(xTaskGetTickCount() / configTICK_RATE_HZ);
+    return ESP_OK;
+}
+
+esp_err_t app_entries_relay_get(uint32_t entry, uint32_t sub_index,
+            osh_node_bb_t *node_bb, app_entries_relay_state_t *response) {
+    *response = relays[sub_index];
+    return ESP_OK;
+}
+
+esp_err_t app_entries_relay_put(uint32_t entry, uint32_t sub_index,
+            osh_node_bb_t *node_bb, const app_entries_relay_state_t *request) {
+    relays[sub_index] = *request;
+    ESP_LOGI(APP_TAG, "relay %ld %s level %d", sub_index,
+            request->on ? "on" : "off", request->level);
+    return ESP_OK;
+}
+
+/* several relays switched as one scene, undone if any fails */
+#define RELAY_ENTRY     0x1000
+
+static app_entries_relay_state_t relays_undo[RELAY_CHANNELS];
+static bool relays_staged = false;
+
+static esp_err_t relay_txn_validate(uint32_t entry, uint32_t sub_index,
+            osh_node_bb_t *node_bb, const uint8_t *data, size_t len) {
+    app_entries_relay_state_t state;
+    return app_entries_relay_state_decode(data, len, &state);
+}
+
+static esp_err_t relay_txn_apply(uint32_t entry, uint32_t sub_index,
+            osh_node_bb_t *node_bb, const uint8_t *data, size_t len) {
+    if (!relays_staged) {
+        memcpy(relays_undo, relays, sizeof(relays));
+        relays_staged = true;
+    }
+    return app_entries_relay_state_decode(data, len, &relays[sub_index]);
+}
+
+static void relay_txn_abort(uint32_t entry, uint32_t sub_index, osh_node_bb_t *node_bb) {
+    memcpy(relays, relays_undo, sizeof(relays));
+    relays_staged = false;
+}
+
+static esp_err_t relay_txn_commit(osh_node_bb_t *node_bb, void *arg) {
+    relays_staged = false;
+    ESP_LOGI(APP_TAG, "relay scene applied");
+    return ESP_OK;
+}
+
+static const osh_node_route_txn_t relay_txn = {
+    .validate = relay_txn_validate,
+    .apply = relay_txn_apply,
+    .abort = relay_txn_abort,
+};
+
 /* Hello World Example */
 void app_main(void)
 {
@@ -49,6 +115,9 @@ void app_main(void)
 
     /* register route */
     ESP_ERROR_CHECK(osh_node_route_register(TEST_ENTRY, OSH_METHOD_GET, test_entry));
+    ESP_ERROR_CHECK(app_entries_register());
+    ESP_ERROR_CHECK(osh_node_route_set_txn(RELAY_ENTRY, &relay_txn));
+    ESP_ERROR_CHECK(osh_node_proto_set_commit(relay_txn_commit, NULL));
 
     /* start modules */
     ESP_ERROR_CHECK(osh_node_modules_start());
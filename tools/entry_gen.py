@@ -0,0 +1,398 @@
+#-*-coding:UTF-8-*-
+
+
+'''
+* @Author      : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+* @Date        : 2024-06-16 10:12:27
+* @LastEditors : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+* @LastEditTime: 2024-06-16 18:40:05
+* @FilePath    : /OpenSmartHome/tools/entry_gen.py
+* @Description : generate typed entry codecs and route table from JSON schema
+* @Copyright (c) 2024 by Zheng, Yang, All Rights Reserved.
+'''
+
+import argparse
+import json
+import os
+import re
+import sys
+
+# scalar types: C type, wire size
+SCALARS = {
+    "bool": ("bool", 1),
+    "u8":   ("uint8_t", 1),
+    "i8":   ("int8_t", 1),
+    "u16":  ("uint16_t", 2),
+    "i16":  ("int16_t", 2),
+    "u32":  ("uint32_t", 4),
+    "i32":  ("int32_t", 4),
+    "f32":  ("float", 4),
+}
+
+# methods and the success code of a typed response
+METHODS = {
+    "GET":    ("OSH_METHOD_GET", "OSH_SUCCESS_CONTENT"),
+    "POST":   ("OSH_METHOD_POST", "OSH_SUCCESS_CREATED"),
+    "PUT":    ("OSH_METHOD_PUT", "OSH_SUCCESS_CHANGED"),
+    "DELETE": ("OSH_METHOD_DELETE", "OSH_SUCCESS_DELETED"),
+    "FETCH":  ("OSH_METHOD_FETCH", "OSH_SUCCESS_CONTENT"),
+    "PATCH":  ("OSH_METHOD_PATCH", "OSH_SUCCESS_CHANGED"),
+    "IPATCH": ("OSH_METHOD_IPATCH", "OSH_SUCCESS_CHANGED"),
+}
+
+IDENT = re.compile(r"^[a-z][a-z0-9_]*$")
+
+
+class SchemaError(Exception):
+    pass
+
+
+def check_ident(name, what):
+    if not isinstance(name, str) or not IDENT.match(name):
+        raise SchemaError("invalid %s name %r" % (what, name))
+
+
+def parse_u32(value, what):
+    try:
+        v = int(value, 0) if isinstance(value, str) else int(value)
+    except (TypeError, ValueError):
+        raise SchemaError("invalid %s %r" % (what, value))
+    if v < 0 or v > 0xFFFFFFFF:
+        raise SchemaError("%s 0x%x out of 32 bits" % (what, v))
+    return v
+
+
+def field_size(field):
+    if field["type"] in SCALARS:
+        return SCALARS[field["type"]][1]
+    return 1 + field["max"]
+
+
+def load_schema(path):
+    with open(path, "r", encoding="utf-8") as f:
+        schema = json.load(f)
+
+    prefix = schema.get("prefix", "app_entries")
+    check_ident(prefix, "prefix")
+
+    types = schema.get("types", {})
+    for tname, fields in types.items():
+        check_ident(tname, "type")
+        if not isinstance(fields, list) or not fields:
+            raise SchemaError("type %s has no field" % tname)
+        seen = set()
+        for field in fields:
+            check_ident(field.get("name"), "field")
+            if field["name"] in seen:
+                raise SchemaError("duplicated field %s.%s" % (tname, field["name"]))
+            seen.add(field["name"])
+            ftype = field.get("type")
+            if ftype in ("str", "bytes"):
+                fmax = field.get("max")
+                if not isinstance(fmax, int) or fmax < 1 or fmax > 255:
+                    raise SchemaError("%s.%s needs max in 1..255" % (tname, field["name"]))
+            elif ftype not in SCALARS:
+                raise SchemaError("%s.%s has unknown type %r" % (tname, field["name"], ftype))
+
+    entries = schema.get("entries", [])
+    names = set()
+    for entry in entries:
+        check_ident(entry.get("name"), "entry")
+        if entry["name"] in names:
+            raise SchemaError("duplicated entry %s" % entry["name"])
+        names.add(entry["name"])
+        entry["entry"] = parse_u32(entry.get("entry"), "entry")
+        entry["mask"] = parse_u32(entry.get("mask", "0xFFFFFFFF"), "mask")
+        host = ~entry["mask"] & 0xFFFFFFFF
+        if host & (host + 1):
+            raise SchemaError("entry %s mask not contiguous" % entry["name"])
+        if entry["entry"] & host:
+            raise SchemaError("entry %s has bits out of mask" % entry["name"])
+        methods = entry.get("methods", {})
+        if not methods:
+            raise SchemaError("entry %s has no method" % entry["name"])
+        for method, io in methods.items():
+            if method not in METHODS:
+                raise SchemaError("entry %s has unknown method %s" % (entry["name"], method))
+            for key in ("request", "response"):
+                if key in io and io[key] not in types:
+                    raise SchemaError("entry %s %s %s type %r undefined"
+                                      % (entry["name"], method, key, io[key]))
+    return prefix, types, entries
+
+
+def gen_header(prefix, types, entries, guard):
+    up = prefix.upper()
+    out = []
+    out.append("/* generated by tools/entry_gen.py, do not edit */")
+    out.append("#ifndef %s" % guard)
+    out.append("#define %s" % guard)
+    out.append("")
+    out.append("#ifdef __cplusplus")
+    out.append('extern "C" {')
+    out.append("#endif")
+    out.append("")
+    out.append('#include "osh_node_proto.h"')
+    out.append("")
+
+    for tname, fields in types.items():
+        out.append("typedef struct {")
+        for field in fields:
+            ftype = field["type"]
+            if ftype in SCALARS:
+                out.append("    %s %s;" % (SCALARS[ftype][0], field["name"]))
+            elif ftype == "str":
+                out.append("    char %s[%d];" % (field["name"], field["max"] + 1))
+            else:
+                out.append("    uint8_t %s[%d];" % (field["name"], field["max"]))
+                out.append("    uint8_t %s_len;" % field["name"])
+        out.append("} %s_%s_t;" % (prefix, tname))
+        out.append("")
+        out.append("#define %s_%s_MAX_LEN %d" % (up, tname.upper(), sum(field_size(f) for f in fields)))
+        out.append("")
+        out.append("/* decode %s, ESP_ERR_INVALID_SIZE if length not match */" % tname)
+        out.append("esp_err_t %s_%s_decode(const uint8_t *buff, size_t len, %s_%s_t *val);"
+                   % (prefix, tname, prefix, tname))
+        out.append("")
+        out.append("/* encode %s into buff of %s_%s_MAX_LEN, return length */" % (tname, up, tname.upper()))
+        out.append("size_t %s_%s_encode(const %s_%s_t *val, uint8_t *buff);"
+                   % (prefix, tname, prefix, tname))
+        out.append("")
+
+    out.append("/* typed handlers, implemented by application */")
+    for entry in entries:
+        for method, io in entry["methods"].items():
+            args = ["uint32_t entry", "uint32_t sub_index", "osh_node_bb_t *node_bb"]
+            if "request" in io:
+                args.append("const %s_%s_t *request" % (prefix, io["request"]))
+            if "response" in io:
+                args.append("%s_%s_t *response" % (prefix, io["response"]))
+            out.append("esp_err_t %s_%s_%s(%s);"
+                       % (prefix, entry["name"], method.lower(), ", ".join(args)))
+    out.append("")
+
+    nroutes = sum(len(e["methods"]) for e in entries)
+    out.append("#define %s_ROUTE_NUM %d" % (up, nroutes))
+    out.append("")
+    out.append("extern const osh_node_route_def_t %s_routes[%s_ROUTE_NUM];" % (prefix, up))
+    out.append("")
+    out.append("/* register all routes of schema */")
+    out.append("#define %s_register() \\" % prefix)
+    out.append("    osh_node_route_register_table(%s_routes, %s_ROUTE_NUM)" % (prefix, up))
+    out.append("")
+    out.append("#ifdef __cplusplus")
+    out.append("}")
+    out.append("#endif")
+    out.append("")
+    out.append("#endif /* %s */" % guard)
+    return "\n".join(out) + "\n"
+
+
+def gen_decode(prefix, tname, fields):
+    out = []
+    fixed = all(f["type"] in SCALARS for f in fields)
+    out.append("esp_err_t %s_%s_decode(const uint8_t *buff, size_t len, %s_%s_t *val) {"
+               % (prefix, tname, prefix, tname))
+    if fixed:
+        size = sum(field_size(f) for f in fields)
+        out.append("    if (%d != len) return ESP_ERR_INVALID_SIZE;" % size)
+    out.append("    size_t off = 0;")
+    for field in fields:
+        name, ftype = field["name"], field["type"]
+        if ftype in SCALARS:
+            ctype, size = SCALARS[ftype]
+            if not fixed:
+                out.append("    if (off + %d > len) return ESP_ERR_INVALID_SIZE;" % size)
+            if ftype == "bool":
+                out.append("    if (1 < buff[off]) return ESP_ERR_INVALID_ARG;")
+                out.append("    val->%s = (0 != buff[off]);" % name)
+            elif size == 1:
+                out.append("    val->%s = (%s)buff[off];" % (name, ctype))
+            elif size == 2:
+                out.append("    val->%s = (%s)((buff[off] << 8) | buff[off + 1]);" % (name, ctype))
+            else:
+                out.append("    uint32_t %s_raw = ((uint32_t)buff[off] << 24) | ((uint32_t)buff[off + 1] << 16) |"
+                           % name)
+                out.append("            ((uint32_t)buff[off + 2] << 8) | buff[off + 3];")
+                if ftype == "f32":
+                    out.append("    memcpy(&val->%s, &%s_raw, sizeof(float));" % (name, name))
+                else:
+                    out.append("    val->%s = (%s)%s_raw;" % (name, ctype, name))
+            out.append("    off += %d;" % size)
+        else:
+            out.append("    if (off + 1 > len || %d < buff[off] || off + 1 + buff[off] > len)"
+                       % field["max"])
+            out.append("        return ESP_ERR_INVALID_SIZE;")
+            out.append("    memcpy(val->%s, &buff[off + 1], buff[off]);" % name)
+            if ftype == "str":
+                out.append("    val->%s[buff[off]] = '\\0';" % name)
+            else:
+                out.append("    val->%s_len = buff[off];" % name)
+            out.append("    off += 1 + buff[off];")
+    out.append("    return (off == len) ? ESP_OK : ESP_ERR_INVALID_SIZE;")
+    out.append("}")
+    return out
+
+
+def gen_encode(prefix, tname, fields):
+    out = []
+    out.append("size_t %s_%s_encode(const %s_%s_t *val, uint8_t *buff) {"
+               % (prefix, tname, prefix, tname))
+    out.append("    size_t off = 0;")
+    for field in fields:
+        name, ftype = field["name"], field["type"]
+        if ftype in SCALARS:
+            size = SCALARS[ftype][1]
+            if ftype == "bool":
+                out.append("    buff[off] = val->%s ? 1 : 0;" % name)
+            elif size == 1:
+                out.append("    buff[off] = (uint8_t)val->%s;" % name)
+            elif size == 2:
+                out.append("    buff[off] = (uint8_t)((uint16_t)val->%s >> 8);" % name)
+                out.append("    buff[off + 1] = (uint8_t)val->%s;" % name)
+            else:
+                if ftype == "f32":
+                    out.append("    uint32_t %s_raw;" % name)
+                    out.append("    memcpy(&%s_raw, &val->%s, sizeof(float));" % (name, name))
+                else:
+                    out.append("    uint32_t %s_raw = (uint32_t)val->%s;" % (name, name))
+                for i in range(4):
+                    out.append("    buff[off + %d] = (uint8_t)(%s_raw >> %d);" % (i, name, 24 - 8 * i))
+            out.append("    off += %d;" % size)
+        else:
+            if ftype == "str":
+                out.append("    size_t %s_len = strnlen(val->%s, %d);" % (name, name, field["max"]))
+            else:
+                out.append("    size_t %s_len = (%d < val->%s_len) ? %d : val->%s_len;"
+                           % (name, field["max"], name, field["max"], name))
+            out.append("    buff[off] = (uint8_t)%s_len;" % name)
+            out.append("    memcpy(&buff[off + 1], val->%s, %s_len);" % (name, name))
+            out.append("    off += 1 + %s_len;" % name)
+    out.append("    return off;")
+    out.append("}")
+    return out
+
+
+def gen_stub(prefix, entry, method, io):
+    up = prefix.upper()
+    fn = "%s_%s_%s" % (prefix, entry["name"], method.lower())
+    out = []
+    out.append("static esp_err_t %s_stub(uint32_t entry," % fn)
+    out.append("            osh_node_bb_t *node_bb,")
+    out.append("            osh_node_proto_session_t *session,")
+    out.append("            const osh_node_proto_pdu_t *request,")
+    out.append("            osh_node_proto_pdu_t *response) {")
+    args = ["entry", "request->sub_index", "node_bb"]
+    if "request" in io:
+        rq = io["request"]
+        out.append("    %s_%s_t req;" % (prefix, rq))
+        out.append("    if (OSH_CONTENT_OCTETS != request->con_type) {")
+        out.append("        proto_response_err_head(request, response,")
+        out.append("                OSH_CC_CLIENT_ERR, OSH_CERR_UNSUPPORTED_FORMAT);")
+        out.append("        return OSH_ERR_PROTO_PDU_FMT;")
+        out.append("    }")
+        out.append("    if (ESP_OK != %s_%s_decode(request->oct_rd, request->con_len, &req)) {"
+                   % (prefix, rq))
+        out.append("        proto_response_err_head(request, response,")
+        out.append("                OSH_CC_CLIENT_ERR, OSH_CERR_BAD_REQUEST);")
+        out.append("        return OSH_ERR_PROTO_PDU_FMT;")
+        out.append("    }")
+        args.append("&req")
+    if "response" in io:
+        rs = io["response"]
+        out.append("    %s_%s_t rsp;" % (prefix, rs))
+        out.append("    memset(&rsp, 0, sizeof(rsp));")
+        args.append("&rsp")
+    out.append("    esp_err_t res = %s(%s);" % (fn, ", ".join(args)))
+    out.append("    if (ESP_OK != res) {")
+    out.append("        proto_response_err_head(request, response,")
+    out.append("                OSH_CC_SERVER_ERR, OSH_SERR_INTERNAL_ERR);")
+    out.append("        return res;")
+    out.append("    }")
+    out.append("    proto_response_ack_head(request, response, OSH_CC_SUCCESS, %s);"
+               % METHODS[method][1])
+    out.append("    response->con_type = OSH_CONTENT_OCTETS;")
+    if "response" in io:
+        rs = io["response"]
+        out.append("    uint8_t *buff = osh_node_proto_response_reserve(response, %s_%s_MAX_LEN);"
+                   % (up, rs.upper()))
+        out.append("    if (NULL == buff) {")
+        out.append("        proto_response_err_head(request, response,")
+        out.append("                OSH_CC_SERVER_ERR, OSH_SERR_INTERNAL_ERR);")
+        out.append("        return ESP_ERR_NO_MEM;")
+        out.append("    }")
+        out.append("    return osh_node_proto_response_commit(response, %s_%s_encode(&rsp, buff));"
+                   % (prefix, rs))
+    else:
+        out.append("    response->con_len = 0;")
+        out.append("    return ESP_OK;")
+    out.append("}")
+    return out
+
+
+def gen_source(prefix, types, entries, header):
+    up = prefix.upper()
+    out = []
+    out.append("/* generated by tools/entry_gen.py, do not edit */")
+    out.append("#include <string.h>")
+    out.append("")
+    out.append('#include "%s"' % header)
+    out.append("")
+    for tname, fields in types.items():
+        out.extend(gen_decode(prefix, tname, fields))
+        out.append("")
+        out.extend(gen_encode(prefix, tname, fields))
+        out.append("")
+    for entry in entries:
+        for method, io in entry["methods"].items():
+            out.extend(gen_stub(prefix, entry, method, io))
+            out.append("")
+    out.append("const osh_node_route_def_t %s_routes[%s_ROUTE_NUM] = {" % (prefix, up))
+    for entry in entries:
+        for method in entry["methods"]:
+            out.append("    {0x%08XUL, 0x%08XUL, %s, %s_%s_%s_stub},"
+                       % (entry["entry"], entry["mask"], METHODS[method][0],
+                          prefix, entry["name"], method.lower()))
+    out.append("};")
+    return "\n".join(out) + "\n"
+
+
+def write_if_changed(path, text):
+    # keep timestamp so dependents are not rebuilt
+    if os.path.exists(path):
+        with open(path, "r", encoding="utf-8") as f:
+            if f.read() == text:
+                return
+    with open(path, "w", encoding="utf-8") as f:
+        f.write(text)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="generate typed entries from schema")
+    parser.add_argument("schema", help="JSON schema of entries")
+    parser.add_argument("-o", "--outdir", default=".", help="output directory")
+    parser.add_argument("--stamp", help="file touched on each run, the build output")
+    args = parser.parse_args()
+
+    try:
+        prefix, types, entries = load_schema(args.schema)
+    except (OSError, ValueError, SchemaError) as e:
+        print("%s: %s" % (args.schema, e), file=sys.stderr)
+        return 1
+
+    header = prefix + ".h"
+    guard = prefix.upper() + "_H"
+    os.makedirs(args.outdir, exist_ok=True)
+    write_if_changed(os.path.join(args.outdir, header),
+                     gen_header(prefix, types, entries, guard))
+    write_if_changed(os.path.join(args.outdir, prefix + ".c"),
+                     gen_source(prefix, types, entries, header))
+    if args.stamp:
+        # outputs keep their time when unchanged, stamp tells the run is done
+        with open(args.stamp, "w", encoding="utf-8"):
+            pass
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
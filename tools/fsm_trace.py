@@ -0,0 +1,128 @@
+#-*-coding:UTF-8-*-
+
+
+'''
+* @Author      : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+* @Date        : 2024-06-28 20:36:12
+* @LastEditors : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+* @LastEditTime: 2024-06-28 22:10:47
+* @FilePath    : /OpenSmartHome/tools/fsm_trace.py
+* @Description : decode FSM trace dumped by GET on MDM entry 0xC0000003
+* @Copyright (c) 2024 by Zheng, Yang, All Rights Reserved.
+'''
+
+import argparse
+import os
+import struct
+import subprocess
+import sys
+
+from node_state import COMPONENT, parse_defines, parse_enum
+
+# layout of osh_node_fsm.h
+TRACE_VER = 1
+HEAD = struct.Struct(">BBHIIHH")
+RECORD = struct.Struct(">IIIiBBBB")
+
+
+class TraceError(Exception):
+    pass
+
+
+def load_names():
+    # IDs to names, prefixes dropped
+    events = parse_defines(os.path.join(COMPONENT, "include", "osh_node_events.h"),
+                           "OSH_NODE_EVENT_")
+    events.pop("OSH_NODE_EVENT_NUM", None)
+    states = parse_enum(os.path.join(COMPONENT, "include", "osh_node_fsm.h"), "OSH_FSM_STATE_")
+    return ({v: k[len("OSH_NODE_EVENT_"):] for k, v in events.items()},
+            {v: k[len("OSH_FSM_STATE_"):] for k, v in states.items()})
+
+
+def load_symbols(elf, nm):
+    # function addresses of firmware, for callbacks
+    try:
+        out = subprocess.run([nm, "--defined-only", elf], check=True,
+                             capture_output=True, text=True).stdout
+    except (OSError, subprocess.CalledProcessError) as e:
+        raise TraceError("failed to read symbols of %s: %s" % (elf, e))
+    symbols = {}
+    for line in out.splitlines():
+        parts = line.split()
+        if 3 == len(parts) and parts[1] in ("T", "t"):
+            symbols[int(parts[0], 16)] = parts[2]
+    return symbols
+
+
+def parse_dump(data):
+    # one or more dumps back to back, records by sequence, cost in us
+    records = {}
+    pos = 0
+    while pos < len(data):
+        if len(data) - pos < HEAD.size:
+            raise TraceError("truncated header at %d" % pos)
+        ver, rec_len, num, first, _, _, _ = HEAD.unpack_from(data, pos)
+        if TRACE_VER != ver or RECORD.size != rec_len:
+            raise TraceError("unknown dump version %d record %d at %d" % (ver, rec_len, pos))
+        pos += HEAD.size
+        if len(data) - pos < num * rec_len:
+            raise TraceError("truncated records at %d" % pos)
+        for i in range(num):
+            records[first + i] = RECORD.unpack_from(data, pos + i * rec_len)
+        pos += num * rec_len
+    return records
+
+
+def render(records, events, states, symbols, fsm_names):
+    print("%8s %12s %9s  %-6s %-10s %-14s %-34s %9s %7s  %s" %
+          ("seq", "time ms", "+ms", "fsm", "state", "event", "callback", "us", "result", "next"))
+    last = None
+    gap = None
+    for seq in sorted(records):
+        time, us, callback, result, fsm, state, event, nxt = records[seq]
+        if gap is not None and seq != gap + 1:
+            print("%8s ... %d records lost" % ("", seq - gap - 1))
+        gap = seq
+        delta = "" if last is None else "%+.3f" % (((time - last) & 0xFFFFFFFF) / 1000.0)
+        last = time
+        if 0 == callback:
+            cb = "-"
+        else:
+            cb = symbols.get(callback, "0x%08x" % callback)
+        moved = "" if nxt == state else ("-> %s" % states.get(nxt, str(nxt)))
+        print("%8d %12.3f %9s  %-6s %-10s %-14s %-34s %9.1f %7s  %s" %
+              (seq, time / 1000.0, delta, fsm_names.get(fsm, str(fsm)),
+               states.get(state, str(state)), events.get(event, str(event)),
+               cb, us, "ok" if 0 == result else "0x%x" % (result & 0xFFFFFFFF), moved))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="decode FSM trace dump to a timeline")
+    parser.add_argument("dump", nargs="+", help="payloads of GET 0xC0000003, in order")
+    parser.add_argument("--elf", help="firmware ELF to name callbacks")
+    parser.add_argument("--nm", default="xtensa-esp32-elf-nm", help="nm of toolchain")
+    parser.add_argument("--fsm", action="append", default=[], metavar="ID=NAME",
+                        help="name of FSM id, logged at creation, 0=net by default")
+    args = parser.parse_args()
+
+    try:
+        fsm_names = {0: "net"}
+        for item in args.fsm:
+            fid, _, name = item.partition("=")
+            fsm_names[int(fid, 0)] = name
+        events, states = load_names()
+        symbols = load_symbols(args.elf, args.nm) if args.elf else {}
+        records = {}
+        for path in args.dump:
+            with open(path, "rb") as f:
+                records.update(parse_dump(f.read()))
+    except (OSError, ValueError, TraceError) as e:
+        print("fsm_trace: %s" % e, file=sys.stderr)
+        return 1
+
+    render(records, events, states, symbols, fsm_names)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
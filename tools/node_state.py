@@ -5,40 +5,274 @@
 * @Author      : kevin.z.y <kevin.cn.zhengyang@gmail.com>
 * @Date        : 2024-05-01 10:38:43
 * @LastEditors : kevin.z.y <kevin.cn.zhengyang@gmail.com>
-* @LastEditTime: 2024-05-09 20:28:30
+* @LastEditTime: 2024-06-26 21:14:52
 * @FilePath    : /OpenSmartHome/tools/node_state.py
-* @Description :
+* @Description : graph of node FSM, drawn as SVG and generated as const C table
 * @Copyright (c) 2024 by Zheng, Yang, All Rights Reserved.
 '''
 
+import argparse
+import os
+import re
+import sys
 
-from graphviz import Digraph
+ROOT = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..")
+COMPONENT = os.path.join(ROOT, "components", "osh_node")
 
-# Digraph
-dot = Digraph()
+# Nodes: name, C state
+STATES = [
+    ("init", "OSH_FSM_STATE_INIT"),
+    ("idle", "OSH_FSM_STATE_IDLE"),
+    ("save", "OSH_FSM_STATE_SAVING"),
+    ("upgrade", "OSH_FSM_STATE_UPGRADING"),
+]
 
-# Nodes
-dot.attr('node', shape='doublecircle')
-dot.node("init", "OSH_FSM_STATE_INIT")
-dot.node("idle", "OSH_FSM_STATE_IDLE")
-dot.node("save", "OSH_FSM_STATE_SAVING")
-dot.node("upgrade", "OSH_FSM_STATE_UPGRADING")
+# Edges: from, events, to, handler (None for transition only), label
+TRANSITIONS = [
+    ("init", ["POWERON"], "init", "osh_node_wifi_init_poweron", "power on"),
+    ("init", ["CONNECT"], "idle", "osh_node_wifi_init_connect", "connect"),
 
-# Edges
-dot.edge("init", "init", label="power on")
-dot.edge("init", "idle", label="connect")
+    ("idle", ["DISCONNECT"], "init", "osh_node_wifi_on_disconnect", "disconnect"),
+    ("idle", ["T_SAVE"], "save", "osh_node_power_on_save", "timeout T_SAVE"),
+    ("idle", ["T_IDLE"], "idle", "osh_node_power_on_eval", "timeout T_IDLE"),
+    ("idle", ["REQUEST", "INVOKE"], "idle", None, "request or invoke"),
+    ("idle", ["UPDATE"], "upgrade", None, "update"),
 
-dot.edge("idle", "init", label="disconnect")
-dot.edge("idle", "save", label="timeout T_SAVE")
-dot.edge("idle", "idle", label="request or invoke")
-dot.edge("idle", "upgrade", label="update")
+    ("upgrade", ["DOWNLOAD"], "upgrade", None, "download"),
+    ("upgrade", ["OTA_COMPLETE"], "init", None, "complete"),
+    ("upgrade", ["OTA_ROLLBACK"], "init", None, "rollback"),
 
-dot.edge("upgrade", "upgrade", label="download")
-dot.edge("upgrade", "init", label="complete")
-dot.edge("upgrade", "init", label="rollback")
+    ("save", ["T_WAKEUP"], "idle", "osh_node_power_on_wakeup", "timeout T_WAKEUP"),
+    ("save", ["T_IDLE"], "save", "osh_node_power_on_eval", "timeout T_IDLE"),
+    ("save", ["DISCONNECT"], "init", "osh_node_wifi_on_disconnect", "disconnect"),
+]
 
-dot.edge("save", "idle", label="timeout T_WAKEUP")
+# Urgent events, dispatched before others queued
+URGENT = ["DISCONNECT", "OTA_ROLLBACK", "T_WAKEUP"]
 
-# Render and Save
-dot.render("../components/osh_node/images/node_fsm", format="svg", cleanup=True)
+TABLE = "g_osh_node_fsm_table"
+HEADER = "osh_node_fsm_table.inc"
+SOURCE = "osh_node_fsm_table.c"
 
+
+class GraphError(Exception):
+    pass
+
+
+def parse_defines(path, prefix):
+    # '#define OSH_NODE_EVENT_X   N' lines of header
+    values = {}
+    pattern = re.compile(r"^#define\s+(%s\w+)\s+(\d+)\b" % prefix)
+    with open(path, "r", encoding="utf-8") as f:
+        for line in f:
+            m = pattern.match(line)
+            if m:
+                values[m.group(1)] = int(m.group(2))
+    return values
+
+
+def parse_enum(path, prefix):
+    # 'OSH_FSM_STATE_X = N,' members of enum
+    values = {}
+    pattern = re.compile(r"^\s*(%s\w+)\s*=\s*(\d+)\s*," % prefix)
+    with open(path, "r", encoding="utf-8") as f:
+        for line in f:
+            m = pattern.match(line)
+            if m:
+                values[m.group(1)] = int(m.group(2))
+    return values
+
+
+def load_graph():
+    events = parse_defines(os.path.join(COMPONENT, "include", "osh_node_events.h"),
+                           "OSH_NODE_EVENT_")
+    event_num = events.pop("OSH_NODE_EVENT_NUM", 64)
+    states = parse_enum(os.path.join(COMPONENT, "include", "osh_node_fsm.h"), "OSH_FSM_STATE_")
+
+    names = {}
+    for name, cstate in STATES:
+        if name in names:
+            raise GraphError("duplicated state %s" % name)
+        if cstate not in states:
+            raise GraphError("state %s is not in OSH_FSM_STATES_ENUM" % cstate)
+        names[name] = cstate
+
+    slots = {}
+    for src, evs, dst, handler, _ in TRANSITIONS:
+        for node in (src, dst):
+            if node not in names:
+                raise GraphError("transition of unknown state %s" % node)
+        for ev in evs:
+            cevent = "OSH_NODE_EVENT_" + ev
+            if cevent not in events:
+                raise GraphError("event %s is not in osh_node_events.h" % cevent)
+            if events[cevent] >= event_num:
+                raise GraphError("event %s over OSH_NODE_EVENT_NUM" % cevent)
+            key = (names[src], cevent)
+            if key in slots:
+                raise GraphError("%s handled twice in %s" % (cevent, src))
+            slots[key] = (handler, names[dst])
+
+    urgent = []
+    for ev in URGENT:
+        cevent = "OSH_NODE_EVENT_" + ev
+        if cevent not in events:
+            raise GraphError("urgent event %s is not in osh_node_events.h" % cevent)
+        urgent.append(cevent)
+
+    handled = set(cstate for cstate, _ in slots)
+    for name, cstate in STATES:
+        if cstate not in handled:
+            raise GraphError("state %s has no transition out" % name)
+    return states, events, slots, urgent
+
+
+def gen_header(slots):
+    handlers = sorted(set(h for h, _ in slots.values() if h is not None))
+    out = []
+    out.append("/* generated by tools/node_state.py, do not edit */")
+    out.append("#ifndef OSH_NODE_FSM_TABLE_INC")
+    out.append("#define OSH_NODE_FSM_TABLE_INC")
+    out.append("")
+    out.append("#ifdef __cplusplus")
+    out.append('extern "C" {')
+    out.append("#endif")
+    out.append("")
+    out.append('#include "osh_node_fsm.h"')
+    out.append("")
+    out.append("/* node FSM, const in flash */")
+    out.append("extern const osh_node_fsm_table_t %s;" % TABLE)
+    out.append("")
+    out.append("/* handlers of transitions */")
+    for h in handlers:
+        out.append("esp_err_t %s(void *e_conf_arg, void *run_arg);" % h)
+    out.append("")
+    out.append("#ifdef __cplusplus")
+    out.append("}")
+    out.append("#endif")
+    out.append("")
+    out.append("#endif /* OSH_NODE_FSM_TABLE_INC */")
+    return "\n".join(out) + "\n"
+
+
+def gen_source(states, events, slots, urgent):
+    order = sorted(slots, key=lambda k: (states[k[0]], events[k[1]]))
+    used_states = sorted(set(s for s, _ in order), key=lambda s: states[s])
+    used_events = sorted(set(e for _, e in order) | set(urgent), key=lambda e: events[e])
+
+    out = []
+    out.append("/* generated by tools/node_state.py, do not edit */")
+    out.append("")
+    out.append('#include "osh_node_fsm.inc"')
+    out.append('#include "%s"' % HEADER)
+    out.append("")
+    out.append("/* slots are ordered by these values, generate again if one changes */")
+    for s in used_states:
+        out.append('_Static_assert(%s == %d, "run tools/node_state.py");' % (s, states[s]))
+    for e in used_events:
+        out.append('_Static_assert(%s == %d, "run tools/node_state.py");' % (e, events[e]))
+    out.append("")
+
+    out.append("static const osh_node_fsm_row_t g_rows[OSH_FSM_STATE_BUTT] = {")
+    first = 0
+    for s in used_states:
+        evs = [e for st, e in order if st == s]
+        bits = " |\n                  ".join("((uint64_t)1 << %s)" % e for e in evs)
+        out.append("    [%s] = {" % s)
+        out.append("        .events = %s," % bits)
+        out.append("        .first = %d," % first)
+        out.append("    },")
+        first += len(evs)
+    out.append("};")
+    out.append("")
+
+    out.append("static const osh_node_fsm_slot_t g_slots[%d] = {" % len(order))
+    for s, e in order:
+        handler, dst = slots[(s, e)]
+        out.append("    {%s, NULL, %s},  // %s@%s" % (handler or "NULL", dst, e, s))
+    out.append("};")
+    out.append("")
+
+    out.append("const osh_node_fsm_table_t %s = {" % TABLE)
+    out.append("    .state_num = OSH_FSM_STATE_BUTT,")
+    out.append("    .slot_num = %d," % len(order))
+    out.append("    .rows = g_rows,")
+    out.append("    .slots = g_slots,")
+    bits = " |\n              ".join("((uint64_t)1 << %s)" % e
+                                     for e in sorted(urgent, key=lambda e: events[e]))
+    out.append("    .urgent = %s," % (bits or "0"))
+    out.append("};")
+    return "\n".join(out) + "\n"
+
+
+def render_svg(path):
+    from graphviz import Digraph
+
+    # Digraph
+    dot = Digraph()
+
+    # Nodes
+    dot.attr('node', shape='doublecircle')
+    for name, cstate in STATES:
+        dot.node(name, cstate)
+
+    # Edges
+    for src, _, dst, _, label in TRANSITIONS:
+        dot.edge(src, dst, label=label)
+
+    # Render and Save
+    dot.render(path, format="svg", cleanup=True)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="node FSM graph to SVG and C table")
+    parser.add_argument("-o", "--outdir", help="generate C table into this directory")
+    parser.add_argument("--stamp", help="file touched on each run, the build output")
+    parser.add_argument("--svg", action="store_true", help="render images/node_fsm.svg")
+    parser.add_argument("--check", action="store_true",
+                        help="fail if generated table is not up to date")
+    args = parser.parse_args()
+
+    try:
+        states, events, slots, urgent = load_graph()
+    except (OSError, GraphError) as e:
+        print("node_state: %s" % e, file=sys.stderr)
+        return 1
+
+    outputs = []
+    if args.outdir:
+        outputs = [
+            (os.path.join(args.outdir, HEADER), gen_header(slots)),
+            (os.path.join(args.outdir, SOURCE), gen_source(states, events, slots, urgent)),
+        ]
+        os.makedirs(args.outdir, exist_ok=True)
+    stale = []
+    for path, text in outputs:
+        old = None
+        if os.path.exists(path):
+            with open(path, "r", encoding="utf-8") as f:
+                old = f.read()
+        if old == text:
+            # keep timestamp so dependents are not rebuilt
+            continue
+        if args.check:
+            stale.append(path)
+            continue
+        with open(path, "w", encoding="utf-8") as f:
+            f.write(text)
+    if stale:
+        print("node_state: %s out of date, run tools/node_state.py" % ", ".join(stale),
+              file=sys.stderr)
+        return 1
+
+    if args.stamp:
+        # outputs keep their time when unchanged, stamp tells the run is done
+        with open(args.stamp, "w", encoding="utf-8"):
+            pass
+    if args.svg:
+        render_svg(os.path.join(COMPONENT, "images", "node_fsm"))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,128 @@
+#-*-coding:UTF-8-*-
+
+
+'''
+* @Author      : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+* @Date        : 2024-06-22 14:05:19
+* @LastEditors : kevin.z.y <kevin.cn.zhengyang@gmail.com>
+* @LastEditTime: 2024-06-22 15:48:22
+* @FilePath    : /OpenSmartHome/tools/res_pack.py
+* @Description : pack static resources into image of resource partition
+* @Copyright (c) 2024 by Zheng, Yang, All Rights Reserved.
+'''
+
+import argparse
+import json
+import os
+import struct
+import sys
+
+# same as osh_node_res.inc
+MAGIC = 0x5248534F
+VERSION = 1
+HEADER = struct.Struct("<IBBHII")
+RECORD = struct.Struct("<IIIIB3x")
+ALIGN = 4
+
+# content types of osh_node_proto_dataframe.h
+CONTENT_TYPES = {
+    "text": 0,
+    "html": 1,
+    "xml":  2,
+    "json": 3,
+    "octets": 4,
+    "mpeg": 5,
+    "jpeg": 6,
+    "svg":  7,
+    "mp4":  8,
+}
+
+
+class ManifestError(Exception):
+    pass
+
+
+def fnv1a(data):
+    # content tag, 0 is kept for unknown
+    h = 0x811C9DC5
+    for b in data:
+        h ^= b
+        h = (h * 0x01000193) & 0xFFFFFFFF
+    return h or 1
+
+
+def parse_u32(value, what):
+    try:
+        v = int(value, 0) if isinstance(value, str) else int(value)
+    except (TypeError, ValueError):
+        raise ManifestError("invalid %s %r" % (what, value))
+    if v < 0 or v > 0xFFFFFFFF:
+        raise ManifestError("%s 0x%x out of 32 bits" % (what, v))
+    return v
+
+
+def load_manifest(path):
+    with open(path, "r", encoding="utf-8") as f:
+        manifest = json.load(f)
+
+    base = os.path.dirname(os.path.abspath(path))
+    resources = []
+    seen = set()
+    for res in manifest.get("resources", []):
+        entry = parse_u32(res.get("entry"), "entry")
+        if entry in seen:
+            raise ManifestError("duplicated entry 0x%08X" % entry)
+        seen.add(entry)
+        ctype = res.get("type", "octets")
+        if ctype not in CONTENT_TYPES:
+            raise ManifestError("entry 0x%08X has unknown type %r" % (entry, ctype))
+        fpath = res.get("file")
+        if not isinstance(fpath, str):
+            raise ManifestError("entry 0x%08X has no file" % entry)
+        with open(os.path.join(base, fpath), "rb") as f:
+            data = f.read()
+        resources.append((entry, CONTENT_TYPES[ctype], data))
+    # node looks up by binary search
+    resources.sort(key=lambda r: r[0])
+    return resources
+
+
+def pack(resources):
+    offset = HEADER.size + RECORD.size * len(resources)
+    index = []
+    contents = []
+    for entry, ctype, data in resources:
+        pad = (-offset) % ALIGN
+        contents.append(b"\xff" * pad)
+        offset += pad
+        index.append(RECORD.pack(entry, offset, len(data), fnv1a(data), ctype))
+        contents.append(data)
+        offset += len(data)
+    header = HEADER.pack(MAGIC, VERSION, 0, len(resources), offset, 0)
+    return header + b"".join(index) + b"".join(contents)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="pack static resources into partition image")
+    parser.add_argument("manifest", help="JSON manifest of resources")
+    parser.add_argument("-o", "--output", default="res.bin", help="output image")
+    parser.add_argument("-s", "--size", default="0x100000", help="partition size")
+    args = parser.parse_args()
+
+    try:
+        resources = load_manifest(args.manifest)
+        image = pack(resources)
+        size = parse_u32(args.size, "size")
+        if len(image) > size:
+            raise ManifestError("image of %d bytes over partition of %d" % (len(image), size))
+    except (OSError, ValueError, ManifestError) as e:
+        print("%s: %s" % (args.manifest, e), file=sys.stderr)
+        return 1
+
+    with open(args.output, "wb") as f:
+        f.write(image)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())